@@ -0,0 +1,118 @@
+
+#include <chrono>
+
+#include "async_log_sink.h"
+
+namespace synkafka {
+
+namespace {
+
+// Backstop in case a wake up is ever missed, lines are only delayed by this at worst
+const std::chrono::milliseconds MaxWriterSleep(100);
+
+size_t round_up_power_of_2(size_t n)
+{
+    size_t p = 2;
+    while (p < n) {
+        p <<= 1;
+    }
+    return p;
+}
+
+}
+
+AsyncLogSink::AsyncLogSink(std::ostream& os, size_t queue_size)
+    : os_(os)
+    , q_(round_up_power_of_2(queue_size))
+    , dropped_(0)
+    , dropped_reported_(0)
+    , stopping_(false)
+    , waiting_(false)
+    , mu_()
+    , cv_()
+    , writer_()
+{
+    writer_ = std::thread(&AsyncLogSink::run, this);
+}
+
+AsyncLogSink::~AsyncLogSink()
+{
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        stopping_ = true;
+    }
+    cv_.notify_one();
+    writer_.join();
+}
+
+void AsyncLogSink::log(const spdlog::details::log_msg& msg)
+{
+    std::string line(msg.formatted.data(), msg.formatted.size());
+
+    if (!q_.enqueue(std::move(line))) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Pairs with the fence in run(): either we see the writer is going to sleep or it sees our line
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiting_.load(std::memory_order_relaxed)) {
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            waiting_.store(false, std::memory_order_relaxed);
+        }
+        cv_.notify_one();
+    }
+}
+
+void AsyncLogSink::run()
+{
+    while (!stopping_.load()) {
+        if (drain() > 0) {
+            continue;
+        }
+
+        // Announce we are going to sleep, then look again in case a line was queued
+        // before the logging thread could have seen that
+        waiting_.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (drain() > 0) {
+            waiting_.store(false, std::memory_order_relaxed);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lk(mu_);
+        cv_.wait_for(lk, MaxWriterSleep, [this]() {
+            return !waiting_.load(std::memory_order_relaxed) || stopping_.load();
+        });
+        waiting_.store(false, std::memory_order_relaxed);
+    }
+
+    // Flush whatever was logged before we were told to stop
+    drain();
+}
+
+size_t AsyncLogSink::drain()
+{
+    size_t written = 0;
+    std::string line;
+
+    while (q_.dequeue(line)) {
+        os_.write(line.data(), line.size());
+        ++written;
+    }
+
+    auto dropped = dropped_.load(std::memory_order_relaxed);
+    if (dropped != dropped_reported_) {
+        os_ << "[synkafka] log queue full, dropped " << (dropped - dropped_reported_) << " log messages" << std::endl;
+        dropped_reported_ = dropped;
+        ++written;
+    }
+
+    if (written > 0) {
+        os_.flush();
+    }
+
+    return written;
+}
+
+}
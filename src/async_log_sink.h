@@ -0,0 +1,54 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+
+#include <boost/core/noncopyable.hpp>
+
+#include "spdlog/sinks/sink.h"
+#include "spdlog/details/mpmc_bounded_q.h"
+
+namespace synkafka {
+
+// spdlog sink that hands formatted lines to a dedicated writer thread through a bounded
+// lock-free queue so that logging threads (in particular asio threads) never block on the
+// output stream. If the queue is full the line is dropped rather than waiting; drops are
+// counted and reported on the output stream by the writer once it catches up.
+// The writer sleeps on a condition variable while the queue is empty, logging threads only
+// take the lock to wake it when it is actually asleep.
+class AsyncLogSink : public spdlog::sinks::sink, private boost::noncopyable
+{
+public:
+    // queue_size is rounded up to a power of 2
+    AsyncLogSink(std::ostream& os, size_t queue_size);
+
+    // Writes any remaining queued lines before returning
+    ~AsyncLogSink();
+
+    void log(const spdlog::details::log_msg& msg) override;
+
+    // Total lines dropped because the queue was full
+    uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+    void run();
+
+    // Write everything currently queued, returns number of lines written
+    size_t drain();
+
+    std::ostream&                                       os_;
+    spdlog::details::mpmc_bounded_queue<std::string>    q_;
+    std::atomic<uint64_t>                               dropped_;
+    uint64_t                                            dropped_reported_; // only touched by writer thread
+    std::atomic<bool>                                   stopping_;
+    std::atomic<bool>                                   waiting_; // writer is (about to be) asleep on cv_
+    std::mutex                                          mu_;
+    std::condition_variable                             cv_;
+    std::thread                                         writer_;
+};
+
+}
@@ -1,7 +1,10 @@
+#include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <future>
 #include <string>
 #include <stdexcept>
+#include <thread>
 
 #include <boost/bind.hpp>
 
@@ -10,12 +13,24 @@
 
 namespace synkafka {
 
-Broker::Broker(boost::asio::io_service& io_service, std::string host, int32_t port, std::string client_id)
-    : client_id_(std::move(client_id))
+namespace {
+
+// How often a cancellable wait checks whether it has been cancelled
+const std::chrono::milliseconds CancelCheckInterval(10);
+
+}
+
+Broker::Broker(boost::asio::io_service& io_service, std::string host, int32_t port, std::string client_id
+              ,std::shared_ptr<BrokerMetrics> metrics)
+    : io_service_(io_service)
+    , client_id_(std::move(client_id))
+    , metrics_(metrics ? std::move(metrics) : std::make_shared<BrokerMetrics>())
     , identity_({0, host, port}) // intentionally copy host string again
     , conn_(io_service, std::move(host), port) // move it here
-    , send_q_(conn_, [this](std::unique_ptr<RPC> rpc){ recv_q_.push(std::move(rpc)); })
-    , recv_q_(conn_, nullptr)
+    , send_q_(conn_, [this](std::unique_ptr<RPC> rpc){ recv_q_.push(std::move(rpc)); }, metrics_)
+    , recv_q_(conn_, nullptr, metrics_)
+    , last_activity_(std::chrono::steady_clock::now().time_since_epoch().count())
+    , limiter_()
 {
 }
 
@@ -26,12 +41,38 @@ Broker::~Broker()
 
 void Broker::close()
 {
-     conn_.close();
+    conn_.close();
+
+    // Nobody waiting for a slot would get anywhere now
+    auto limiter = std::atomic_load(&limiter_);
+    if (limiter) {
+        limiter->close();
+    }
 }
 
-std::future<PacketDecoder> Broker::call(int16_t api_key, std::unique_ptr<PacketEncoder> request_packet)
+std::future<PacketDecoder> Broker::call(int16_t api_key, std::unique_ptr<PacketEncoder> request_packet, int16_t api_version
+                                       ,trace_context_t trace, ConcurrencySlot slot)
 {
-    auto rpc = std::unique_ptr<RPC>(new RPC(api_key, std::move(request_packet), client_id_));
+    last_activity_.store(std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+
+    if (slot.empty()) {
+        auto ec = acquire_slot(api_key, std::chrono::steady_clock::now(), slot, trace);
+        if (ec) {
+            std::promise<PacketDecoder> failed;
+            failed.set_exception(std::make_exception_ptr(ec));
+            return failed.get_future();
+        }
+    }
+
+    // Created after waiting for a slot so it's round trip doesn't include the wait
+    auto rpc = std::unique_ptr<RPC>(new RPC(api_key, std::move(request_packet), client_id_, api_version));
+    rpc->set_limiter(slot.take());
+
+    if (trace) {
+        trace->trace.broker_id = identity_.node_id;
+        trace->trace.api_key = api_key;
+        rpc->set_trace(std::move(trace));
+    }
 
     auto f = rpc->get_future();
 
@@ -40,6 +81,122 @@ std::future<PacketDecoder> Broker::call(int16_t api_key, std::unique_ptr<PacketE
     return f;
 }
 
+std::error_code Broker::acquire_slot(int16_t api_key, std::chrono::steady_clock::time_point deadline, ConcurrencySlot& slot
+                                    ,const trace_context_t& trace, const std::atomic<bool>* cancel)
+{
+    if (api_key != ApiKey::ProduceRequest) {
+        return std::error_code();
+    }
+
+    auto limiter = std::atomic_load(&limiter_);
+    if (!limiter) {
+        return std::error_code();
+    }
+
+    bool acquired = false;
+    if (cancel == nullptr) {
+        acquired = limiter->acquire(deadline);
+    } else {
+        // Wait in slices to notice a cancel, like wait_for_response()
+        for (;;) {
+            auto until = std::min(deadline, std::chrono::steady_clock::now() + CancelCheckInterval);
+            acquired = limiter->acquire(until);
+            if (acquired || until == deadline || is_closed()) {
+                break;
+            }
+            if (cancel->load()) {
+                return make_error_code(synkafka_error::client_stopping);
+            }
+        }
+    }
+
+    if (!acquired) {
+        auto ec = make_error_code(is_closed() ? synkafka_error::network_fail : synkafka_error::in_flight_limit);
+        if (trace) {
+            trace->trace.broker_id = identity_.node_id;
+            trace->trace.api_key = api_key;
+            trace->interceptor->on_error(trace->trace, ec);
+        }
+        return ec;
+    }
+
+    slot = ConcurrencySlot(std::move(limiter));
+    return std::error_code();
+}
+
+void Broker::set_adaptive_concurrency(int32_t initial_limit, int32_t max_limit)
+{
+    std::atomic_store(&limiter_, std::make_shared<ConcurrencyLimiter>(initial_limit, max_limit, metrics_));
+}
+
+int32_t Broker::remaining_ms(std::chrono::steady_clock::time_point deadline)
+{
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+    return static_cast<int32_t>(std::max<int64_t>(left.count(), 0));
+}
+
+std::future_status Broker::wait_for_response(std::future<PacketDecoder>& f, int32_t timeout_ms, const SyncWaitPolicy& wait_policy)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+
+    switch (wait_policy.mode)
+    {
+    case SyncWaitMode::Park:
+        break;
+
+    case SyncWaitMode::SpinThenPark:
+        {
+            auto spin_until = std::min(deadline, std::chrono::steady_clock::now() + std::chrono::microseconds(wait_policy.spin_us));
+            while (std::chrono::steady_clock::now() < spin_until) {
+                if (f.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+                    return std::future_status::ready;
+                }
+            }
+        }
+        break;
+
+    case SyncWaitMode::RunIOLoop:
+        {
+            // Same spin budget as SpinThenPark so a slow response doesn't burn a core until the
+            // deadline, after that park like any other waiter.
+            auto spin_until = std::min(deadline, std::chrono::steady_clock::now() + std::chrono::microseconds(wait_policy.spin_us));
+            while (std::chrono::steady_clock::now() < spin_until) {
+                if (f.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+                    return std::future_status::ready;
+                }
+                if (io_service_.poll_one() == 0) {
+                    // Nothing ready to run, don't starve asio threads that are doing the actual IO
+                    std::this_thread::yield();
+                }
+            }
+        }
+        break;
+    }
+
+    if (wait_policy.cancel == nullptr) {
+        return f.wait_until(deadline);
+    }
+
+    while (!wait_policy.cancel->load()) {
+        auto until = std::min(deadline, std::chrono::steady_clock::now() + CancelCheckInterval);
+        auto status = f.wait_until(until);
+        if (status == std::future_status::ready || until == deadline) {
+            return status;
+        }
+    }
+    return std::future_status::timeout;
+}
+
+void Broker::trace_timeout(const TraceContext& trace, const std::error_code& ec)
+{
+    RequestTrace t;
+    t.broker_id = trace.trace.broker_id;
+    t.api_key = trace.trace.api_key;
+    t.topic = trace.trace.topic;
+    t.partition_id = trace.trace.partition_id;
+    trace.interceptor->on_error(t, ec);
+}
+
 std::error_code Broker::connect()
 {
     auto boost_ec = conn_.connect();
@@ -53,5 +210,13 @@ std::error_code Broker::connect()
     return std::error_code();
 }
 
+void Broker::async_connect(std::function<void (std::error_code)> handler)
+{
+    conn_.async_connect([handler](error_code boost_ec) {
+        // Same mapping as connect()
+        handler(boost_ec ? make_error_code(synkafka_error::network_fail) : std::error_code());
+    });
+}
+
 
 }
\ No newline at end of file
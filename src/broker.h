@@ -1,5 +1,8 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <future>
 #include <memory>
 #include <mutex>
@@ -8,9 +11,12 @@
 #include <boost/bind.hpp>
 #include <boost/core/noncopyable.hpp>
 
+#include "concurrency_limiter.h"
 #include "connection.h"
+#include "interceptor.h"
 #include "protocol.h"
 #include "log.h"
+#include "metrics.h"
 #include "rpc.h"
 
 namespace synkafka {
@@ -18,6 +24,34 @@ namespace synkafka {
 using boost::asio::ip::tcp;
 using boost::system::error_code;
 
+// How a thread blocked in Broker::sync_call waits for it's response
+enum class SyncWaitMode
+{
+    // Block on the response future. Cheapest on CPU but each response costs a futex wake
+    // and scheduler hop from the asio thread to the caller.
+    Park,
+
+    // Busy-poll the response future for up to spin_us microseconds before blocking.
+    // Burns a core while spinning but responses arriving within the spin are picked up
+    // without a wake up.
+    SpinThenPark,
+
+    // Run ready asio handlers on the calling thread for up to spin_us microseconds, yielding
+    // when there is nothing to run, then block like Park. Only sensible with IOThreadMode::Shared
+    // where any thread may run handlers for any connection.
+    RunIOLoop,
+};
+
+struct SyncWaitPolicy
+{
+    SyncWaitMode                mode;
+    int32_t                     spin_us; // only used by SpinThenPark and RunIOLoop
+    // Optional, if set the wait gives up with synkafka_error::client_stopping soon after it becomes true.
+    // For callers that can't close the connection to fail their requests because others share it.
+    // Blocking is then done in short slices to check it, so leave it unset unless it's needed.
+    const std::atomic<bool>*    cancel;
+};
+
 /**
  * The main client interface for talking to a kafka broker
  */
@@ -25,28 +59,88 @@ class Broker : private boost::noncopyable
 {
 public:
     // Attempts to connect on startup
-    Broker(boost::asio::io_service& io_service, std::string host, int32_t port, std::string client_id);
+    // metrics is optional, if given all traffic on this broker's connection is counted there.
+    Broker(boost::asio::io_service& io_service, std::string host, int32_t port, std::string client_id
+          ,std::shared_ptr<BrokerMetrics> metrics = nullptr);
     ~Broker();
 
-    std::future<PacketDecoder> call(int16_t api_key, std::unique_ptr<PacketEncoder> request_packet);
-
+    // trace is optional, if given the request is reported to it's interceptor at each step (see interceptor.h).
+    // We fill in the broker id and api key.
+    // With adaptive concurrency enabled produce requests use slot (see acquire_slot()), or if it's empty
+    // take one only if it's free straight away, failing with synkafka_error::in_flight_limit otherwise.
+    std::future<PacketDecoder> call(int16_t api_key, std::unique_ptr<PacketEncoder> request_packet, int16_t api_version = KafkaApiVersion
+                                   ,trace_context_t trace = nullptr, ConcurrencySlot slot = ConcurrencySlot());
+
+    // With adaptive concurrency enabled produce requests need a slot on this connection, wait until
+    // deadline for one to come free, failing with synkafka_error::in_flight_limit if none does (or
+    // network_fail if we're closed meanwhile). Other requests (or any without adaptive concurrency)
+    // don't, slot is left empty. cancel works like SyncWaitPolicy::cancel.
+    std::error_code acquire_slot(int16_t api_key, std::chrono::steady_clock::time_point deadline, ConcurrencySlot& slot
+                                ,const trace_context_t& trace = nullptr, const std::atomic<bool>* cancel = nullptr);
+
+    // timeout_ms covers both waiting for a concurrency slot and for the response
     template<typename RequestType, typename ResponseType>
-    std::error_code sync_call(RequestType& request, ResponseType& resp, int32_t timeout_ms)
+    std::error_code sync_call(RequestType& request, ResponseType& resp, int32_t timeout_ms
+                             ,SyncWaitPolicy wait_policy = SyncWaitPolicy{SyncWaitMode::Park, 0, nullptr}
+                             ,const trace_context_t& trace = nullptr)
+    {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+
+        ConcurrencySlot slot;
+        auto ec = acquire_slot(RequestType::api_key, deadline, slot, trace, wait_policy.cancel);
+        if (ec) {
+            return ec;
+        }
+
+        std::future<PacketDecoder> decoder_future;
+
+        ec = start_call(request, decoder_future, trace, std::move(slot));
+        if (ec) {
+            return ec;
+        }
+
+        return finish_call(decoder_future, resp, remaining_ms(deadline), wait_policy, trace);
+    }
+
+    // The two halves of sync_call(). start_call() encodes the request and queues it to be sent, so
+    // requests started from one thread (or under a lock) are sent in that order. finish_call() waits
+    // for and decodes the response. slot is passed on to call(), acquire it first so that the wait
+    // for it doesn't hold up whatever is keeping requests in order.
+    // Both must be given the same trace context (if any)
+    template<typename RequestType>
+    std::error_code start_call(RequestType& request, std::future<PacketDecoder>& decoder_future
+                              ,const trace_context_t& trace = nullptr, ConcurrencySlot slot = ConcurrencySlot())
     {
         auto enc = std::unique_ptr<PacketEncoder>(new PacketEncoder(512));
         enc->io(request);
 
         if (!enc->ok()) {
-            log()->error("Failed to encode request: ") << enc->err_str();
+            SYNKAFKA_LOG_ERROR("Failed to encode request: ") << enc->err_str();
             return make_error_code(synkafka_error::encoding_error);
         }
 
-        auto decoder_future = call(RequestType::api_key, std::move(enc));
+        decoder_future = call(RequestType::api_key, std::move(enc), RequestType::api_version, trace, std::move(slot));
+
+        return make_error_code(synkafka_error::no_error);
+    }
 
-        auto status = decoder_future.wait_for(std::chrono::milliseconds(timeout_ms));
+    template<typename ResponseType>
+    std::error_code finish_call(std::future<PacketDecoder>& decoder_future, ResponseType& resp, int32_t timeout_ms
+                               ,SyncWaitPolicy wait_policy = SyncWaitPolicy{SyncWaitMode::Park, 0, nullptr}
+                               ,const trace_context_t& trace = nullptr)
+    {
+        auto status = wait_for_response(decoder_future, timeout_ms, wait_policy);
 
         if (status != std::future_status::ready) {
-            return make_error_code(synkafka_error::network_timeout);
+            if (wait_policy.cancel != nullptr && wait_policy.cancel->load()) {
+                // The request is left to finish (or time out) on it's own
+                return make_error_code(synkafka_error::client_stopping);
+            }
+            auto ec = make_error_code(synkafka_error::network_timeout);
+            if (trace) {
+                trace_timeout(*trace, ec);
+            }
+            return ec;
         } else {
             // OK we got a result, decode it
             try
@@ -55,28 +149,36 @@ public:
                 decoder.io(resp);
 
                 if (!decoder.ok()) {
-                    log()->error("Failed to decode packet: ") << decoder.err_str();
-                    return make_error_code(synkafka_error::decoding_error);
+                    SYNKAFKA_LOG_ERROR("Failed to decode packet: ") << decoder.err_str();
+                    auto ec = make_error_code(synkafka_error::decoding_error);
+                    if (trace) {
+                        trace->interceptor->on_error(trace->trace, ec);
+                    }
+                    return ec;
+                }
+
+                if (trace) {
+                    trace->interceptor->on_decoded(trace->trace);
                 }
             }
             catch (const std::error_code& errc)
             {
-                log()->error("Failed sync_call with error_code: ") << errc.message();
+                SYNKAFKA_LOG_ERROR("Failed sync_call with error_code: ") << errc.message();
                 return errc;
             }
             catch (const std::future_error& e)
             {
-                log()->error("Failed sync_call with future_error: ") << e.code().message();
+                SYNKAFKA_LOG_ERROR("Failed sync_call with future_error: ") << e.code().message();
                 return e.code();
             }
             catch (const std::exception& e)
             {
-                log()->error("Failed sync_call with exception: ") << e.what();
+                SYNKAFKA_LOG_ERROR("Failed sync_call with exception: ") << e.what();
                 return make_error_code(synkafka_error::unknown);
             }
             catch (...)
             {
-                log()->error("Failed sync_call with unknown exception");
+                SYNKAFKA_LOG_ERROR("Failed sync_call with unknown exception");
                 return make_error_code(synkafka_error::unknown);
             }
         }
@@ -89,23 +191,62 @@ public:
 
     void set_node_id(int32_t node_id) { identity_.node_id = node_id; }
     void set_connect_timeout(int32_t milliseconds) { conn_.set_timeout(milliseconds); }
+    void set_socket_options(const SocketOptions& opts) { conn_.set_socket_options(opts); }
+
+    // Limit the produce requests pipelined on this connection with a ConcurrencyLimiter that adapts
+    // to their round trip times (see concurrency_limiter.h), starting at initial_limit. The limit is
+    // reported in our metrics' concurrency_limit.
+    // Safe to call while in use, requests already in flight count against the old limiter.
+    void set_adaptive_concurrency(int32_t initial_limit, int32_t max_limit);
+    bool has_adaptive_concurrency() const { return std::atomic_load(&limiter_) != nullptr; }
 
     // Blocking, thread-safe call.
     // Must be called OUTSIDE asio thread
     std::error_code connect();
 
+    // Non-blocking connect, safe to call from asio threads. handler runs on the connection's
+    // strand with the same errors connect() would return. There is no need to wait for it before
+    // call()ing, requests made while connecting are sent as soon as the connection is up.
+    void async_connect(std::function<void (std::error_code)> handler);
+
     bool is_connected() const { return conn_.is_connected(); }
     bool is_closed() const { return conn_.is_closed(); }
 
+    // Requests queued to send or waiting for a response
+    int64_t outstanding_requests() const { return metrics_->send_queue_depth.value() + metrics_->recv_queue_depth.value(); }
+
+    // Moving average of request latency in microseconds, from call() to response so it includes time
+    // spent queued. 0 until the first response.
+    int64_t latency_ewma_us() const { return metrics_->latency_ewma_us.value(); }
+
+    // When a request was last made through call() (or since construction if none has been), used to
+    // spot idle connections
+    std::chrono::steady_clock::time_point last_activity() const
+    {
+        return std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(last_activity_.load(std::memory_order_relaxed)));
+    }
+
     const proto::Broker& get_config() const { return identity_; }
 
+    // Milliseconds left until deadline, 0 if it has passed. For finish_call() timeouts
+    static int32_t remaining_ms(std::chrono::steady_clock::time_point deadline);
+
 private:
 
+    std::future_status wait_for_response(std::future<PacketDecoder>& f, int32_t timeout_ms, const SyncWaitPolicy& wait_policy);
+
+    // The RPC may still be using the trace when we time out so report a copy of just the parts set before it was queued
+    static void trace_timeout(const TraceContext& trace, const std::error_code& ec);
+
+    boost::asio::io_service&    io_service_;
     std::string     client_id_;
+    std::shared_ptr<BrokerMetrics> metrics_; // our own if none was given, to track outstanding work
     proto::Broker   identity_;
     Connection      conn_;
     RPCSendQueue    send_q_;
     RPCRecvQueue    recv_q_;
+    std::atomic<std::chrono::steady_clock::rep> last_activity_; // steady_clock ticks
+    std::shared_ptr<ConcurrencyLimiter> limiter_; // null unless enabled, only accessed with std::atomic_load/store
 };
 
 }
\ No newline at end of file
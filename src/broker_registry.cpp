@@ -0,0 +1,64 @@
+
+#include <tuple>
+
+#include "broker_registry.h"
+
+namespace synkafka {
+
+bool BrokerRegistry::Key::operator<(const Key& other) const
+{
+    return std::tie(io_service, host, port, client_id)
+        < std::tie(other.io_service, other.host, other.port, other.client_id);
+}
+
+BrokerRegistry& BrokerRegistry::instance()
+{
+    static BrokerRegistry registry;
+    return registry;
+}
+
+std::shared_ptr<Broker> BrokerRegistry::get(boost::asio::io_service& io_service
+                                           ,const std::string& host
+                                           ,int32_t port
+                                           ,const std::string& client_id
+                                           ,std::shared_ptr<BrokerMetrics> metrics
+                                           )
+{
+    std::lock_guard<std::mutex> lk(mu_);
+
+    auto& entry = brokers_[Key{&io_service, host, port, client_id}];
+
+    auto broker = entry.lock();
+    if (broker != nullptr && !broker->is_closed()) {
+        return broker;
+    }
+
+    broker = std::make_shared<Broker>(io_service, host, port, client_id, std::move(metrics));
+    entry = broker;
+
+    // Only new connections can leave stale entries behind so this is a good time to tidy up
+    remove_expired();
+
+    return broker;
+}
+
+size_t BrokerRegistry::size()
+{
+    std::lock_guard<std::mutex> lk(mu_);
+    remove_expired();
+    return brokers_.size();
+}
+
+// Caller MUST hold lock on mu_
+void BrokerRegistry::remove_expired()
+{
+    for (auto it = brokers_.begin(); it != brokers_.end(); ) {
+        if (it->second.expired()) {
+            it = brokers_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+}
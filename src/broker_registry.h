@@ -0,0 +1,59 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <boost/asio.hpp>
+#include <boost/core/noncopyable.hpp>
+
+#include "broker.h"
+#include "metrics.h"
+
+namespace synkafka {
+
+// Process wide registry of broker connections so that several ProducerClients running on the
+// same io_service can multiplex their requests over one socket per broker rather than each
+// opening their own.
+// A broker's host:port identifies the cluster it belongs to so entries are keyed by that along
+// with the io_service and client_id (which is sent in every request header).
+// The registry only holds weak references: a connection lives exactly as long as at least one
+// client is still using it.
+class BrokerRegistry : private boost::noncopyable
+{
+public:
+    static BrokerRegistry& instance();
+
+    // Return the registered broker for host:port if it's still open, otherwise create and register
+    // a new one. metrics is only used when a new broker is created, so a shared connection's traffic
+    // is counted by whichever client created it.
+    std::shared_ptr<Broker> get(boost::asio::io_service& io_service
+                               ,const std::string& host
+                               ,int32_t port
+                               ,const std::string& client_id
+                               ,std::shared_ptr<BrokerMetrics> metrics
+                               );
+
+    // Number of registered brokers still in use by some client
+    size_t size();
+
+private:
+    struct Key
+    {
+        boost::asio::io_service*    io_service;
+        std::string                 host;
+        int32_t                     port;
+        std::string                 client_id;
+
+        bool operator<(const Key& other) const;
+    };
+
+    // Caller MUST hold lock on mu_
+    void remove_expired();
+
+    std::mutex                                  mu_;
+    std::map<Key, std::weak_ptr<Broker>>        brokers_;
+};
+
+}
@@ -0,0 +1,124 @@
+
+#include <algorithm>
+
+#include "buffer_pool.h"
+
+namespace synkafka {
+
+const size_t ResponseBufferPool::MinBufferSize;
+const size_t ResponseBufferPool::MaxPooledSize;
+const size_t ResponseBufferPool::MaxIdlePerClass;
+const int16_t ResponseBufferPool::MaxApiKey;
+
+ResponseBufferPool& ResponseBufferPool::instance()
+{
+    static ResponseBufferPool pool;
+    return pool;
+}
+
+ResponseBufferPool::ResponseBufferPool()
+    : expected_()
+    , free_(std::make_shared<FreeLists>())
+{
+    for (auto& e : expected_) {
+        e.store(MinBufferSize, std::memory_order_relaxed);
+    }
+    free_->classes.resize(class_for(MaxPooledSize) + 1);
+}
+
+ResponseBufferPool::FreeLists::~FreeLists()
+{
+    for (auto& c : classes) {
+        for (auto b : c) {
+            delete b;
+        }
+    }
+}
+
+void ResponseBufferPool::FreeLists::release(buffer_t* buffer)
+{
+    // Buffers may have been grown by the reader, file them by what they can hold now
+    if (buffer->size() <= MaxPooledSize) {
+        std::lock_guard<std::mutex> lk(mu);
+        auto& c = classes[class_for(buffer->size() + 1) - 1];
+        if (c.size() < MaxIdlePerClass) {
+            c.push_back(buffer);
+            return;
+        }
+    }
+    delete buffer;
+}
+
+size_t ResponseBufferPool::class_for(size_t size)
+{
+    // Smallest n with 2^n >= size
+    size_t n = 0;
+    while ((static_cast<size_t>(1) << n) < size) {
+        ++n;
+    }
+    return n;
+}
+
+shared_buffer_t ResponseBufferPool::acquire(int16_t api_key)
+{
+    auto cls = class_for(size_for(api_key));
+    buffer_t* buffer = nullptr;
+
+    {
+        // A slightly bigger idle buffer is better than allocating, but don't tie up a huge one
+        std::lock_guard<std::mutex> lk(free_->mu);
+        for (auto i = cls; i < free_->classes.size() && i <= cls + 2; ++i) {
+            auto& c = free_->classes[i];
+            if (!c.empty()) {
+                buffer = c.back();
+                c.pop_back();
+                break;
+            }
+        }
+    }
+
+    if (buffer == nullptr) {
+        buffer = new buffer_t(static_cast<size_t>(1) << cls);
+    }
+
+    auto lists = free_;
+    return shared_buffer_t(buffer, [lists](buffer_t* b) { lists->release(b); });
+}
+
+void ResponseBufferPool::record(int16_t api_key, size_t response_size)
+{
+    if (api_key < 0 || api_key >= MaxApiKey) {
+        return;
+    }
+
+    auto& expected = expected_[api_key];
+    auto current = expected.load(std::memory_order_relaxed);
+
+    // Jump straight up to anything bigger so the next one fits, drift down slowly so an occasional
+    // small response doesn't undo that. Races between threads only lose an update, which is fine.
+    size_t next = response_size >= current
+        ? response_size
+        : current - (current - response_size) / 16;
+
+    expected.store(std::max(next, MinBufferSize), std::memory_order_relaxed);
+}
+
+size_t ResponseBufferPool::size_for(int16_t api_key) const
+{
+    if (api_key < 0 || api_key >= MaxApiKey) {
+        return MinBufferSize;
+    }
+    return static_cast<size_t>(1) << class_for(expected_[api_key].load(std::memory_order_relaxed));
+}
+
+size_t ResponseBufferPool::idle_buffers() const
+{
+    std::lock_guard<std::mutex> lk(free_->mu);
+    size_t n = 0;
+    for (auto& c : free_->classes) {
+        n += c.size();
+    }
+    return n;
+}
+
+}
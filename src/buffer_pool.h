@@ -0,0 +1,68 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <boost/core/noncopyable.hpp>
+
+#include "buffer.h"
+
+namespace synkafka {
+
+// Process wide pool of response buffers, sized per API key from the responses actually seen.
+// Produce responses are tiny while metadata responses for a big cluster can be hundreds of KB,
+// so rather than starting every response in a 1KB buffer and growing it (zero filling as it goes)
+// each API key tracks a typical response size that grows straight to the largest seen and decays
+// slowly. Buffers are handed out in power of 2 size classes and go back to the pool when the last
+// reference to them is dropped.
+class ResponseBufferPool : private boost::noncopyable
+{
+public:
+    static ResponseBufferPool& instance();
+
+    ResponseBufferPool();
+
+    // Get a buffer expected to fit a response to api_key. It's size() is at least the expected size,
+    // all of it usable without resizing.
+    shared_buffer_t acquire(int16_t api_key);
+
+    // Tell the pool how big a response to api_key actually was
+    void record(int16_t api_key, size_t response_size);
+
+    // Current buffer size acquire() would hand out for api_key
+    size_t size_for(int16_t api_key) const;
+
+    // Buffers currently idle in the pool, mostly for testing
+    size_t idle_buffers() const;
+
+    static const size_t MinBufferSize   = 1024;
+    // Bigger buffers are freed rather than kept
+    static const size_t MaxPooledSize   = 16 * 1024 * 1024;
+    static const size_t MaxIdlePerClass = 16;
+    // Responses to api keys outside this range get MinBufferSize buffers and aren't tracked
+    static const int16_t MaxApiKey      = 64;
+
+private:
+    // Free lists outlive the pool object itself since buffers can still be in use (and return to it)
+    // while static destructors run
+    struct FreeLists
+    {
+        std::mutex                          mu;
+        std::vector<std::vector<buffer_t*>> classes; // indexed by log2 of size
+
+        ~FreeLists();
+        void release(buffer_t* buffer);
+    };
+
+    static size_t class_for(size_t size);
+
+    std::array<std::atomic<size_t>, MaxApiKey>  expected_;
+    std::shared_ptr<FreeLists>                  free_;
+};
+
+}
@@ -0,0 +1,72 @@
+
+#include <algorithm>
+
+#include "circuit_breaker.h"
+
+namespace synkafka {
+
+CircuitBreaker::CircuitBreaker(int32_t initial_backoff_ms, int32_t max_backoff_ms)
+    : mu_()
+    , initial_backoff_(initial_backoff_ms)
+    , max_backoff_(max_backoff_ms)
+    , failures_(0)
+    , retry_at_()
+    , probing_(false)
+{}
+
+void CircuitBreaker::set_backoff(int32_t initial_backoff_ms, int32_t max_backoff_ms)
+{
+    std::lock_guard<std::mutex> lk(mu_);
+    initial_backoff_ = std::chrono::milliseconds(initial_backoff_ms);
+    max_backoff_ = std::chrono::milliseconds(max_backoff_ms);
+}
+
+bool CircuitBreaker::allow(bool& start_probe)
+{
+    start_probe = false;
+
+    std::lock_guard<std::mutex> lk(mu_);
+
+    if (failures_ == 0 || initial_backoff_.count() <= 0) {
+        return true;
+    }
+
+    if (!probing_ && clock_t::now() >= retry_at_) {
+        probing_ = true;
+        start_probe = true;
+    }
+    return false;
+}
+
+void CircuitBreaker::record_success()
+{
+    std::lock_guard<std::mutex> lk(mu_);
+    failures_ = 0;
+    probing_ = false;
+}
+
+void CircuitBreaker::record_failure()
+{
+    std::lock_guard<std::mutex> lk(mu_);
+
+    ++failures_;
+    probing_ = false;
+
+    // Double per failure, stopping before the shift could overflow
+    auto backoff = initial_backoff_ * (1ll << std::min(failures_ - 1, 30));
+    retry_at_ = clock_t::now() + std::min<std::chrono::milliseconds>(backoff, std::max(max_backoff_, initial_backoff_));
+}
+
+int32_t CircuitBreaker::failures() const
+{
+    std::lock_guard<std::mutex> lk(mu_);
+    return failures_;
+}
+
+bool CircuitBreaker::is_open() const
+{
+    std::lock_guard<std::mutex> lk(mu_);
+    return failures_ > 0 && initial_backoff_.count() > 0;
+}
+
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+#include <boost/core/noncopyable.hpp>
+
+namespace synkafka {
+
+// Tracks whether a broker is worth trying to reach. Each failure (in a row) opens the breaker
+// for twice as long as the last, up to a maximum, and while it's open requests should fail
+// straight away rather than each waiting out a connect timeout. Once the backoff has passed one
+// caller is told to probe the broker; the breaker stays open until that probe reports back,
+// closing on success and backing off further on failure.
+// An initial backoff of 0 disables it, it never opens.
+class CircuitBreaker : private boost::noncopyable
+{
+public:
+    CircuitBreaker(int32_t initial_backoff_ms, int32_t max_backoff_ms);
+
+    void set_backoff(int32_t initial_backoff_ms, int32_t max_backoff_ms);
+
+    // Returns true if requests may go to the broker. Otherwise start_probe is set (for only
+    // one caller per backoff period) when it's time to find out if the broker is back.
+    bool allow(bool& start_probe);
+
+    void record_success();
+    void record_failure();
+
+    // Failures since the last success
+    int32_t failures() const;
+    bool is_open() const;
+
+private:
+    typedef std::chrono::steady_clock clock_t;
+
+    mutable std::mutex          mu_;
+    std::chrono::milliseconds   initial_backoff_;
+    std::chrono::milliseconds   max_backoff_;
+    int32_t                     failures_;
+    clock_t::time_point         retry_at_; // when the next probe is due, only meaningful while open
+    bool                        probing_;
+};
+
+}
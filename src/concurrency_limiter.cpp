@@ -0,0 +1,144 @@
+
+#include <algorithm>
+#include <limits>
+
+#include "concurrency_limiter.h"
+
+namespace synkafka {
+
+namespace {
+
+const double BackoffRatio = 0.9;
+
+}
+
+const int32_t ConcurrencyLimiter::MinLimit;
+const int32_t ConcurrencyLimiter::LatencyTolerance;
+const int32_t ConcurrencyLimiter::BaselineWindow;
+
+ConcurrencySlot::ConcurrencySlot(ConcurrencySlot&& other)
+    : limiter_(std::move(other.limiter_))
+{}
+
+ConcurrencySlot& ConcurrencySlot::operator=(ConcurrencySlot&& other)
+{
+    if (this != &other) {
+        release();
+        limiter_ = std::move(other.limiter_);
+    }
+    return *this;
+}
+
+void ConcurrencySlot::release()
+{
+    if (limiter_) {
+        limiter_->cancel();
+        limiter_.reset();
+    }
+}
+
+ConcurrencyLimiter::ConcurrencyLimiter(int32_t initial_limit, int32_t max_limit, std::shared_ptr<BrokerMetrics> metrics)
+    : mu_()
+    , cv_()
+    , limit_(0)
+    , max_limit_(std::max(max_limit, MinLimit))
+    , in_flight_(0)
+    , closed_(false)
+    , baseline_rtt_us_(0)
+    , window_min_rtt_us_(std::numeric_limits<int64_t>::max())
+    , window_samples_(0)
+    , metrics_(std::move(metrics))
+{
+    std::lock_guard<std::mutex> lk(mu_);
+    set_limit(initial_limit);
+}
+
+bool ConcurrencyLimiter::acquire(std::chrono::steady_clock::time_point deadline)
+{
+    std::unique_lock<std::mutex> lk(mu_);
+
+    if (!cv_.wait_until(lk, deadline, [this]() { return closed_ || in_flight_ < static_cast<int32_t>(limit_); })
+        || closed_) {
+        return false;
+    }
+
+    ++in_flight_;
+    return true;
+}
+
+void ConcurrencyLimiter::release(std::chrono::microseconds rtt, bool dropped)
+{
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+
+        // Whether we were using enough of the limit for this response to say anything about raising it
+        bool limited = in_flight_ * 2 >= limit_;
+        --in_flight_;
+
+        if (dropped) {
+            set_limit(limit_ * BackoffRatio);
+        } else {
+            auto us = rtt.count();
+
+            window_min_rtt_us_ = std::min(window_min_rtt_us_, us);
+            if (++window_samples_ >= BaselineWindow) {
+                baseline_rtt_us_ = window_min_rtt_us_;
+                window_min_rtt_us_ = std::numeric_limits<int64_t>::max();
+                window_samples_ = 0;
+            }
+            if (baseline_rtt_us_ == 0 || us < baseline_rtt_us_) {
+                baseline_rtt_us_ = std::max<int64_t>(us, 1);
+            }
+
+            if (us > baseline_rtt_us_ * LatencyTolerance) {
+                set_limit(limit_ * BackoffRatio);
+            } else if (limited) {
+                set_limit(limit_ + 1);
+            }
+        }
+    }
+
+    // The limit may have gone up as well as the slot coming free
+    cv_.notify_all();
+}
+
+void ConcurrencyLimiter::cancel()
+{
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        --in_flight_;
+    }
+    cv_.notify_one();
+}
+
+void ConcurrencyLimiter::close()
+{
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        closed_ = true;
+    }
+    cv_.notify_all();
+}
+
+int32_t ConcurrencyLimiter::limit() const
+{
+    std::lock_guard<std::mutex> lk(mu_);
+    return static_cast<int32_t>(limit_);
+}
+
+int32_t ConcurrencyLimiter::in_flight() const
+{
+    std::lock_guard<std::mutex> lk(mu_);
+    return in_flight_;
+}
+
+void ConcurrencyLimiter::set_limit(double limit)
+{
+    limit_ = std::min(std::max(limit, static_cast<double>(MinLimit)), static_cast<double>(max_limit_));
+
+    if (metrics_) {
+        metrics_->concurrency_limit.set(static_cast<int64_t>(limit_));
+    }
+}
+
+}
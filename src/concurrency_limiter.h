@@ -0,0 +1,91 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+#include <boost/core/noncopyable.hpp>
+
+#include "metrics.h"
+
+namespace synkafka {
+
+class ConcurrencyLimiter;
+
+// A slot acquired from a ConcurrencyLimiter that no request is using yet. Given back without
+// affecting the limit when destroyed or release()d, unless take()n by a request first.
+// Move only so that ownership of the slot is always clear.
+class ConcurrencySlot : private boost::noncopyable
+{
+public:
+    ConcurrencySlot() : limiter_() {}
+    // limiter must already have been acquire()d from
+    explicit ConcurrencySlot(std::shared_ptr<ConcurrencyLimiter> limiter) : limiter_(std::move(limiter)) {}
+    ConcurrencySlot(ConcurrencySlot&& other);
+    ConcurrencySlot& operator=(ConcurrencySlot&& other);
+    ~ConcurrencySlot() { release(); }
+
+    bool empty() const { return limiter_ == nullptr; }
+    void release();
+
+    // Hand the slot over to a request, which must release() it to the limiter with it's round trip time
+    std::shared_ptr<ConcurrencyLimiter> take() { return std::move(limiter_); }
+
+private:
+    std::shared_ptr<ConcurrencyLimiter> limiter_;
+};
+
+// Adaptive limit on how many requests may be in flight on one broker connection at once (AIMD).
+// Every response adds one to the limit while we are using at least half of it, and any response
+// that took much longer than the quickest recently seen (or any request that failed) takes a
+// tenth off. So the limit grows while pipelining more is free, and backs off as soon as requests
+// start queueing up in front of the broker rather than being handled.
+class ConcurrencyLimiter : private boost::noncopyable
+{
+public:
+    // metrics is optional, if given the current limit is kept in it's concurrency_limit gauge.
+    ConcurrencyLimiter(int32_t initial_limit, int32_t max_limit, std::shared_ptr<BrokerMetrics> metrics = nullptr);
+
+    // Take a slot, waiting until deadline for one to come free. false if none did or we're closed
+    bool acquire(std::chrono::steady_clock::time_point deadline);
+
+    // Give a slot back with the request's round trip time. dropped means it failed
+    void release(std::chrono::microseconds rtt, bool dropped);
+
+    // Give back a slot that was never used for a request, the limit is left as it is
+    void cancel();
+
+    // Fail all current and future acquire()s, for when the connection is closed
+    void close();
+
+    int32_t limit() const;
+    int32_t in_flight() const;
+
+    static const int32_t MinLimit = 1;
+
+    // Responses more than this many times slower than the baseline count as queueing
+    static const int32_t LatencyTolerance = 2;
+
+    // Baseline is the quickest response in the last this many, so it follows the broker
+    // if it gets permanently slower
+    static const int32_t BaselineWindow = 256;
+
+private:
+    // Caller MUST hold lock on mu_
+    void set_limit(double limit);
+
+    mutable std::mutex              mu_;
+    std::condition_variable         cv_;
+    double                          limit_;
+    int32_t                         max_limit_;
+    int32_t                         in_flight_;
+    bool                            closed_;
+    int64_t                         baseline_rtt_us_; // 0 until first response
+    int64_t                         window_min_rtt_us_;
+    int32_t                         window_samples_;
+    std::shared_ptr<BrokerMetrics>  metrics_;
+};
+
+}
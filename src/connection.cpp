@@ -1,7 +1,17 @@
-#include <boost/bind.hpp>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <functional>
+
+#ifdef __linux__
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#endif
 
 #include "connection.h"
 #include "log.h"
+#include "resolver_cache.h"
 
 namespace errc = boost::system::errc;
 
@@ -13,11 +23,16 @@ Connection::impl::impl(boost::asio::io_service& io_service, std::string host, in
     , socket_(io_service)
     , strand_(io_service)
     , resolver_(io_service)
+    , endpoints_()
+    , endpoint_idx_(0)
     , timeout_ms_(1000)
+    , socket_options_()
     , mu_()
     , cv_()
     , state_(STATE_INIT)
     , ec_()
+    , connect_handlers_()
+    , connect_timer_(io_service)
 {}
 
 error_code Connection::impl::close(error_code ec, bool lock_held)
@@ -34,9 +49,9 @@ error_code Connection::impl::close(error_code ec, bool lock_held)
     }
 
     if (ec) {
-        log()->warn() << "Connection to " << dns_query_ << " closed with error: " << ec.message();
+        SYNKAFKA_LOG_WARN() << "Connection to " << dns_query_ << " closed with error: " << ec.message();
     } else {
-        log()->debug() << "Connection to " << dns_query_ << " closed";
+        SYNKAFKA_LOG_DEBUG() << "Connection to " << dns_query_ << " closed";
         // Must set an error otherwise other threads waiting on connect will just see ec_ is not
         // an error and assume that connection is fine.
         ec = make_error_code(boost::system::errc::connection_aborted);
@@ -46,6 +61,7 @@ error_code Connection::impl::close(error_code ec, bool lock_held)
 
     if (state_ == STATE_INIT) {
         state_ = STATE_CLOSED;
+        complete_connect_handlers(ec_);
         return ec;
     }
 
@@ -57,12 +73,77 @@ error_code Connection::impl::close(error_code ec, bool lock_held)
     // but we don't care, saves us allocating another one on stack we don't care about
     socket_.close(ec);
 
+    connect_timer_.cancel(ec);
+
     // Wake up any threads waiting to connect...
     cv_.notify_all();
+    complete_connect_handlers(ec_);
 
     return ec_;
 }
 
+void Connection::impl::complete_connect_handlers(error_code ec)
+{
+    // Posted rather than called so handlers never run under mu_ or re-enter whoever closed us
+    for (auto& handler : connect_handlers_) {
+        strand_.post(std::bind(std::move(handler), ec));
+    }
+    connect_handlers_.clear();
+}
+
+void Connection::impl::open_socket(const tcp::endpoint& endpoint, error_code& ec)
+{
+    socket_.open(endpoint.protocol(), ec);
+    if (ec) {
+        return;
+    }
+
+    // Buffer sizes are only hints to the OS so failing to set them is not fatal
+    error_code opt_ec;
+
+    if (socket_options_.send_buffer_bytes > 0) {
+        socket_.set_option(tcp::socket::send_buffer_size(socket_options_.send_buffer_bytes), opt_ec);
+        if (opt_ec) {
+            SYNKAFKA_LOG_WARN() << "Connection to " << dns_query_ << " failed to set send buffer size: " << opt_ec.message();
+        }
+    }
+
+    if (socket_options_.receive_buffer_bytes > 0) {
+        socket_.set_option(tcp::socket::receive_buffer_size(socket_options_.receive_buffer_bytes), opt_ec);
+        if (opt_ec) {
+            SYNKAFKA_LOG_WARN() << "Connection to " << dns_query_ << " failed to set receive buffer size: " << opt_ec.message();
+        }
+    }
+}
+
+void Connection::impl::tune_connected_socket()
+{
+    error_code ec;
+
+    if (socket_options_.no_delay) {
+        socket_.set_option(tcp::no_delay(true), ec);
+        if (ec) {
+            SYNKAFKA_LOG_WARN() << "Connection to " << dns_query_ << " failed to set TCP_NODELAY: " << ec.message();
+        }
+    }
+
+    if (socket_options_.keep_alive) {
+        socket_.set_option(boost::asio::socket_base::keep_alive(true), ec);
+        if (ec) {
+            SYNKAFKA_LOG_WARN() << "Connection to " << dns_query_ << " failed to set SO_KEEPALIVE: " << ec.message();
+        }
+    }
+
+#ifdef TCP_QUICKACK
+    if (socket_options_.quick_ack) {
+        int one = 1;
+        if (::setsockopt(socket_.native_handle(), IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one)) != 0) {
+            SYNKAFKA_LOG_WARN() << "Connection to " << dns_query_ << " failed to set TCP_QUICKACK: " << std::strerror(errno);
+        }
+    }
+#endif
+}
+
 Connection::Connection(boost::asio::io_service& io_service, std::string host, int32_t port)
     : pimpl_(new impl(io_service, std::move(host), port), [](impl* impl){ impl->close(); delete impl; })
 {
@@ -76,12 +157,12 @@ error_code Connection::connect()
     {
     case STATE_CONNECTED:
         // Already connected, return immediately (with null error)
-        log()->debug() << *this << "connect(): is already connected";
+        SYNKAFKA_LOG_DEBUG() << *this << "connect(): is already connected";
         return error_code();
 
     case STATE_CLOSED:
         // already closed
-        log()->debug() << *this << "connect(): is already closed: " << pimpl_->ec_.message();
+        SYNKAFKA_LOG_DEBUG() << *this << "connect(): is already closed: " << pimpl_->ec_.message();
         return pimpl_->ec_;
 
     case STATE_CONNECTING:
@@ -96,7 +177,7 @@ error_code Connection::connect()
                 // Condition variable timed out waiting for state change
                 auto ec = errc::make_error_code(errc::timed_out);
                 // Close with error, this will wake any other threads too
-                log()->debug() << *this << "connect(): timed out: " << ec.message();
+                SYNKAFKA_LOG_DEBUG() << *this << "connect(): timed out: " << ec.message();
                 // We need to call close without releasing lock though since the connect might have succeeded between our timeout
                 // wait on the CV and here and unlocking explicitly before calling close allows a race where coroutine continues processing
                 // connection and sends RPC on the connection here before we get to close it due to timeout.
@@ -106,22 +187,18 @@ error_code Connection::connect()
 
             if (pimpl_->state_ != STATE_CONNECTED) {
                 // Connection attempt failed, return error
-                log()->debug() << *this << "connect(): closed while we waited: "  << pimpl_->ec_.message();
+                SYNKAFKA_LOG_DEBUG() << *this << "connect(): closed while we waited: "  << pimpl_->ec_.message();
                 return pimpl_->ec_;
             }
 
             // Success!
-            log()->debug() << *this << "connect(): OK";
+            SYNKAFKA_LOG_DEBUG() << *this << "connect(): OK";
             return error_code();
         }
 
     case STATE_INIT:
-        pimpl_->state_ = STATE_CONNECTING;
-        // unlock so we don't deadlock on recursion
-        lk.unlock();
-        log()->debug() << *this << "connect(): starting connect";
-        // Trigger actual connection coroutine
-        (*this)();
+        SYNKAFKA_LOG_DEBUG() << *this << "connect(): starting connect";
+        start_connect(lk);
 
         return connect();
     }
@@ -130,6 +207,60 @@ error_code Connection::connect()
     return error_code();
 }
 
+void Connection::async_connect(connect_handler_t handler)
+{
+    std::unique_lock<std::mutex> lk(pimpl_->mu_);
+
+    switch (pimpl_->state_)
+    {
+    case STATE_CONNECTED:
+        pimpl_->strand_.post(std::bind(std::move(handler), error_code()));
+        return;
+
+    case STATE_CLOSED:
+        pimpl_->strand_.post(std::bind(std::move(handler), pimpl_->ec_));
+        return;
+
+    case STATE_CONNECTING:
+        pimpl_->connect_handlers_.push_back(std::move(handler));
+        return;
+
+    case STATE_INIT:
+        SYNKAFKA_LOG_DEBUG() << *this << "async_connect(): starting connect";
+        pimpl_->connect_handlers_.push_back(std::move(handler));
+        start_connect(lk);
+        return;
+    }
+}
+
+void Connection::start_connect(std::unique_lock<std::mutex>& lk)
+{
+    pimpl_->state_ = STATE_CONNECTING;
+
+    // Blocking connect() callers time out on their own but async_connect() ones have nobody
+    // waiting so the timer enforces timeout_ms_ for them. Only a weak reference so a pending
+    // timer doesn't keep a connection nobody wants alive.
+    std::weak_ptr<impl> weak_impl = pimpl_;
+    pimpl_->connect_timer_.expires_from_now(std::chrono::milliseconds(pimpl_->timeout_ms_));
+    pimpl_->connect_timer_.async_wait([weak_impl](const error_code& ec) {
+        auto impl = weak_impl.lock();
+        if (ec || !impl) {
+            return;
+        }
+        std::lock_guard<std::mutex> lk(impl->mu_);
+        // Connect may have completed just as we fired
+        if (impl->state_ == STATE_CONNECTING) {
+            impl->close(errc::make_error_code(errc::timed_out), true);
+        }
+    });
+
+    // unlock so we don't deadlock on recursion
+    lk.unlock();
+
+    // Trigger actual connection coroutine
+    (*this)();
+}
+
 // Enable the pseudo-keywords reenter, yield and fork.
 #include <boost/asio/yield.hpp>
 
@@ -148,29 +279,50 @@ void Connection::operator()(error_code ec, tcp::resolver::iterator endpoint_iter
     // Coroutine
     reenter (this)
     {
-        log()->debug() << *this << "coroutine(): starting resolve";
-        yield pimpl_->resolver_.async_resolve(pimpl_->dns_query_, *this);
+        if (ResolverCache::instance().lookup(pimpl_->dns_query_.host_name(), pimpl_->dns_query_.service_name()
+                                            ,pimpl_->endpoints_, ec)) {
+            if (ec) {
+                // Resolution failed recently, don't ask again until the negative entry expires
+                SYNKAFKA_LOG_DEBUG() << *this << "coroutine(): cached resolve failure: " << ec.message();
+                close(ec);
+                return;
+            }
+            SYNKAFKA_LOG_DEBUG() << *this << "coroutine(): using " << pimpl_->endpoints_.size() << " cached addresses";
+        } else {
+            SYNKAFKA_LOG_DEBUG() << *this << "coroutine(): starting resolve";
+            yield pimpl_->resolver_.async_resolve(pimpl_->dns_query_, *this);
 
-        if (ec) {
-            // Failed to resolve, can't do much with that...
-            log()->debug() << *this << "coroutine(): resolve failed: " << ec.message();
-            close(ec);
-            return;
+            if (ec) {
+                // Failed to resolve, can't do much with that...
+                SYNKAFKA_LOG_DEBUG() << *this << "coroutine(): resolve failed: " << ec.message();
+                ResolverCache::instance().store_failure(pimpl_->dns_query_.host_name(), pimpl_->dns_query_.service_name(), ec);
+                close(ec);
+                return;
+            }
+
+            pimpl_->endpoints_.assign(endpoint_iterator, tcp::resolver::iterator());
+            ResolverCache::instance().store(pimpl_->dns_query_.host_name(), pimpl_->dns_query_.service_name(), pimpl_->endpoints_);
         }
 
-        while (endpoint_iterator != tcp::resolver::iterator()) {
-            log()->debug() << *this << "coroutine(): async connect to "
-                << endpoint_iterator->host_name()
-                << ":" << endpoint_iterator->service_name();
+        // Cached lookups hand back the addresses rotated so that consecutive connects start at a
+        // different one, between them connections still fall through all of them in order.
+        for (pimpl_->endpoint_idx_ = 0; pimpl_->endpoint_idx_ < pimpl_->endpoints_.size(); ++pimpl_->endpoint_idx_) {
+            SYNKAFKA_LOG_DEBUG() << *this << "coroutine(): async connect to "
+                << pimpl_->endpoints_[pimpl_->endpoint_idx_];
 
-            yield pimpl_->socket_.async_connect(*endpoint_iterator, boost::bind(*this, _1, endpoint_iterator));
+            pimpl_->open_socket(pimpl_->endpoints_[pimpl_->endpoint_idx_], ec);
+            if (ec) {
+                SYNKAFKA_LOG_DEBUG() << *this << "coroutine(): failed to open socket: " << ec.message();
+                continue;
+            }
+
+            yield pimpl_->socket_.async_connect(pimpl_->endpoints_[pimpl_->endpoint_idx_], *this);
 
             if (ec) {
                 // Error connecting. close socket and try again on next iteration
                 auto str = ec.message();
-                log()->debug() << *this << "coroutine(): async connect failed: " << ec.message();
+                SYNKAFKA_LOG_DEBUG() << *this << "coroutine(): async connect failed: " << ec.message();
                 pimpl_->socket_.close();
-                ++endpoint_iterator;
             } else {
                 // Connected OK, We are done...
                 {
@@ -185,9 +337,14 @@ void Connection::operator()(error_code ec, tcp::resolver::iterator endpoint_iter
                         // notified already
                         return;
                     }
+                    pimpl_->tune_connected_socket();
                     pimpl_->state_ = STATE_CONNECTED;
+
+                    error_code timer_ec;
+                    pimpl_->connect_timer_.cancel(timer_ec);
+                    pimpl_->complete_connect_handlers(error_code());
                 }
-                log()->debug() << *this << "coroutine(): async connect OK ";
+                SYNKAFKA_LOG_DEBUG() << *this << "coroutine(): async connect OK ";
                 // Signal any waiters that we are now connected
                 pimpl_->cv_.notify_all();
                 return;
@@ -196,7 +353,7 @@ void Connection::operator()(error_code ec, tcp::resolver::iterator endpoint_iter
 
         // If we made it here then we faile dto connect to all endpoints given
         // by DNS
-        log()->debug() << *this << "coroutine(): async connect failed (no more endpoints): " << ec.message();
+        SYNKAFKA_LOG_DEBUG() << *this << "coroutine(): async connect failed (no more endpoints): " << ec.message();
         close(ec);
     }
 }
@@ -2,8 +2,10 @@
 
 #include <ostream>
 #include <condition_variable>
+#include <functional>
 #include <memory>
 #include <mutex>
+#include <vector>
 
 #include <boost/asio.hpp>
 #include <boost/asio/coroutine.hpp>
@@ -14,6 +16,22 @@ namespace synkafka
 using boost::asio::ip::tcp;
 using boost::system::error_code;
 
+// TCP tuning applied to broker sockets
+struct SocketOptions
+{
+    // Disable Nagle so small pipelined requests aren't held back waiting for acks
+    bool    no_delay                = true;
+    // SO_SNDBUF/SO_RCVBUF in bytes, 0 leaves the OS default. Set before connecting so that
+    // a large receive buffer can be reflected in the TCP window scale negotiated on connect.
+    int32_t send_buffer_bytes       = 0;
+    int32_t receive_buffer_bytes    = 0;
+    // SO_KEEPALIVE, lets the OS notice dead peers on otherwise idle connections
+    bool    keep_alive              = false;
+    // TCP_QUICKACK where supported (Linux), ignored elsewhere. The kernel may drop back to
+    // delayed acks later, this only applies it at connect.
+    bool    quick_ack               = false;
+};
+
 // Connection manages process of (blocking, multithreaded) connect of a single tcp socket
 // with timeout
 class Connection : boost::asio::coroutine
@@ -24,11 +42,22 @@ public:
     // Set the timeout for connection, default is 1 second (1000 ms)
     void set_timeout(int32_t milliseconds) { pimpl_->timeout_ms_ = milliseconds; }
 
+    // Must be set before connect() to have any effect
+    void set_socket_options(const SocketOptions& opts) { pimpl_->socket_options_ = opts; }
+
     // Safe to call from multiple threads
     // Call will block until socket is connected, fails,
     // or the timeout is met.
     error_code connect();
 
+    typedef std::function<void (error_code)> connect_handler_t;
+
+    // Non-blocking version of connect(), safe to call from asio threads. Starts connecting if
+    // nobody has yet and returns immediately. handler is posted to the connection's strand
+    // with the result once the connection is up, fails or the timeout is met (or straight
+    // away if that has already happened).
+    void async_connect(connect_handler_t handler);
+
     // Entry point for connection coroutine - not to be called externally
     // although must be public for asio to hook into it
     typedef void result_type; // Allows boost::bind to bind arguments to functor calls...
@@ -71,6 +100,10 @@ private:
 
     typedef enum { STATE_INIT, STATE_CONNECTING, STATE_CONNECTED, STATE_CLOSED } ConnectionState;
 
+    // Move from STATE_INIT to STATE_CONNECTING, arm the connect timeout and kick off the coroutine.
+    // lk must hold pimpl_->mu_, it is released before the coroutine starts.
+    void start_connect(std::unique_lock<std::mutex>& lk);
+
     // Pimpl pattern since whole Functor must be trivially copyable to be a valid asio handler
     // this means we just keep a shared pointer to entire state and only pay price of one shared_ptr
     // copy each time.
@@ -80,15 +113,28 @@ private:
 
         error_code close(error_code ec = error_code(), bool lock_held = false);
 
+        // Open socket_ ready to connect and apply the options that must be set beforehand
+        void open_socket(const tcp::endpoint& endpoint, error_code& ec);
+        // Apply the rest of socket_options_ once connected
+        void tune_connected_socket();
+
+        // Post result to everyone waiting in async_connect(), mu_ must be held
+        void complete_connect_handlers(error_code ec);
+
         tcp::resolver::query            dns_query_;
         tcp::socket                     socket_;
         boost::asio::io_service::strand strand_;
         tcp::resolver                   resolver_;
+        std::vector<tcp::endpoint>      endpoints_;     // addresses for the current connect attempt
+        size_t                          endpoint_idx_;  // which of endpoints_ we are trying
         int32_t                         timeout_ms_;
+        SocketOptions                   socket_options_;
         std::mutex                      mu_;
         std::condition_variable         cv_;
         ConnectionState                 state_;
         error_code                      ec_;
+        std::vector<connect_handler_t>  connect_handlers_;
+        boost::asio::steady_timer       connect_timer_;
     };
 
     std::shared_ptr<impl> pimpl_;
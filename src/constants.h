@@ -24,9 +24,12 @@ namespace ApiKey
     const int16_t OffsetCommitRequest       = 8;
     const int16_t OffsetFetchRequest        = 9;
     const int16_t ConsumerMetadataRequest   = 10;
+    // Kafka 0.11+ only
+    const int16_t InitProducerIdRequest     = 22;
 };
 
-// Api version sent in all request headers for 0.8.x
+// Api version sent in request headers for 0.8.x APIs. Requests that need a newer
+// version (only used for idempotent produce) declare their own.
 const int16_t KafkaApiVersion = 0;
 
 }
\ No newline at end of file
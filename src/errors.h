@@ -24,6 +24,10 @@ enum class synkafka_error
     client_stopping,
     encoding_error,
     decoding_error,
+    buffer_memory_exhausted,
+    broker_unavailable,
+    rate_limited,
+    in_flight_limit,
     unknown,
 };
 
@@ -55,6 +59,14 @@ public:
             return "Error encoding protocol bytes";
         case synkafka_error::decoding_error:
             return "Error decoding protocol bytes";
+        case synkafka_error::buffer_memory_exhausted:
+            return "Client buffer memory limit reached";
+        case synkafka_error::broker_unavailable:
+            return "Broker recently failed and is backing off before reconnecting";
+        case synkafka_error::rate_limited:
+            return "Client rate limit reached";
+        case synkafka_error::in_flight_limit:
+            return "Too many requests already in flight to broker";
         case synkafka_error::unknown:
             return "Unknown error";
         default:
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <system_error>
+
+namespace synkafka {
+
+// What an Interceptor is told about a request at each step
+struct RequestTrace
+{
+    int32_t     correlation_id  = -1; // assigned when the request is queued on the connection
+    int32_t     broker_id       = -1;
+    int16_t     api_key         = -1;
+    std::string topic;
+    int32_t     partition_id    = -1;
+    // Request bytes up to and including on_write_complete, response bytes from on_response_header
+    size_t      bytes           = 0;
+};
+
+// Hooks into the lifecycle of produce requests, for tracing and finding where latency goes.
+// Callbacks run on whichever thread the step happens on: on_enqueue to on_response_header (and
+// errors failing a queued request) on asio threads, on_decoded (and timeouts or decode failures)
+// on the thread that called produce(). They must be thread safe and quick, anything slow here
+// holds up every other request on the same connection.
+// All callbacks default to doing nothing so implementations only override what they need.
+class Interceptor
+{
+public:
+    virtual ~Interceptor() {}
+
+    // Queued to be written to the broker's connection
+    virtual void on_enqueue(const RequestTrace&) {}
+    // Header encoded and the whole request ready to write, bytes is it's full size on the wire
+    virtual void on_encoded(const RequestTrace&) {}
+    // Socket write containing the request started. Requests queued together share one write.
+    virtual void on_write_start(const RequestTrace&) {}
+    virtual void on_write_complete(const RequestTrace&) {}
+    // Whole response read and it's header checked, bytes is the response size
+    virtual void on_response_header(const RequestTrace&) {}
+    // Response decoded by the caller
+    virtual void on_decoded(const RequestTrace&) {}
+    // Request failed at any point, including errors returned by kafka for the partition.
+    // correlation_id may still be -1 for timeouts.
+    virtual void on_error(const RequestTrace&, const std::error_code&) {}
+};
+
+// An interceptor and the trace of one request it is watching, shared between the RPC and the
+// thread waiting for it's response. Requests without one are not traced at all.
+struct TraceContext
+{
+    TraceContext(std::shared_ptr<Interceptor> i, RequestTrace t)
+        : interceptor(std::move(i))
+        , trace(std::move(t))
+    {}
+
+    std::shared_ptr<Interceptor>    interceptor;
+    RequestTrace                    trace;
+};
+
+typedef std::shared_ptr<TraceContext> trace_context_t;
+
+}
@@ -31,6 +31,12 @@ enum class kafka_error
     OffsetsLoadInProgressCode           = 14, // The broker returns this error code for an offset fetch request if it is still loading offsets (after a leader change for that offsets topic partition).
     ConsumerCoordinatorNotAvailableCode = 15, // The broker returns this error code for consumer metadata requests or offset commit requests if the offsets topic has not yet been created.
     NotCoordinatorForConsumerCode       = 16, // The broker returns this error code if it receives an offset fetch or commit request for a consumer group that it is not a coordinator for.
+    NotEnoughReplicas                   = 19, // Messages are rejected since there are fewer in-sync replicas than required.
+    NotEnoughReplicasAfterAppend        = 20, // Messages are written to the log, but to fewer in-sync replicas than required.
+    OutOfOrderSequenceNumber            = 45, // The broker received an out of order sequence number from an idempotent producer.
+    DuplicateSequenceNumber             = 46, // The broker received a duplicate sequence number, the batch was already written.
+    InvalidProducerEpoch                = 47, // Producer attempted an operation with an old epoch.
+    UnknownProducerId                   = 59, // The broker has no state for this producer id, usually because it's records have all been deleted.
 };
 
 class kafka_category_impl
@@ -77,6 +83,18 @@ public:
             return "The broker returns this error code for consumer metadata requests or offset commit requests if the offsets topic has not yet been created.";
         case kafka_error::NotCoordinatorForConsumerCode:
             return "The broker returns this error code if it receives an offset fetch or commit request for a consumer group that it is not a coordinator for.";
+        case kafka_error::NotEnoughReplicas:
+            return "Messages are rejected since there are fewer in-sync replicas than required.";
+        case kafka_error::NotEnoughReplicasAfterAppend:
+            return "Messages are written to the log, but to fewer in-sync replicas than required.";
+        case kafka_error::OutOfOrderSequenceNumber:
+            return "The broker received an out of order sequence number from an idempotent producer.";
+        case kafka_error::DuplicateSequenceNumber:
+            return "The broker received a duplicate sequence number, the batch was already written.";
+        case kafka_error::InvalidProducerEpoch:
+            return "Producer attempted an operation with an old epoch.";
+        case kafka_error::UnknownProducerId:
+            return "The broker has no state for this producer id, usually because it's records have all been deleted.";
         default:
             return "Invalid Kafka Error";
         }
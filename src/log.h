@@ -1,9 +1,21 @@
 #pragma once
 
+#include <cstdlib>
+#include <iostream>
 #include <mutex>
 
 #include "spdlog/spdlog.h"
 
+#include "async_log_sink.h"
+
+// Minimum level that is compiled in at all, as a spdlog::level::level_enum value
+// (0 = trace, 1 = debug, 2 = info ... 9 = off). Statements below this level compile to nothing
+// regardless of LOG_LEVEL at runtime. Default keeps everything so LOG_LEVEL=TRACE still works
+// for debugging, release builds that never need it can define this as 2 to strip trace/debug.
+#ifndef SYNKAFKA_LOG_MIN_LEVEL
+#define SYNKAFKA_LOG_MIN_LEVEL 0
+#endif
+
 namespace synkafka {
 
 // Nasty reaching into details namespace but necessary to create
@@ -11,9 +23,46 @@ namespace synkafka {
 // output.
 typedef spdlog::details::line_logger logger_t;
 
+namespace detail {
+
+inline std::shared_ptr<AsyncLogSink>& async_log_sink()
+{
+    static std::shared_ptr<AsyncLogSink> sink;
+    return sink;
+}
+
+// LOG_ASYNC_QUEUE_SIZE from the environment, 8192 if it's not set to a positive number
+inline size_t async_log_queue_size()
+{
+    auto queue_size_str = getenv("LOG_ASYNC_QUEUE_SIZE");
+    if (queue_size_str != nullptr && std::strtoul(queue_size_str, nullptr, 10) > 0) {
+        return std::strtoul(queue_size_str, nullptr, 10);
+    }
+    return 8192;
+}
+
+// LOG_ASYNC=1 in the environment makes log writes go through a bounded queue to a background
+// writer thread instead of writing synchronously to stdout from the logging thread.
+// LOG_ASYNC_QUEUE_SIZE sets the queue length in lines (default 8192), lines logged while
+// it is full are dropped and counted.
+inline std::shared_ptr<spdlog::logger> make_logger()
+{
+    auto async = getenv("LOG_ASYNC");
+    if (async == nullptr || strcmp(async, "1") != 0) {
+        return spdlog::stdout_logger_mt("console");
+    }
+
+    auto sink = std::make_shared<AsyncLogSink>(std::cout, async_log_queue_size());
+    async_log_sink() = sink;
+
+    return spdlog::create("console", {sink});
+}
+
+}
+
 inline std::shared_ptr<spdlog::logger> log() {
 
-    static auto log = spdlog::stdout_logger_mt("console");
+    static auto log = detail::make_logger();
     static std::once_flag init_done;
 
     std::call_once(init_done, [&](){
@@ -46,4 +95,46 @@ inline std::shared_ptr<spdlog::logger> log() {
     return log;
 }
 
-}
\ No newline at end of file
+// Number of log lines dropped because the async log queue was full.
+// Always 0 if LOG_ASYNC is not enabled.
+inline uint64_t log_messages_dropped()
+{
+    log();
+    auto& sink = detail::async_log_sink();
+    return sink ? sink->dropped() : 0;
+}
+
+// The same logger as log() but without the shared_ptr copy and call_once on every use.
+// The logger is never destroyed before exit (spdlog's registry holds a reference) so
+// a raw pointer is safe. This is what the SYNKAFKA_LOG_* macros use.
+inline spdlog::logger* raw_log()
+{
+    static spdlog::logger* logger = log().get();
+    return logger;
+}
+
+// Check level before building a log line. The compile time check is constant folded so
+// for levels below SYNKAFKA_LOG_MIN_LEVEL the whole statement is dead code.
+inline bool log_enabled(spdlog::level::level_enum lvl)
+{
+    return lvl >= SYNKAFKA_LOG_MIN_LEVEL && raw_log()->should_log(lvl);
+}
+
+}
+
+// Iostream style logging that costs only a level check when disabled:
+//
+//    SYNKAFKA_LOG_DEBUG() << "thing happened: " << thing;
+//    SYNKAFKA_LOG_WARN("Metadata is stale: ") << reason;
+//
+// Unlike log()->debug() << ... none of the arguments are evaluated and no line_logger is
+// constructed unless the level is enabled. The if/else form makes the macro safe to use as the
+// body of an unbraced if.
+#define SYNKAFKA_LOG_AT(lvl, method) \
+    if (!::synkafka::log_enabled(::spdlog::level::lvl)) {} else ::synkafka::raw_log()->method
+
+#define SYNKAFKA_LOG_TRACE(...)    SYNKAFKA_LOG_AT(trace, trace)(__VA_ARGS__)
+#define SYNKAFKA_LOG_DEBUG(...)    SYNKAFKA_LOG_AT(debug, debug)(__VA_ARGS__)
+#define SYNKAFKA_LOG_INFO(...)     SYNKAFKA_LOG_AT(info, info)(__VA_ARGS__)
+#define SYNKAFKA_LOG_WARN(...)     SYNKAFKA_LOG_AT(warn, warn)(__VA_ARGS__)
+#define SYNKAFKA_LOG_ERROR(...)    SYNKAFKA_LOG_AT(err, error)(__VA_ARGS__)
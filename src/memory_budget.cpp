@@ -0,0 +1,117 @@
+
+#include <chrono>
+
+#include "errors.h"
+#include "memory_budget.h"
+
+namespace synkafka {
+
+MemoryReservation::MemoryReservation(MemoryReservation&& other)
+    : budget_(other.budget_)
+    , bytes_(other.bytes_)
+{
+    other.budget_ = nullptr;
+    other.bytes_ = 0;
+}
+
+MemoryReservation& MemoryReservation::operator=(MemoryReservation&& other)
+{
+    if (this != &other) {
+        release();
+        budget_ = other.budget_;
+        bytes_ = other.bytes_;
+        other.budget_ = nullptr;
+        other.bytes_ = 0;
+    }
+    return *this;
+}
+
+void MemoryReservation::release()
+{
+    if (budget_ != nullptr) {
+        budget_->release(bytes_);
+        budget_ = nullptr;
+        bytes_ = 0;
+    }
+}
+
+MemoryBudget::MemoryBudget(Gauge* used_gauge, Counter* wait_counter)
+    : mu_()
+    , cv_()
+    , limit_(0)
+    , used_(0)
+    , used_gauge_(used_gauge)
+    , wait_counter_(wait_counter)
+{}
+
+void MemoryBudget::set_limit(size_t bytes)
+{
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        limit_ = bytes;
+    }
+    // Might have been raised so that waiters now fit
+    cv_.notify_all();
+}
+
+size_t MemoryBudget::limit() const
+{
+    std::lock_guard<std::mutex> lk(mu_);
+    return limit_;
+}
+
+size_t MemoryBudget::used() const
+{
+    std::lock_guard<std::mutex> lk(mu_);
+    return used_;
+}
+
+std::error_code MemoryBudget::reserve(size_t bytes, int32_t timeout_ms, MemoryReservation& reservation)
+{
+    std::unique_lock<std::mutex> lk(mu_);
+
+    if (limit_ > 0 && bytes > limit_) {
+        return make_error_code(synkafka_error::buffer_memory_exhausted);
+    }
+
+    if (!fits(bytes)) {
+        if (timeout_ms <= 0) {
+            return make_error_code(synkafka_error::buffer_memory_exhausted);
+        }
+
+        auto started_at = std::chrono::steady_clock::now();
+        auto ok = cv_.wait_for(lk, std::chrono::milliseconds(timeout_ms), [&]{ return fits(bytes); });
+
+        if (wait_counter_ != nullptr) {
+            auto took = std::chrono::steady_clock::now() - started_at;
+            wait_counter_->add(std::chrono::duration_cast<std::chrono::microseconds>(took).count());
+        }
+
+        if (!ok) {
+            return make_error_code(synkafka_error::buffer_memory_exhausted);
+        }
+    }
+
+    used_ += bytes;
+    if (used_gauge_ != nullptr) {
+        used_gauge_->add(bytes);
+    }
+
+    reservation = MemoryReservation(this, bytes);
+
+    return make_error_code(synkafka_error::no_error);
+}
+
+void MemoryBudget::release(size_t bytes)
+{
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        used_ -= bytes;
+        if (used_gauge_ != nullptr) {
+            used_gauge_->sub(bytes);
+        }
+    }
+    cv_.notify_all();
+}
+
+}
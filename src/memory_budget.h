@@ -0,0 +1,77 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <system_error>
+
+#include <boost/core/noncopyable.hpp>
+
+#include "metrics.h"
+
+namespace synkafka {
+
+class MemoryBudget;
+
+// Bytes held against a MemoryBudget, given back when this is destroyed or release()d.
+// Move only so that ownership of the bytes is always clear.
+class MemoryReservation : private boost::noncopyable
+{
+public:
+    MemoryReservation() : budget_(nullptr), bytes_(0) {}
+    MemoryReservation(MemoryReservation&& other);
+    MemoryReservation& operator=(MemoryReservation&& other);
+    ~MemoryReservation() { release(); }
+
+    size_t bytes() const { return bytes_; }
+    void release();
+
+private:
+    friend class MemoryBudget;
+
+    MemoryReservation(MemoryBudget* budget, size_t bytes) : budget_(budget), bytes_(bytes) {}
+
+    MemoryBudget*   budget_;
+    size_t          bytes_;
+};
+
+// Upper bound on the bytes of produce data a client holds in memory at once across
+// all in-flight requests. Producers reserve before building a request and give it back
+// once the broker has responded (or the request failed), so a slow or unavailable broker
+// applies backpressure to callers rather than letting memory grow without limit.
+// A limit of 0 means unlimited, usage is still tracked.
+class MemoryBudget : private boost::noncopyable
+{
+public:
+    // used_gauge and wait_counter are optional, if given current usage and total
+    // microseconds spent blocked waiting for memory are recorded there.
+    explicit MemoryBudget(Gauge* used_gauge = nullptr, Counter* wait_counter = nullptr);
+
+    void set_limit(size_t bytes);
+    size_t limit() const;
+    size_t used() const;
+
+    // Reserve bytes against the budget. If they don't fit, wait up to timeout_ms for other
+    // reservations to be released; timeout_ms of 0 fails immediately instead.
+    // Returns synkafka_error::buffer_memory_exhausted if the bytes could not be reserved in time, or
+    // straight away if they exceed the whole limit and so never could be.
+    std::error_code reserve(size_t bytes, int32_t timeout_ms, MemoryReservation& reservation);
+
+private:
+    friend class MemoryReservation;
+
+    void release(size_t bytes);
+
+    // Caller MUST hold lock on mu_
+    bool fits(size_t bytes) const { return limit_ == 0 || used_ + bytes <= limit_; }
+
+    mutable std::mutex          mu_;
+    std::condition_variable     cv_;
+    size_t                      limit_;
+    size_t                      used_;
+    Gauge*                      used_gauge_;
+    Counter*                    wait_counter_;
+};
+
+}
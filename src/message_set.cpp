@@ -10,7 +10,9 @@ MessageSet::MessageSet()
     , max_message_size_(1000000) // Kafka default
     , compression_(COMP_None)
     , encoded_size_(0)
+    , wire_size_(0)
     , owned_buffers_()
+    , owners_()
 {}
 
 void MessageSet::set_compression(CompressionType comp)
@@ -45,6 +47,18 @@ std::error_code MessageSet::push(const slice& message, const slice& key, bool co
     return push(std::move(m));
 }
 
+std::error_code MessageSet::push(const slice& message, const slice& key, std::shared_ptr<const void> owner)
+{
+    Message m{key, message};
+    auto ec = push(std::move(m));
+
+    if (!ec) {
+        owners_.push_back(std::move(owner));
+    }
+
+    return ec;
+}
+
 std::error_code MessageSet::push(Message&& m)
 {
     auto encoded_size = get_msg_encoded_size(m);
@@ -148,6 +162,8 @@ void kafka_proto_io(PacketCodec& p, MessageSet& ms)
 void kafka_proto_io_impl(PacketCodec& p, MessageSet& ms, int32_t encoded_length)
 {
     if (p.is_writer()) {
+        auto start_offset = p.get_cursor();
+
         if (ms.compression_ == COMP_None) {
             for (auto& message : ms.messages_) {
                 // Encode offset
@@ -196,6 +212,8 @@ void kafka_proto_io_impl(PacketCodec& p, MessageSet& ms, int32_t encoded_length)
             // Update length field
             p.end_length(len_field);
         }
+
+        ms.wire_size_ = p.get_cursor() - start_offset;
     } else {
         // No length prefix for messages and we might have partial one at end of buffer legitimately
         // Keep reading until we have them all (or hit error)...
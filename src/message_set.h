@@ -2,6 +2,11 @@
 
 #include <deque>
 #include <list>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 #include "buffer.h"
 #include "constants.h"
@@ -48,6 +53,30 @@ public:
     std::error_code push(const slice& message, const slice& key, bool copy = false);
     std::error_code push(Message&& m);
 
+    // Push a message whose memory is kept alive by a refcounted owner, e.g. a shared_ptr to the
+    // buffer the slices point into. The set holds a reference to owner until it is destroyed so
+    // the caller doesn't need to keep anything alive itself, and nothing is copied.
+    // owner is only retained if the push succeeds.
+    std::error_code push(const slice& message, const slice& key, std::shared_ptr<const void> owner);
+
+    // Push a message taking ownership of the moved-in value and key buffers without copying their
+    // contents. Accepts rvalue std::string or buffer_t for both; anything else (including lvalues)
+    // falls through to the borrowing push() above.
+    template<typename Buffer
+            ,typename = typename std::enable_if<!std::is_lvalue_reference<Buffer>::value
+                                                && (std::is_same<Buffer, std::string>::value
+                                                    || std::is_same<Buffer, buffer_t>::value)
+                                               >::type
+            >
+    std::error_code push(Buffer&& message, Buffer&& key)
+    {
+        auto owner = std::make_shared<std::pair<Buffer, Buffer>>(std::move(message), std::move(key));
+        // Take slices only after the move: short strings are stored inline so their data moves too
+        slice value_slice(owner->first);
+        slice key_slice(owner->second);
+        return push(value_slice, key_slice, std::shared_ptr<const void>(std::move(owner)));
+    }
+
     // Allow encode/decode like the primitive structs, by the time we get to actually encode
     // it is REQUIRED that the MessageSet is in a valid state (i.e. non empty and not too big).
     // Note friend can't have optional length so this is an implementation function that is called by
@@ -55,8 +84,13 @@ public:
     friend void kafka_proto_io_impl(PacketCodec& p, MessageSet& ms, int32_t encoded_length);
 
     const std::deque<Message>& get_messages() const { return messages_; }
+    CompressionType get_compression() const { return compression_; }
     size_t get_encoded_size() const { return encoded_size_; }
 
+    // Size in bytes the set actually took up the last time it was encoded, after any compression.
+    // 0 if it has not been encoded yet.
+    size_t get_wire_size() const { return wire_size_; }
+
 private:
     size_t get_msg_encoded_size(const Message& m) const;
     size_t get_worst_case_compressed_size(size_t size) const;
@@ -67,9 +101,12 @@ private:
     size_t              max_message_size_;
     CompressionType     compression_;
     size_t              encoded_size_;
+    size_t              wire_size_;
 
     // Any strings we need to keep around to keep slices valid
     std::list<buffer_t>        owned_buffers_;
+    // Buffers handed to us by the caller for the same reason
+    std::vector<std::shared_ptr<const void>>  owners_;
 };
 
 void kafka_proto_io(PacketCodec& p, MessageSet::Message& m);
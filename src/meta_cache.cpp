@@ -0,0 +1,141 @@
+
+#include <cerrno>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <sstream>
+
+#include "meta_cache.h"
+
+namespace synkafka {
+
+namespace {
+
+const char* const Magic = "synkafka_meta";
+const int Version = 1;
+
+}
+
+MetaCacheFile::MetaCacheFile(std::string path)
+    : path_(std::move(path))
+{}
+
+std::error_code MetaCacheFile::load(proto::MetadataResponse& meta) const
+{
+    std::ifstream in(path_);
+    if (!in) {
+        return std::error_code(errno ? errno : ENOENT, std::generic_category());
+    }
+
+    std::stringstream contents;
+    contents << in.rdbuf();
+
+    if (!parse(contents.str(), meta)) {
+        return std::make_error_code(std::errc::invalid_argument);
+    }
+    return std::error_code();
+}
+
+std::error_code MetaCacheFile::save(const proto::MetadataResponse& meta) const
+{
+    auto tmp_path = path_ + ".tmp";
+
+    {
+        std::ofstream out(tmp_path, std::ios::trunc);
+        out << serialize(meta);
+        out.flush();
+        if (!out) {
+            auto ec = std::error_code(errno ? errno : EIO, std::generic_category());
+            std::remove(tmp_path.c_str());
+            return ec;
+        }
+    }
+
+    if (std::rename(tmp_path.c_str(), path_.c_str()) != 0) {
+        auto ec = std::error_code(errno, std::generic_category());
+        std::remove(tmp_path.c_str());
+        return ec;
+    }
+    return std::error_code();
+}
+
+std::string MetaCacheFile::serialize(const proto::MetadataResponse& meta)
+{
+    std::ostringstream out;
+
+    out << Magic << " " << Version << "\n";
+
+    for (auto& b : meta.brokers) {
+        out << "broker " << b.node_id << " " << b.host << " " << b.port << "\n";
+    }
+
+    for (auto& t : meta.topics) {
+        for (auto& p : t.partitions) {
+            out << "partition " << t.name << " " << p.partition_id << " " << p.leader << "\n";
+        }
+    }
+
+    return out.str();
+}
+
+bool MetaCacheFile::parse(const std::string& str, proto::MetadataResponse& meta)
+{
+    std::istringstream in(str);
+    std::string line;
+
+    meta.brokers.clear();
+    meta.topics.clear();
+
+    if (!std::getline(in, line)) {
+        return false;
+    }
+
+    {
+        std::istringstream header(line);
+        std::string magic;
+        int version = 0;
+        if (!(header >> magic >> version) || magic != Magic || version != Version) {
+            return false;
+        }
+    }
+
+    // Index of each topic in meta.topics so partitions can be listed in any order
+    std::map<std::string, size_t> topic_idx;
+
+    while (std::getline(in, line)) {
+        if (line.empty()) {
+            continue;
+        }
+
+        std::istringstream fields(line);
+        std::string kind;
+        fields >> kind;
+
+        if (kind == "broker") {
+            proto::Broker b;
+            if (!(fields >> b.node_id >> b.host >> b.port)) {
+                return false;
+            }
+            meta.brokers.push_back(std::move(b));
+        } else if (kind == "partition") {
+            std::string topic;
+            proto::PartitionMetaData p{make_error_code(kafka_error::NoError), 0, -1, {}, {}};
+            if (!(fields >> topic >> p.partition_id >> p.leader)) {
+                return false;
+            }
+
+            auto it = topic_idx.find(topic);
+            if (it == topic_idx.end()) {
+                it = topic_idx.insert(std::make_pair(topic, meta.topics.size())).first;
+                meta.topics.push_back(proto::TopicMetaData{make_error_code(kafka_error::NoError), topic, {}});
+            }
+            meta.topics[it->second].partitions.push_back(std::move(p));
+        } else {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+}
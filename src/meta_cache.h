@@ -0,0 +1,46 @@
+#pragma once
+
+#include <string>
+#include <system_error>
+
+#include "protocol.h"
+
+namespace synkafka {
+
+// Last known cluster metadata kept in a file so a restarted client can start producing to
+// the leaders it knew about straight away, instead of every client in a rolling restart
+// fetching full metadata from the bootstrap brokers before it can do anything.
+// Only brokers and partition leaders are kept, the rest of the metadata isn't used.
+//
+// The file is a small line based text format:
+//
+//   synkafka_meta 1
+//   broker <node_id> <host> <port>
+//   partition <topic> <partition_id> <leader>
+//
+// Kafka doesn't allow whitespace in host or topic names so no quoting is needed.
+class MetaCacheFile
+{
+public:
+    explicit MetaCacheFile(std::string path);
+
+    const std::string& path() const { return path_; }
+
+    // Read the file into meta. Fails with std::errc::no_such_file_or_directory if there
+    // is no file yet and std::errc::invalid_argument if it can't be parsed.
+    std::error_code load(proto::MetadataResponse& meta) const;
+
+    // Replace the file with meta. Written to a temporary file next to it first and then
+    // renamed over it so a reader (or a crash) never sees a partial file.
+    std::error_code save(const proto::MetadataResponse& meta) const;
+
+    static std::string serialize(const proto::MetadataResponse& meta);
+
+    // Returns false (leaving meta in an unspecified state) if str isn't a valid cache file
+    static bool parse(const std::string& str, proto::MetadataResponse& meta);
+
+private:
+    std::string path_;
+};
+
+}
@@ -0,0 +1,246 @@
+
+#include <sstream>
+
+#include "errors.h"
+#include "metrics.h"
+
+namespace synkafka {
+
+Counter::Counter()
+{
+    for (auto& cell : cells_) {
+        cell.value.store(0, std::memory_order_relaxed);
+    }
+}
+
+uint64_t Counter::value() const
+{
+    uint64_t total = 0;
+    for (auto& cell : cells_) {
+        total += cell.value.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+size_t Counter::cell_index()
+{
+    // Hand out cells round-robin to threads as they first touch any counter. With a handful
+    // of asio threads and producing threads this spreads them out well enough without
+    // needing to know which core we are actually on.
+    static std::atomic<size_t> next_index(0);
+    static thread_local size_t index = next_index.fetch_add(1, std::memory_order_relaxed) % NumCells;
+    return index;
+}
+
+Metrics::Metrics()
+    : produce_requests()
+    , produce_errors()
+    , produce_retries()
+    , meta_refreshes()
+    , meta_refresh_failures()
+    , meta_refresh_retries()
+    , meta_refresh_duration_us()
+    , reconnects()
+    , idle_connections_closed()
+    , health_probe_failures()
+    , breaker_rejections()
+    , rate_limit_delays()
+    , rate_limit_wait_us()
+    , encode_bytes_in()
+    , encode_bytes_out()
+    , buffer_memory_used()
+    , buffer_memory_limit()
+    , buffer_memory_wait_us()
+    , other_errors_(0)
+    , mu_()
+    , brokers_()
+{
+    for (int i = 0; i < MaxErrorCodes; ++i) {
+        kafka_errors_[i].store(0, std::memory_order_relaxed);
+        client_errors_[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+std::shared_ptr<BrokerMetrics> Metrics::broker(int32_t node_id)
+{
+    std::lock_guard<std::mutex> lk(mu_);
+
+    auto& bm = brokers_[node_id];
+    if (!bm) {
+        bm = std::make_shared<BrokerMetrics>();
+    }
+    return bm;
+}
+
+void Metrics::record_error(const std::error_code& ec)
+{
+    if (!ec) {
+        return;
+    }
+
+    if (ec.category() == kafka_category()) {
+        // Shift by one since Unknown is -1
+        auto idx = ec.value() + 1;
+        if (idx >= 0 && idx < MaxErrorCodes) {
+            kafka_errors_[idx].fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+    } else if (ec.category() == synkafka_category()) {
+        auto idx = ec.value();
+        if (idx >= 0 && idx < MaxErrorCodes) {
+            client_errors_[idx].fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+    }
+
+    other_errors_.fetch_add(1, std::memory_order_relaxed);
+}
+
+MetricsSnapshot Metrics::snapshot() const
+{
+    MetricsSnapshot s;
+
+    s.produce_requests          = produce_requests.value();
+    s.produce_errors            = produce_errors.value();
+    s.produce_retries           = produce_retries.value();
+    s.meta_refreshes            = meta_refreshes.value();
+    s.meta_refresh_failures     = meta_refresh_failures.value();
+    s.meta_refresh_retries      = meta_refresh_retries.value();
+    s.meta_refresh_duration_us  = meta_refresh_duration_us.value();
+    s.reconnects                = reconnects.value();
+    s.idle_connections_closed   = idle_connections_closed.value();
+    s.health_probe_failures     = health_probe_failures.value();
+    s.breaker_rejections        = breaker_rejections.value();
+    s.rate_limit_delays         = rate_limit_delays.value();
+    s.rate_limit_wait_us        = rate_limit_wait_us.value();
+    s.encode_bytes_in           = encode_bytes_in.value();
+    s.encode_bytes_out          = encode_bytes_out.value();
+    s.buffer_memory_used        = buffer_memory_used.value();
+    s.buffer_memory_limit       = buffer_memory_limit.value();
+    s.buffer_memory_wait_us     = buffer_memory_wait_us.value();
+
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        for (auto& pair : brokers_) {
+            auto& bm = *pair.second;
+            s.brokers[pair.first] = BrokerMetricsSnapshot{bm.bytes_sent.value()
+                                                         ,bm.bytes_received.value()
+                                                         ,bm.requests_sent.value()
+                                                         ,bm.writes_sent.value()
+                                                         ,bm.responses_received.value()
+                                                         ,bm.send_queue_depth.value()
+                                                         ,bm.recv_queue_depth.value()
+                                                         ,bm.latency_ewma_us.value()
+                                                         ,bm.concurrency_limit.value()
+                                                         };
+        }
+    }
+
+    for (int i = 0; i < MaxErrorCodes; ++i) {
+        auto n = kafka_errors_[i].load(std::memory_order_relaxed);
+        if (n > 0) {
+            s.kafka_errors[i - 1] = n;
+        }
+        n = client_errors_[i].load(std::memory_order_relaxed);
+        if (n > 0) {
+            s.client_errors[i] = n;
+        }
+    }
+
+    s.other_errors = other_errors_.load(std::memory_order_relaxed);
+
+    return s;
+}
+
+namespace {
+
+void write_header(std::ostream& os, const std::string& name, const char* type, const char* help)
+{
+    os << "# HELP " << name << " " << help << "\n"
+       << "# TYPE " << name << " " << type << "\n";
+}
+
+template<typename T>
+void write_metric(std::ostream& os, const std::string& prefix, const char* name, const char* type, const char* help, T value)
+{
+    auto full_name = prefix + "_" + name;
+    write_header(os, full_name, type, help);
+    os << full_name << " " << value << "\n";
+}
+
+template<typename Getter>
+void write_broker_metric(std::ostream& os, const MetricsSnapshot& s, const std::string& prefix
+                        ,const char* name, const char* type, const char* help, Getter get)
+{
+    if (s.brokers.empty()) {
+        return;
+    }
+
+    auto full_name = prefix + "_broker_" + name;
+    write_header(os, full_name, type, help);
+    for (auto& pair : s.brokers) {
+        os << full_name << "{node_id=\"" << pair.first << "\"} " << get(pair.second) << "\n";
+    }
+}
+
+}
+
+std::string format_prometheus(const MetricsSnapshot& s, const std::string& prefix)
+{
+    std::ostringstream os;
+
+    write_metric(os, prefix, "produce_requests_total", "counter", "Produce calls made", s.produce_requests);
+    write_metric(os, prefix, "produce_errors_total", "counter", "Produce calls that returned an error", s.produce_errors);
+    write_metric(os, prefix, "produce_retries_total", "counter", "Idempotent produce attempts resent by the client", s.produce_retries);
+    write_metric(os, prefix, "meta_refreshes_total", "counter", "Metadata fetches from the cluster", s.meta_refreshes);
+    write_metric(os, prefix, "meta_refresh_failures_total", "counter", "Metadata fetches that failed", s.meta_refresh_failures);
+    write_metric(os, prefix, "meta_refresh_retries_total", "counter", "Metadata fetches retried after an error", s.meta_refresh_retries);
+    write_metric(os, prefix, "meta_refresh_duration_seconds_total", "counter", "Total time spent fetching metadata"
+                ,static_cast<double>(s.meta_refresh_duration_us) / 1e6);
+    write_metric(os, prefix, "reconnects_total", "counter", "Broker connections re-created after a previous one was closed", s.reconnects);
+    write_metric(os, prefix, "idle_connections_closed_total", "counter", "Broker connections closed for being idle", s.idle_connections_closed);
+    write_metric(os, prefix, "health_probe_failures_total", "counter", "Idle connection health probes that failed", s.health_probe_failures);
+    write_metric(os, prefix, "breaker_rejections_total", "counter", "Requests failed fast because their broker's circuit breaker was open", s.breaker_rejections);
+    write_metric(os, prefix, "rate_limit_delays_total", "counter", "Produce requests held back by a rate limit", s.rate_limit_delays);
+    write_metric(os, prefix, "rate_limit_wait_seconds_total", "counter", "Total time produce requests were held back by rate limits"
+                ,static_cast<double>(s.rate_limit_wait_us) / 1e6);
+    write_metric(os, prefix, "encode_bytes_in_total", "counter", "MessageSet bytes before compression", s.encode_bytes_in);
+    write_metric(os, prefix, "encode_bytes_out_total", "counter", "MessageSet bytes after compression", s.encode_bytes_out);
+    write_metric(os, prefix, "buffer_memory_used_bytes", "gauge", "Bytes of produce data currently held against the buffer memory budget", s.buffer_memory_used);
+    write_metric(os, prefix, "buffer_memory_limit_bytes", "gauge", "Configured buffer memory budget, 0 if unlimited", s.buffer_memory_limit);
+    write_metric(os, prefix, "buffer_memory_wait_seconds_total", "counter", "Total time producers spent blocked waiting for buffer memory"
+                ,static_cast<double>(s.buffer_memory_wait_us) / 1e6);
+
+    write_broker_metric(os, s, prefix, "bytes_sent_total", "counter", "Bytes written to broker"
+                       ,[](const BrokerMetricsSnapshot& b) { return b.bytes_sent; });
+    write_broker_metric(os, s, prefix, "bytes_received_total", "counter", "Bytes read from broker"
+                       ,[](const BrokerMetricsSnapshot& b) { return b.bytes_received; });
+    write_broker_metric(os, s, prefix, "requests_sent_total", "counter", "Requests written to broker"
+                       ,[](const BrokerMetricsSnapshot& b) { return b.requests_sent; });
+    write_broker_metric(os, s, prefix, "writes_sent_total", "counter", "Socket writes to broker, each carrying one or more requests"
+                       ,[](const BrokerMetricsSnapshot& b) { return b.writes_sent; });
+    write_broker_metric(os, s, prefix, "responses_received_total", "counter", "Responses read from broker"
+                       ,[](const BrokerMetricsSnapshot& b) { return b.responses_received; });
+    write_broker_metric(os, s, prefix, "send_queue_depth", "gauge", "Requests queued to be written"
+                       ,[](const BrokerMetricsSnapshot& b) { return b.send_queue_depth; });
+    write_broker_metric(os, s, prefix, "recv_queue_depth", "gauge", "Requests written and awaiting response"
+                       ,[](const BrokerMetricsSnapshot& b) { return b.recv_queue_depth; });
+    write_broker_metric(os, s, prefix, "latency_seconds", "gauge", "Moving average of request latency including time queued"
+                       ,[](const BrokerMetricsSnapshot& b) { return static_cast<double>(b.latency_ewma_us) / 1e6; });
+    write_broker_metric(os, s, prefix, "concurrency_limit", "gauge", "Adaptive limit on produce requests in flight, 0 if not enabled"
+                       ,[](const BrokerMetricsSnapshot& b) { return b.concurrency_limit; });
+
+    auto errors_name = prefix + "_errors_total";
+    write_header(os, errors_name, "counter", "Errors returned to callers by category and code");
+    for (auto& pair : s.kafka_errors) {
+        os << errors_name << "{category=\"kafka\",code=\"" << pair.first << "\"} " << pair.second << "\n";
+    }
+    for (auto& pair : s.client_errors) {
+        os << errors_name << "{category=\"synkafka\",code=\"" << pair.first << "\"} " << pair.second << "\n";
+    }
+    os << errors_name << "{category=\"other\"} " << s.other_errors << "\n";
+
+    return os.str();
+}
+
+}
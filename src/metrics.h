@@ -0,0 +1,182 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+
+#include <boost/core/noncopyable.hpp>
+
+namespace synkafka {
+
+// Monotonically increasing counter.
+// Increments land in one of several cache-line sized cells chosen per-thread so that
+// asio threads and producing threads bumping the same counter don't all fight over
+// a single cache line. Reading has to sum all cells which is comparatively slow but
+// only happens when taking a snapshot.
+class Counter : private boost::noncopyable
+{
+public:
+    Counter();
+
+    void add(uint64_t n = 1)
+    {
+        cells_[cell_index()].value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    uint64_t value() const;
+
+private:
+    static const size_t NumCells = 8;
+
+    // Padded rather than alignas() since over-aligned types can't be safely heap allocated
+    // before C++17 and we are embedded in heap allocated objects.
+    struct Cell
+    {
+        std::atomic<uint64_t> value;
+        char                  pad[64 - sizeof(std::atomic<uint64_t>)];
+    };
+
+    static size_t cell_index();
+
+    Cell cells_[NumCells];
+};
+
+// Value that can go up and down like queue depth. Gauges are written from fewer places
+// than counters and need a consistent value to be useful so they are a single atomic.
+class Gauge : private boost::noncopyable
+{
+public:
+    Gauge() : value_(0) {}
+
+    void add(int64_t n = 1) { value_.fetch_add(n, std::memory_order_relaxed); }
+    void sub(int64_t n = 1) { value_.fetch_sub(n, std::memory_order_relaxed); }
+    void set(int64_t n) { value_.store(n, std::memory_order_relaxed); }
+    int64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<int64_t> value_;
+};
+
+// Per-broker metrics. Broker and its RPC queues hold a shared_ptr to this so that counters
+// remain valid for any asio handlers still in flight after the Broker has been replaced.
+struct BrokerMetrics
+{
+    Counter bytes_sent;
+    Counter bytes_received;
+    Counter requests_sent;
+    Counter writes_sent; // socket writes, each carrying one or more requests
+    Counter responses_received;
+    Gauge   send_queue_depth; // RPCs waiting to be (or being) written
+    Gauge   recv_queue_depth; // RPCs written and waiting for a response
+    Gauge   latency_ewma_us; // moving average of time from call() to response, 0 until the first response
+    Gauge   concurrency_limit; // adaptive limit on produce requests in flight, 0 if not enabled
+};
+
+// Plain copies of all the values at a point in time, safe to inspect or format at leisure.
+struct BrokerMetricsSnapshot
+{
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+    uint64_t requests_sent;
+    uint64_t writes_sent;
+    uint64_t responses_received;
+    int64_t  send_queue_depth;
+    int64_t  recv_queue_depth;
+    int64_t  latency_ewma_us;
+    int64_t  concurrency_limit;
+};
+
+struct MetricsSnapshot
+{
+    uint64_t produce_requests;
+    uint64_t produce_errors;
+    uint64_t produce_retries; // idempotent produce attempts resent by the client
+    uint64_t meta_refreshes;
+    uint64_t meta_refresh_failures;
+    uint64_t meta_refresh_retries;
+    uint64_t meta_refresh_duration_us; // total time spent in all refreshes
+    uint64_t reconnects;
+    uint64_t idle_connections_closed;
+    uint64_t health_probe_failures;
+    uint64_t breaker_rejections;
+    uint64_t rate_limit_delays; // produces held back to stay under a rate limit
+    uint64_t rate_limit_wait_us; // total time they were held back for
+    uint64_t encode_bytes_in;  // MessageSet bytes before compression
+    uint64_t encode_bytes_out; // MessageSet bytes actually put on the wire
+    int64_t  buffer_memory_used;
+    int64_t  buffer_memory_limit; // 0 if unlimited
+    uint64_t buffer_memory_wait_us; // total time producers spent blocked waiting for buffer memory
+
+    // Keyed by node id, bootstrap brokers (before we know their ids) are all reported as -1
+    std::map<int32_t, BrokerMetricsSnapshot> brokers;
+
+    // Error counts keyed by error code value, only non-zero counts are included
+    std::map<int, uint64_t> kafka_errors;
+    std::map<int, uint64_t> client_errors; // synkafka_error codes
+    uint64_t                other_errors;  // system/network errors
+};
+
+// Registry of all client metrics. One is owned by each ProducerClient.
+// All recording methods are thread safe and lock free except for broker(), which takes a lock
+// but is only called when a new Broker connection is created.
+class Metrics : private boost::noncopyable
+{
+public:
+    // Node id used for brokers created from bootstrap config before cluster meta is known
+    static const int32_t BootstrapNodeId = -1;
+
+    Metrics();
+
+    // Get (creating if necessary) the metrics for a broker node
+    std::shared_ptr<BrokerMetrics> broker(int32_t node_id);
+
+    // Count an error by it's code. Kafka and synkafka errors are tracked per-code, anything
+    // else is lumped together.
+    void record_error(const std::error_code& ec);
+
+    // Cheap copy of current values. Counters are read individually so the snapshot
+    // is not atomic across metrics, but every value in it is one that was actually observed.
+    MetricsSnapshot snapshot() const;
+
+    Counter produce_requests;
+    Counter produce_errors;
+    Counter produce_retries;
+    Counter meta_refreshes;
+    Counter meta_refresh_failures;
+    Counter meta_refresh_retries;
+    Counter meta_refresh_duration_us;
+    Counter reconnects;
+    Counter idle_connections_closed;
+    Counter health_probe_failures;
+    Counter breaker_rejections;
+    Counter rate_limit_delays;
+    Counter rate_limit_wait_us;
+    Counter encode_bytes_in;
+    Counter encode_bytes_out;
+    Gauge   buffer_memory_used;
+    Gauge   buffer_memory_limit;
+    Counter buffer_memory_wait_us;
+
+private:
+    // Kafka error codes are -1 (Unknown) and then small positive numbers, we shift by one to index them.
+    // Synkafka codes are our own small enum. Anything outside of these ranges is counted in other_errors_.
+    static const int MaxErrorCodes = 64;
+
+    std::atomic<uint64_t>   kafka_errors_[MaxErrorCodes];
+    std::atomic<uint64_t>   client_errors_[MaxErrorCodes];
+    std::atomic<uint64_t>   other_errors_;
+
+    mutable std::mutex                          mu_; // protects brokers_ map (not the metrics in it)
+    std::map<int32_t, std::shared_ptr<BrokerMetrics>> brokers_;
+};
+
+// Format a snapshot in Prometheus text exposition format (version 0.0.4)
+// so it can be served directly from a /metrics endpoint. All metric names are
+// prefixed with prefix + "_".
+std::string format_prometheus(const MetricsSnapshot& snapshot, const std::string& prefix = "synkafka");
+
+}
@@ -2,42 +2,126 @@
 #include <algorithm>
 #include <cstring>
 #include <exception>
+#include <future>
 #include <random>
 #include <iomanip>
+#include <limits>
 #include <set>
+#include <stdexcept>
 #include <system_error>
 #include <sstream>
 
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "broker_registry.h"
 #include "log.h"
 #include "synkafka.h"
 
 namespace synkafka {
 
-ProducerClient::ProducerClient(const std::string& brokers, int num_io_threads)
+ProducerClient::ProducerClient(const std::string& brokers, int num_io_threads, IOThreadMode io_mode)
     :broker_configs_()
     ,brokers_()
     ,partition_map_()
+    ,next_partition_()
+    ,topic_rate_limits_()
+    ,broker_rate_limits_()
     ,mu_()
     ,meta_fetch_mu_()
     ,last_meta_fetch_()
     ,last_meta_error_()
-    ,io_service_()
-    ,work_(new boost::asio::io_service::work(io_service_))
-    ,asio_threads_(num_io_threads)
+    ,io_mode_(io_mode)
+    ,io_services_()
+    ,external_io_service_(nullptr)
+    ,share_connections_(false)
+    ,work_()
+    ,asio_threads_()
     ,stopping_(false)
+    ,maintenance_thread_()
+    ,maintenance_cv_()
+    ,interceptor_()
+    ,meta_cache_()
+    ,meta_validate_thread_()
+    ,in_flight_produces_(0)
+    ,drain_cv_()
+    ,cancel_waits_(false)
+    ,cancel_cv_()
     ,client_id_("synkafka_client")
+    ,metrics_()
+    ,memory_budget_(&metrics_.buffer_memory_used, &metrics_.buffer_memory_wait_us)
+    ,producer_mu_()
+    ,producer_id_(-1)
+    ,producer_epoch_(-1)
+    ,sequences_()
 {
-    broker_configs_ = string_to_brokers(brokers);
+    init_broker_configs(brokers);
 
-    // Randomize broker order so we "load balance" meta requests
-    // among them if multiple are given.
-    std::random_device rd;
-    std::mt19937 g(rd());
+    if (num_io_threads < 1) {
+        throw std::invalid_argument("ProducerClient needs at least one io thread");
+    }
 
-    std::shuffle(broker_configs_.begin(), broker_configs_.end(), g);
+    if (io_mode_ == IOThreadMode::ShardPerCore) {
+        // Concurrency hint of 1 lets asio know only one thread will ever run each of these
+        // so it can skip some internal locking.
+        for (int i = 0; i < num_io_threads; ++i) {
+            io_services_.emplace_back(new boost::asio::io_service(1));
+        }
+    } else {
+        io_services_.emplace_back(new boost::asio::io_service());
+    }
 
-    for (auto& t : asio_threads_) {
-        t = std::thread(&ProducerClient::run_asio, this);
+    for (auto& io : io_services_) {
+        work_.emplace_back(new boost::asio::io_service::work(*io));
+    }
+
+    for (int i = 0; i < num_io_threads; ++i) {
+        asio_threads_.emplace_back(&ProducerClient::run_asio, this, i);
+    }
+}
+
+ProducerClient::ProducerClient(const std::string& brokers, boost::asio::io_service& io_service, bool share_connections)
+    :broker_configs_()
+    ,brokers_()
+    ,partition_map_()
+    ,next_partition_()
+    ,topic_rate_limits_()
+    ,broker_rate_limits_()
+    ,mu_()
+    ,meta_fetch_mu_()
+    ,last_meta_fetch_()
+    ,last_meta_error_()
+    ,io_mode_(IOThreadMode::Shared)
+    ,io_services_()
+    ,external_io_service_(&io_service)
+    ,share_connections_(share_connections)
+    ,work_()
+    ,asio_threads_()
+    ,stopping_(false)
+    ,maintenance_thread_()
+    ,maintenance_cv_()
+    ,interceptor_()
+    ,meta_cache_()
+    ,meta_validate_thread_()
+    ,in_flight_produces_(0)
+    ,drain_cv_()
+    ,cancel_waits_(false)
+    ,cancel_cv_()
+    ,client_id_("synkafka_client")
+    ,metrics_()
+    ,memory_budget_(&metrics_.buffer_memory_used, &metrics_.buffer_memory_wait_us)
+    ,producer_mu_()
+    ,producer_id_(-1)
+    ,producer_epoch_(-1)
+    ,sequences_()
+{
+    init_broker_configs(brokers);
+
+    if (share_connections_) {
+        // Closing won't be able to close connections to fail our waits
+        sync_wait_.cancel = &cancel_waits_;
     }
 }
 
@@ -80,6 +164,175 @@ void ProducerClient::set_client_id(std::string client_id)
     client_id_ = std::move(client_id);
 }
 
+void ProducerClient::set_buffer_memory(size_t bytes)
+{
+    memory_budget_.set_limit(bytes);
+    metrics_.buffer_memory_limit.set(static_cast<int64_t>(bytes));
+}
+
+void ProducerClient::set_buffer_memory_block_timeout(int32_t milliseconds)
+{
+    buffer_memory_block_timeout_ = milliseconds;
+}
+
+void ProducerClient::set_idempotent(bool enable, int32_t max_retries, int32_t retry_backoff)
+{
+    idempotent_ = enable;
+    idempotent_retries_ = max_retries;
+    idempotent_retry_backoff_ = retry_backoff;
+}
+
+void ProducerClient::set_socket_options(const SocketOptions& opts)
+{
+    socket_options_ = opts;
+}
+
+void ProducerClient::set_connection_maintenance(int32_t idle_timeout, int32_t probe_interval)
+{
+    std::lock_guard<std::mutex> lk(mu_);
+
+    idle_timeout_ = idle_timeout;
+    probe_interval_ = probe_interval;
+
+    if ((idle_timeout_ > 0 || probe_interval_ > 0) && !maintenance_thread_.joinable() && !stopping_.load()) {
+        maintenance_thread_ = std::thread(&ProducerClient::run_maintenance, this);
+    }
+
+    // Wake it to pick up new intervals
+    maintenance_cv_.notify_all();
+}
+
+void ProducerClient::set_interceptor(std::shared_ptr<Interceptor> interceptor)
+{
+    interceptor_ = std::move(interceptor);
+}
+
+void ProducerClient::set_metadata_cache_file(const std::string& path)
+{
+    // Same lock order as refresh_meta(), and stops one writing the file while we swap it
+    std::lock_guard<std::mutex> meta_lock(meta_fetch_mu_);
+
+    meta_cache_.reset(new MetaCacheFile(path));
+
+    proto::MetadataResponse meta;
+    auto ec = meta_cache_->load(meta);
+    if (ec) {
+        if (ec != std::errc::no_such_file_or_directory) {
+            SYNKAFKA_LOG_WARN("Ignoring metadata cache file ") << path << ": " << ec.message();
+        }
+        return;
+    }
+
+    std::lock_guard<std::mutex> lk(mu_);
+
+    // Anything we've fetched for ourselves is newer than the file
+    if (!partition_map_.empty() || meta_validate_thread_.joinable() || stopping_.load()) {
+        return;
+    }
+
+    apply_meta_locked(meta);
+
+    SYNKAFKA_LOG_INFO("Loaded cached cluster meta from ") << path << ":\n" << debug_dump_meta();
+
+    meta_validate_thread_ = std::thread(&ProducerClient::validate_cached_meta, this);
+}
+
+void ProducerClient::set_reconnect_backoff(int32_t initial_backoff, int32_t max_backoff)
+{
+    std::lock_guard<std::mutex> lk(mu_);
+
+    reconnect_backoff_ = initial_backoff;
+    reconnect_backoff_max_ = max_backoff;
+
+    for (auto& b : brokers_) {
+        b.second.breaker->set_backoff(reconnect_backoff_, reconnect_backoff_max_);
+    }
+}
+
+void ProducerClient::set_topic_rate_limit(const std::string& topic, double bytes_per_sec, double requests_per_sec)
+{
+    std::lock_guard<std::mutex> lk(mu_);
+
+    if (bytes_per_sec <= 0 && requests_per_sec <= 0) {
+        topic_rate_limits_.erase(topic);
+    } else {
+        topic_rate_limits_[topic] = std::make_shared<RateLimiter>(bytes_per_sec, requests_per_sec);
+    }
+}
+
+void ProducerClient::set_broker_rate_limit(double bytes_per_sec, double requests_per_sec)
+{
+    std::lock_guard<std::mutex> lk(mu_);
+
+    broker_rate_limit_bytes_ = bytes_per_sec;
+    broker_rate_limit_requests_ = requests_per_sec;
+
+    // Start again with the new limits
+    broker_rate_limits_.clear();
+}
+
+void ProducerClient::set_rate_limit_timeout(int32_t milliseconds)
+{
+    rate_limit_timeout_ = milliseconds;
+}
+
+void ProducerClient::set_adaptive_concurrency(bool enable, int32_t initial_limit, int32_t max_limit)
+{
+    adaptive_concurrency_ = enable;
+    concurrency_initial_limit_ = initial_limit;
+    concurrency_max_limit_ = max_limit;
+}
+
+void ProducerClient::set_sync_wait(SyncWaitMode mode, int32_t spin_microseconds)
+{
+    if (mode == SyncWaitMode::RunIOLoop && io_mode_ == IOThreadMode::ShardPerCore) {
+        throw std::invalid_argument("SyncWaitMode::RunIOLoop can't be used with IOThreadMode::ShardPerCore");
+    }
+    sync_wait_ = SyncWaitPolicy{mode, spin_microseconds, sync_wait_.cancel};
+}
+
+void ProducerClient::set_shard_core_affinity(int first_core)
+{
+    if (io_mode_ != IOThreadMode::ShardPerCore) {
+        throw std::invalid_argument("Core affinity can only be set with IOThreadMode::ShardPerCore");
+    }
+    if (first_core < 0) {
+        throw std::invalid_argument("ProducerClient first_core must not be negative");
+    }
+
+#ifdef __linux__
+    auto cores = std::thread::hardware_concurrency();
+    if (cores == 0) {
+        return;
+    }
+
+    // Each shard's io_service is only run by it's own thread, so this is where the handler runs
+    for (size_t shard = 0; shard < io_services_.size(); ++shard) {
+        auto core = (static_cast<size_t>(first_core) + shard) % cores;
+        io_services_[shard]->post([shard, core]() {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(core, &cpus);
+            if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+                SYNKAFKA_LOG_WARN("ProducerClient failed to pin io shard ") << shard << " to core " << core;
+            }
+        });
+    }
+#endif
+}
+
+void ProducerClient::init_broker_configs(const std::string& brokers)
+{
+    broker_configs_ = string_to_brokers(brokers);
+
+    // Randomize broker order so we "load balance" meta requests
+    // among them if multiple are given.
+    std::random_device rd;
+    std::mt19937 g(rd());
+
+    std::shuffle(broker_configs_.begin(), broker_configs_.end(), g);
+}
+
 std::error_code ProducerClient::check_topic_partition_leader_available(const std::string& topic, int32_t partition_id)
 {
     return check_topic_partition_leader_available(topic, partition_id, nullptr);
@@ -99,127 +352,799 @@ std::error_code ProducerClient::check_topic_partition_leader_available(const std
         if (last_meta_error_) {
             return last_meta_error_;
         }
-        return make_error_code(kafka_error::UnknownTopicOrPartition);
-    }
+        return make_error_code(kafka_error::UnknownTopicOrPartition);
+    }
+
+    auto ec = check_breaker(broker);
+    if (ec) {
+        return ec;
+    }
+
+    // We got a broker! Try to connect (returns immediately if already connected)
+    broker->set_connect_timeout(connect_timeout_);
+    ec = broker->connect();
+
+    if (ec) {
+        close_broker(std::move(broker));
+    } else {
+        if (leader_id != nullptr) {
+            *leader_id = broker->get_config().node_id;
+        }
+    }
+
+    return ec;
+}
+
+std::vector<std::error_code> ProducerClient::check_topic_partitions_leader_available(const std::vector<std::pair<std::string, int32_t>>& partitions)
+{
+    std::vector<std::error_code> errors(partitions.size());
+
+    if (stopping_.load()) {
+        std::fill(errors.begin(), errors.end(), make_error_code(synkafka_error::client_stopping));
+        return errors;
+    }
+
+    // Leader node id for each requested partition, -1 if not known
+    std::vector<int32_t> leaders(partitions.size(), -1);
+    std::map<int32_t, std::shared_ptr<Broker>> leader_brokers;
+
+    // Resolve every partition against the same metadata snapshot. If any are unknown
+    // we refresh meta once and resolve them all again rather than refreshing per partition.
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        bool any_unknown = false;
+        leader_brokers.clear();
+
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+
+            for (size_t i = 0; i < partitions.size(); ++i) {
+                auto partition_it = partition_map_.find(Partition{partitions[i].first, partitions[i].second});
+                if (partition_it == partition_map_.end() || partition_it->second < 0) {
+                    leaders[i] = -1;
+                    any_unknown = true;
+                    continue;
+                }
+
+                leaders[i] = partition_it->second;
+
+                if (leader_brokers.count(leaders[i]) == 0) {
+                    auto broker = get_broker_for_node_locked(leaders[i]);
+                    if (broker == nullptr) {
+                        // Inconsistent meta, treat it like an unknown leader
+                        leaders[i] = -1;
+                        any_unknown = true;
+                        continue;
+                    }
+                    leader_brokers[leaders[i]] = std::move(broker);
+                }
+            }
+        }
+
+        if (!any_unknown || attempt > 0) {
+            break;
+        }
+
+        refresh_meta();
+    }
+
+    // Connect to each distinct leader that isn't already connected, all at once so the
+    // total time blocked is bounded by one connect_timeout rather than one per broker.
+    std::map<int32_t, std::future<std::error_code>> connects;
+    std::map<int32_t, std::error_code> leader_errors;
+    for (auto& lb : leader_brokers) {
+        auto broker = lb.second;
+        auto breaker_ec = check_breaker(broker);
+        if (breaker_ec) {
+            leader_errors[lb.first] = breaker_ec;
+            continue;
+        }
+        if (broker->is_connected()) {
+            continue;
+        }
+        broker->set_connect_timeout(connect_timeout_);
+        auto connected = std::make_shared<std::promise<std::error_code>>();
+        connects[lb.first] = connected->get_future();
+        broker->async_connect([connected](std::error_code ec) { connected->set_value(ec); });
+    }
+
+    for (auto& c : connects) {
+        auto ec = c.second.get();
+        if (ec) {
+            close_broker(leader_brokers[c.first]);
+        }
+        leader_errors[c.first] = ec;
+    }
+
+    std::error_code unknown_ec = last_meta_error_
+        ? last_meta_error_
+        : make_error_code(kafka_error::UnknownTopicOrPartition);
+
+    for (size_t i = 0; i < partitions.size(); ++i) {
+        if (leaders[i] < 0) {
+            errors[i] = unknown_ec;
+            continue;
+        }
+        auto err_it = leader_errors.find(leaders[i]);
+        if (err_it != leader_errors.end()) {
+            errors[i] = err_it->second;
+        }
+    }
+
+    return errors;
+}
+
+std::error_code ProducerClient::produce(const std::string& topic, int32_t partition_id, MessageSet& messages)
+{
+    return produce_partition(topic, partition_id, messages, nullptr);
+}
+
+std::error_code ProducerClient::produce_partition(const std::string& topic, int32_t partition_id, MessageSet& messages, bool* sent)
+{
+    metrics_.produce_requests.add();
+
+    std::error_code ec;
+
+    // Counted before checking stopping_ so that close() either waits for us or we see it's stopping
+    in_flight_produces_.fetch_add(1);
+
+    auto finished = [this]() {
+        if (in_flight_produces_.fetch_sub(1) == 1 && stopping_.load()) {
+            std::lock_guard<std::mutex> lk(mu_);
+            drain_cv_.notify_all();
+        }
+    };
+
+    if (stopping_.load()) {
+        ec = make_error_code(synkafka_error::client_stopping);
+    } else {
+        try {
+            ec = do_produce(topic, partition_id, messages, sent);
+        } catch (...) {
+            // Don't leave close() waiting for us
+            finished();
+            throw;
+        }
+
+        if (ec && stopping_.load() && ec.category() != kafka_category()) {
+            // Most likely close() gave up waiting and failed our request, a real answer from kafka is still passed on
+            ec = make_error_code(synkafka_error::client_stopping);
+        }
+    }
+
+    if (ec) {
+        metrics_.produce_errors.add();
+        metrics_.record_error(ec);
+    }
+
+    // Last, close() may return and the client go away as soon as we are done
+    finished();
+
+    return ec;
+}
+
+std::error_code ProducerClient::do_produce(const std::string& topic, int32_t partition_id, MessageSet& messages, bool* sent)
+{
+    if (stopping_.load()) {
+        return make_error_code(synkafka_error::client_stopping);
+    }
+
+    // Hold the encoded size of the batch against the memory budget until we have the response
+    // since that's roughly what the request buffer will take while it's in flight.
+    MemoryReservation reservation;
+    auto ec = memory_budget_.reserve(messages.get_encoded_size(), buffer_memory_block_timeout_, reservation);
+    if (ec) {
+        return ec;
+    }
+
+    Partition p{topic, partition_id};
+
+    if (idempotent_) {
+        return produce_idempotent(p, messages, sent);
+    }
+
+    auto broker = get_broker_for_partition(p);
+
+    if (broker == nullptr) {
+        if (last_meta_error_) {
+            return last_meta_error_;
+        }
+        return make_error_code(kafka_error::UnknownTopicOrPartition);
+    }
+
+    ec = check_breaker(broker);
+    if (ec) {
+        return ec;
+    }
+
+    // We got a broker! Try to connect (returns immediately if already connected)
+    broker->set_connect_timeout(connect_timeout_);
+    ec = broker->connect();
+
+    if (ec) {
+        close_broker(std::move(broker));
+        return ec;
+    }
+
+    ec = wait_for_rate_limits(p, broker->get_config().node_id, messages.get_encoded_size());
+    if (ec) {
+        return ec;
+    }
+
+    // We have a connected broker that is (at least last time we checked) leader
+    // for the partition. Send it batch!
+    proto::ProduceRequest rq{required_acks_
+                            ,produce_timeout_
+                            ,{proto::ProduceTopic{topic
+                                                 ,{proto::ProducePartition{partition_id
+                                                                           ,messages
+                                                                           }
+                                                  }
+                                                 }
+                             }
+                            };
+
+
+    proto::ProduceResponse resp;
+
+    auto trace = make_trace(p);
+
+    // sync_call() in steps so we know whether the request got as far as being queued to send
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(produce_timeout_ + produce_timeout_rtt_allowance_);
+
+    ConcurrencySlot slot;
+    ec = broker->acquire_slot(ApiKey::ProduceRequest, deadline, slot, trace, sync_wait_.cancel);
+
+    std::future<PacketDecoder> decoder_future;
+    if (!ec) {
+        ec = broker->start_call(rq, decoder_future, trace, std::move(slot));
+    }
+
+    if (!ec) {
+        if (sent != nullptr) {
+            *sent = true;
+        }
+        ec = broker->finish_call(decoder_future, resp, Broker::remaining_ms(deadline), sync_wait_, trace);
+    }
+
+    // The request holds it's own copy of the MessageSet which is the one that got encoded
+    auto& encoded = rq.topics[0].partitions[0].messages;
+    metrics_.encode_bytes_in.add(encoded.get_encoded_size());
+    metrics_.encode_bytes_out.add(encoded.get_wire_size());
+
+    if (ec) {
+        // All call error cases are client or network failures. Wipe out connection and hope
+        // we can do better next time. Except for the broker having too much in flight already
+        // which we'd only make worse by failing everything else in flight too.
+        if (ec != synkafka_error::in_flight_limit) {
+            close_broker(std::move(broker));
+        }
+        return ec;
+    }
+
+    // OK got a response, see if it is kafka-protocol error!
+    // We only ever produce one partition/topic at a time which makes this simpler.
+    // In fact that is the whole point of this library - no partial failures
+    if (!ec) {
+        if (resp.topics.size() != 1 || resp.topics[0].partitions.size() != 1) {
+            // Probably not possible?
+            ec = make_error_code(synkafka_error::unknown);
+        } else {
+            ec = resp.topics[0].partitions[0].err_code;
+        }
+    }
+
+    if (ec) {
+        if (trace) {
+            trace->interceptor->on_error(trace->trace, ec);
+        }
+
+        // All Kafka errors here are either transient or related to incorrect metadata
+        // or bad messages. There is really no need to close broker.
+        forget_stale_partition(p, ec, broker->get_config().node_id);
+        return ec;
+    }
+
+    return make_error_code(synkafka_error::no_error);
+}
+
+std::error_code ProducerClient::produce_any(const std::string& topic, MessageSet& messages
+                                           ,PartitionPolicy policy, int32_t* partition_id)
+{
+    if (partition_id != nullptr) {
+        *partition_id = -1;
+    }
+
+    std::set<int32_t> failed; // partitions that turned us away before anything was written
+    std::error_code ec;
+    bool connected_leaders = false;
+
+    for (;;) {
+        auto chosen = choose_partition(topic, policy, failed);
+
+        if (chosen < 0) {
+            if (!failed.empty() || connected_leaders) {
+                return ec ? ec : make_error_code(kafka_error::UnknownTopicOrPartition);
+            }
+
+            // Nothing connected (or we don't know the topic yet). Connect every leader at once and look again.
+            connected_leaders = true;
+
+            std::vector<std::pair<std::string, int32_t>> partitions;
+            for (int attempt = 0; attempt < 2 && partitions.empty(); ++attempt) {
+                if (attempt > 0) {
+                    refresh_meta();
+                }
+                std::lock_guard<std::mutex> lk(mu_);
+                for (auto it = partition_map_.lower_bound(Partition{topic, std::numeric_limits<int32_t>::min()})
+                    ;it != partition_map_.end() && it->first.topic == topic
+                    ;++it) {
+                    partitions.push_back(std::make_pair(topic, it->first.partition_id));
+                }
+            }
+
+            if (partitions.empty()) {
+                ec = last_meta_error_ ? last_meta_error_ : make_error_code(kafka_error::UnknownTopicOrPartition);
+            } else {
+                // Any one leader error will do if none of them are available
+                for (auto& leader_ec : check_topic_partitions_leader_available(partitions)) {
+                    ec = leader_ec;
+                    if (!ec) {
+                        break;
+                    }
+                }
+            }
+            continue;
+        }
+
+        if (partition_id != nullptr) {
+            *partition_id = chosen;
+        }
+
+        bool sent = false;
+        ec = produce_partition(topic, chosen, messages, &sent);
+
+        // Kafka rejected these before writing anything, or we never got as far as sending them,
+        // so another partition can have them
+        if (ec == kafka_error::NotLeaderForPartition
+            || ec == kafka_error::LeaderNotAvailable
+            || ec == kafka_error::UnknownTopicOrPartition
+            || (!sent && (ec == synkafka_error::network_fail
+                          || ec == synkafka_error::network_timeout
+                          || ec == synkafka_error::broker_unavailable
+                          || ec == synkafka_error::rate_limited
+                          || ec == synkafka_error::in_flight_limit))) {
+            failed.insert(chosen);
+            continue;
+        }
+
+        return ec;
+    }
+}
+
+int32_t ProducerClient::choose_partition(const std::string& topic, PartitionPolicy policy, const std::set<int32_t>& exclude)
+{
+    std::lock_guard<std::mutex> lk(mu_);
+
+    // Connected partitions with how much we'd rather not use them
+    std::vector<std::pair<int32_t, int64_t>> candidates;
+
+    for (auto it = partition_map_.lower_bound(Partition{topic, std::numeric_limits<int32_t>::min()})
+        ;it != partition_map_.end() && it->first.topic == topic
+        ;++it) {
+        if (it->second < 0 || exclude.count(it->first.partition_id) > 0) {
+            continue;
+        }
+
+        auto broker_it = brokers_.find(it->second);
+        if (broker_it == brokers_.end() || broker_it->second.broker == nullptr
+            || !broker_it->second.broker->is_connected() || broker_it->second.breaker->is_open()) {
+            continue;
+        }
+
+        int64_t cost = 0;
+        switch (policy)
+        {
+        case PartitionPolicy::RoundRobin:
+            break;
+        case PartitionPolicy::LeastOutstanding:
+            cost = broker_it->second.broker->outstanding_requests();
+            break;
+        case PartitionPolicy::LowestLatency:
+            cost = broker_it->second.broker->latency_ewma_us();
+            break;
+        }
+
+        candidates.push_back(std::make_pair(it->first.partition_id, cost));
+    }
+
+    if (candidates.empty()) {
+        return -1;
+    }
+
+    // Start looking from the next round robin position so that ties (all of them for RoundRobin)
+    // are spread over the partitions rather than always going to the first
+    auto start = next_partition_[topic]++;
+    auto best = candidates[start % candidates.size()];
+    for (size_t i = 1; i < candidates.size(); ++i) {
+        auto& c = candidates[(start + i) % candidates.size()];
+        if (c.second < best.second) {
+            best = c;
+        }
+    }
+
+    return best.first;
+}
+
+std::error_code ProducerClient::wait_for_rate_limits(const Partition& p, int32_t node_id, size_t bytes)
+{
+    std::shared_ptr<RateLimiter> limits[2];
+
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+
+        auto topic_it = topic_rate_limits_.find(p.topic);
+        if (topic_it != topic_rate_limits_.end()) {
+            limits[0] = topic_it->second;
+        }
+
+        if (broker_rate_limit_bytes_ > 0 || broker_rate_limit_requests_ > 0) {
+            auto& broker_limit = broker_rate_limits_[node_id];
+            if (broker_limit == nullptr) {
+                broker_limit = std::make_shared<RateLimiter>(broker_rate_limit_bytes_, broker_rate_limit_requests_);
+            }
+            limits[1] = broker_limit;
+        }
+    }
+
+    // Take from both first so we wait once for whichever is further behind
+    std::chrono::microseconds delay(0);
+    for (auto& limit : limits) {
+        if (limit) {
+            delay = std::max(delay, limit->take(bytes));
+        }
+    }
+
+    if (delay.count() == 0) {
+        return std::error_code();
+    }
+
+    if (delay > std::chrono::milliseconds(rate_limit_timeout_)) {
+        // Not sending after all so don't count it against the limits
+        for (auto& limit : limits) {
+            if (limit) {
+                limit->give_back(bytes);
+            }
+        }
+        return make_error_code(synkafka_error::rate_limited);
+    }
+
+    metrics_.rate_limit_delays.add();
+    metrics_.rate_limit_wait_us.add(delay.count());
+
+    std::unique_lock<std::mutex> lk(mu_);
+    if (cancel_cv_.wait_for(lk, delay, [this]() { return cancel_waits_.load(); })) {
+        // close() ran out of time while we were waiting
+        lk.unlock();
+        for (auto& limit : limits) {
+            if (limit) {
+                limit->give_back(bytes);
+            }
+        }
+        return make_error_code(synkafka_error::client_stopping);
+    }
+
+    return std::error_code();
+}
+
+trace_context_t ProducerClient::make_trace(const Partition& p)
+{
+    if (!interceptor_) {
+        return nullptr;
+    }
+
+    RequestTrace t;
+    t.topic = p.topic;
+    t.partition_id = p.partition_id;
+    return std::make_shared<TraceContext>(interceptor_, std::move(t));
+}
+
+void ProducerClient::forget_stale_partition(const Partition& p, const std::error_code& ec, int32_t node_id)
+{
+    if (ec == kafka_error::NotLeaderForPartition
+        || ec == kafka_error::UnknownTopicOrPartition // if broker returns this then our meta is out of date...
+        || ec == kafka_error::LeaderNotAvailable      // during election, meta is stale but refresh won't help till election is done
+        || ec == kafka_error::ReplicaNotAvailable     // pretty sure this is not even possible from a produce but semantically meta-related
+        ) {
+        // All of these cases indicate our meta-data is out of date.
+        // Instead of reloading it right now (which is likely wasted effort in some cases like)
+        // during leadership election, we simple remove the partition from the mapping
+        // such that next request to produce to it or check availability will result in re-fetch
+        // of meta. This allows client to back-off for certain error types etc. As may be appropriate to them
+        {
+            std::unique_lock<std::mutex> lk(mu_);
+
+            auto partition_it = partition_map_.find(p);
+            if (partition_it != partition_map_.end()) {
+                partition_map_.erase(partition_it);
+            }
+        }
+
+        SYNKAFKA_LOG_WARN("Metadata is stale: produce to broker ") << node_id
+            << " for [" << p.topic << "," << p.partition_id << "] returned: " << ec.message();
+    }
+}
+
+namespace {
+
+// Errors after which an idempotent produce can safely be resent with the same sequence number
+bool is_retriable(const std::error_code& ec)
+{
+    return ec == synkafka_error::network_fail
+        || ec == synkafka_error::network_timeout
+        || ec == kafka_error::NotLeaderForPartition
+        || ec == kafka_error::UnknownTopicOrPartition
+        || ec == kafka_error::LeaderNotAvailable
+        || ec == kafka_error::RequestTimedOut
+        || ec == kafka_error::NotEnoughReplicas
+        || ec == kafka_error::NotEnoughReplicasAfterAppend;
+}
+
+}
+
+std::error_code ProducerClient::produce_idempotent(const Partition& p, MessageSet& messages, bool* sent)
+{
+    if (required_acks_ != -1) {
+        // Brokers refuse idempotent produce unless all in sync replicas ack
+        return make_error_code(synkafka_error::bad_config);
+    }
+
+    auto now = std::chrono::system_clock::now().time_since_epoch();
+
+    proto::ProduceRequestV3 rq{slice()
+                              ,required_acks_
+                              ,produce_timeout_
+                              ,{proto::ProduceTopicV3{p.topic
+                                                     ,{proto::RecordBatchPartition{p.partition_id
+                                                                                  ,messages
+                                                                                  ,ProducerIdentity{-1, -1, 0}
+                                                                                  ,std::chrono::duration_cast<std::chrono::milliseconds>(now).count()
+                                                                                  ,0
+                                                                                  }
+                                                      }
+                                                     }
+                               }
+                              };
+
+    auto& batch = rq.topics[0].partitions[0];
+    std::shared_ptr<PartitionSequence> seq;
+    bool assigned = false;
+    std::error_code ec;
+
+    for (int32_t attempt = 0; attempt <= idempotent_retries_; ++attempt) {
+        if (attempt > 0) {
+            metrics_.produce_retries.add();
+
+            // Give the cluster a moment to elect a new leader or the network to recover, otherwise with no
+            // broker to send to we'd just spin through metadata refreshes and connects.
+            if (idempotent_retry_backoff_ > 0 && !stopping_.load()) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(idempotent_retry_backoff_));
+            }
+        }
+
+        if (stopping_.load()) {
+            ec = make_error_code(synkafka_error::client_stopping);
+            break;
+        }
+
+        auto broker = get_broker_for_partition(p);
+
+        if (broker == nullptr) {
+            ec = last_meta_error_ ? last_meta_error_ : make_error_code(kafka_error::UnknownTopicOrPartition);
+            if (is_retriable(ec)) {
+                continue;
+            }
+            break;
+        }
+
+        ec = check_breaker(broker);
+        if (ec) {
+            // Not worth retrying until it's backed off
+            break;
+        }
+
+        broker->set_connect_timeout(connect_timeout_);
+        ec = broker->connect();
+
+        if (ec) {
+            close_broker(std::move(broker));
+            continue;
+        }
+
+        ProducerIdentity producer{-1, -1, 0};
+        if (!assigned) {
+            ec = ensure_producer_id(*broker, p, producer, seq);
+
+            if (ec) {
+                if (is_retriable(ec)) {
+                    close_broker(std::move(broker));
+                    continue;
+                }
+                break;
+            }
+        }
+
+        // Every attempt is more traffic so each is held to the limits
+        ec = wait_for_rate_limits(p, broker->get_config().node_id, messages.get_encoded_size());
+        if (ec) {
+            break;
+        }
+
+        // Each attempt is a new request so gets a trace of it's own
+        auto trace = make_trace(p);
+
+        // The wait for a concurrency slot comes out of the same timeout as the response, and happens
+        // before taking the partition's lock so other batches for it aren't held up behind us
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(produce_timeout_ + produce_timeout_rtt_allowance_);
+
+        ConcurrencySlot slot;
+        ec = broker->acquire_slot(ApiKey::ProduceRequest, deadline, slot, trace, sync_wait_.cancel);
+        if (ec) {
+            break;
+        }
 
-    // We got a broker! Try to connect (returns immediately if already connected)
-    broker->set_connect_timeout(connect_timeout_);
-    auto ec = broker->connect();
+        std::future<PacketDecoder> decoder_future;
+        {
+            // Sequence assignment and queuing happen under the partition's lock so batches are sent
+            // in sequence order. Retries keep the sequence they were first given so the broker can
+            // drop them if an earlier attempt was actually written.
+            std::lock_guard<std::mutex> lk(seq->mu);
+
+            if (!assigned) {
+                producer.base_sequence = seq->next;
+                batch.producer = producer;
+                seq->next = next_sequence(seq->next, static_cast<int32_t>(messages.get_messages().size()));
+                seq->in_flight.insert(producer.base_sequence);
+                assigned = true;
+            }
 
-    if (ec) {
-        close_broker(std::move(broker));
-    } else {
-        if (leader_id != nullptr) {
-            *leader_id = broker->get_config().node_id;
+            ec = broker->start_call(rq, decoder_future, trace, std::move(slot));
         }
-    }
 
-    return ec;
-}
+        if (sent != nullptr) {
+            // Even a failed start may have left an earlier attempt's copy with the broker
+            *sent = true;
+        }
 
-std::error_code ProducerClient::produce(const std::string& topic, int32_t partition_id, MessageSet& messages)
-{
-    if (stopping_.load()) {
-        return make_error_code(synkafka_error::client_stopping);
-    }
+        if (ec) {
+            break;
+        }
 
-    Partition p{topic, partition_id};
+        proto::ProduceResponseV3 resp;
+        ec = broker->finish_call(decoder_future, resp, Broker::remaining_ms(deadline), sync_wait_, trace);
 
-    auto broker = get_broker_for_partition(p);
+        metrics_.encode_bytes_in.add(batch.messages.get_encoded_size());
+        metrics_.encode_bytes_out.add(batch.wire_size);
 
-    if (broker == nullptr) {
-        if (last_meta_error_) {
-            return last_meta_error_;
+        if (ec) {
+            if (ec != synkafka_error::in_flight_limit) {
+                close_broker(std::move(broker));
+            }
+            if (is_retriable(ec)) {
+                continue;
+            }
+            break;
         }
-        return make_error_code(kafka_error::UnknownTopicOrPartition);
-    }
 
-    // We got a broker! Try to connect (returns immediately if already connected)
-    broker->set_connect_timeout(connect_timeout_);
-    auto ec = broker->connect();
+        if (resp.topics.size() != 1 || resp.topics[0].partitions.size() != 1) {
+            ec = make_error_code(synkafka_error::unknown);
+            break;
+        }
 
-    if (ec) {
-        close_broker(std::move(broker));
-        return ec;
-    }
+        ec = resp.topics[0].partitions[0].err_code;
 
-    // We have a connected broker that is (at least last time we checked) leader
-    // for the partition. Send it batch!
-    proto::ProduceRequest rq{required_acks_
-                            ,produce_timeout_
-                            ,{proto::ProduceTopic{topic
-                                                 ,{proto::ProducePartition{partition_id
-                                                                           ,messages
-                                                                           }
-                                                  }
-                                                 }
-                             }
-                            };
+        if (ec == kafka_error::DuplicateSequenceNumber) {
+            // An earlier attempt got written, which is what we wanted
+            ec = make_error_code(synkafka_error::no_error);
+        }
 
+        if (!ec) {
+            break;
+        }
 
-    proto::ProduceResponse resp;
+        if (trace) {
+            trace->interceptor->on_error(trace->trace, ec);
+        }
 
-    ec = broker->sync_call(rq, resp, produce_timeout_ + produce_timeout_rtt_allowance_);
+        forget_stale_partition(p, ec, broker->get_config().node_id);
 
-    if (ec) {
-        // All call error cases are client or network failures. Wipe out connection and hope
-        // we can do better next time.
-        close_broker(std::move(broker));
-        return ec;
+        if (ec == kafka_error::OutOfOrderSequenceNumber) {
+            // If a batch ahead of us in the sequence is still in flight it's probably being retried and we
+            // just overtook it. Try again after it.
+            std::lock_guard<std::mutex> lk(seq->mu);
+            if (!seq->in_flight.empty() && *seq->in_flight.begin() != batch.producer.base_sequence) {
+                continue;
+            }
+        }
+
+        if (is_retriable(ec)) {
+            continue;
+        }
+
+        break;
     }
 
-    // OK got a response, see if it is kafka-protocol error!
-    // We only ever produce one partition/topic at a time which makes this simpler.
-    // In fact that is the whole point of this library - no partial failures
-    if (!ec) {
-        if (resp.topics.size() != 1 || resp.topics[0].partitions.size() != 1) {
-            // Probably not possible?
-            ec = make_error_code(synkafka_error::unknown);
-        } else {
-            ec = resp.topics[0].partitions[0].err_code;
+    if (assigned) {
+        {
+            std::lock_guard<std::mutex> lk(seq->mu);
+            seq->in_flight.erase(batch.producer.base_sequence);
+        }
+
+        if (ec) {
+            // The batch may never have been written, leaving a gap in the partition's sequence that would
+            // make every later batch fail. Start over with a new producer id on the next produce.
+            reset_producer_id(batch.producer);
         }
     }
 
-    if (ec) {
-        // All Kafka errors here are either transient or related to incorrect metadata
-        // or bad messages. There is really no need to close broker.
+    return ec;
+}
 
-        if (ec == kafka_error::NotLeaderForPartition
-            || ec == kafka_error::UnknownTopicOrPartition // if broker returns this then our meta is out of date...
-            || ec == kafka_error::LeaderNotAvailable      // during election, meta is stale but refresh won't help till election is done
-            || ec == kafka_error::ReplicaNotAvailable     // pretty sure this is not even possible from a produce but semantically meta-related
-            ) {
-            // All of these cases indicate our meta-data is out of date.
-            // Instead of reloading it right now (which is likely wasted effort in some cases like)
-            // during leadership election, we simple remove the partition from the mapping
-            // such that next request to produce to it or check availability will result in re-fetch
-            // of meta. This allows client to back-off for certain error types etc. As may be appropriate to them
-            {
-                std::unique_lock<std::mutex> lk(mu_);
-
-                auto partition_it = partition_map_.find(p);
-                if (partition_it != partition_map_.end()) {
-                    partition_map_.erase(partition_it);
-                }
-            }
+std::error_code ProducerClient::ensure_producer_id(Broker& broker, const Partition& p
+                                                  ,ProducerIdentity& producer, std::shared_ptr<PartitionSequence>& seq)
+{
+    std::lock_guard<std::mutex> lk(producer_mu_);
 
-            log()->warn("Metadata is stale: produce to broker ") << broker->get_config().node_id
-                << " for [" << topic << "," << partition_id << "] returned: " << ec.message();
+    if (producer_id_ < 0) {
+        // Transaction timeout isn't used without a transactional id but must be valid for the broker
+        proto::InitProducerIdRequest req{slice(), 60000};
+        proto::InitProducerIdResponse resp;
 
+        auto ec = broker.sync_call(req, resp, connect_timeout_);
+        if (!ec) {
+            ec = resp.err_code;
         }
-        return ec;
+        if (ec) {
+            SYNKAFKA_LOG_WARN("Failed to get idempotent producer id from broker ") << broker.get_config().node_id
+                << ": " << ec.message();
+            return ec;
+        }
+
+        producer_id_ = resp.producer_id;
+        producer_epoch_ = resp.producer_epoch;
+    }
+
+    producer.producer_id = producer_id_;
+    producer.producer_epoch = producer_epoch_;
+
+    // Sequences belong to a producer id so must be looked up together with it
+    auto& s = sequences_[p];
+    if (!s) {
+        s = std::make_shared<PartitionSequence>();
     }
+    seq = s;
 
     return make_error_code(synkafka_error::no_error);
 }
 
+void ProducerClient::reset_producer_id(const ProducerIdentity& failed)
+{
+    std::lock_guard<std::mutex> lk(producer_mu_);
+
+    // Another thread may already have started over
+    if (producer_id_ == failed.producer_id && producer_epoch_ == failed.producer_epoch) {
+        producer_id_ = -1;
+        producer_epoch_ = -1;
+        sequences_.clear();
+    }
+}
+
 std::shared_ptr<Broker> ProducerClient::get_broker_for_partition(const Partition& p, bool refresh_meta)
 {
     std::unique_lock<std::mutex> lk(mu_);
 
     auto partition_it = partition_map_.find(p);
     if (partition_it == partition_map_.end() || partition_it->second < 0) {
-        log()->debug("Don't know about partition (or no leader was elected yet) [") << p.topic << "," << p.partition_id << "] refresh meta: " << refresh_meta
+        SYNKAFKA_LOG_DEBUG("Don't know about partition (or no leader was elected yet) [") << p.topic << "," << p.partition_id << "] refresh meta: " << refresh_meta
             << "\n" << debug_dump_meta();
         // Don't know about that partition, re-fetch metadata?
         if (refresh_meta) {
@@ -234,26 +1159,58 @@ std::shared_ptr<Broker> ProducerClient::get_broker_for_partition(const Partition
     }
 
     // We know that partition, lets find it's broker
-    auto broker_it = brokers_.find(partition_it->second);
-    if (broker_it == brokers_.end()) {
+    auto broker = get_broker_for_node_locked(partition_it->second);
+    if (broker == nullptr) {
         // Brokers list doesn't have entry, this can't happen (tm)
         // since meta data fetch should always update both and Kafka should never
-        // return a partition assigned to a broker that it doesn't also have in the cluster
-        lk.unlock();
-        close();
-        throw std::runtime_error("No broker object made for a known partition. Kafka is trolling you or there is a bug. Closing client.");
+        // return a partition assigned to a broker that it doesn't also have in the cluster.
+        // We're inside a produce() that close() would wait for so only stop accepting new ones here,
+        // the rest is left to close() (or the destructor) once we've returned.
+        stopping_ = true;
+        maintenance_cv_.notify_all();
+        throw std::runtime_error("No broker object made for a known partition. Kafka is trolling you or there is a bug. Stopping client.");
+    }
+
+    return broker;
+}
+
+std::shared_ptr<Broker> ProducerClient::get_broker_for_node_locked(int32_t node_id)
+{
+    auto broker_it = brokers_.find(node_id);
+    if (broker_it == brokers_.end()) {
+        return std::shared_ptr<Broker>(nullptr);
     }
 
     if (broker_it->second.broker == nullptr
         || broker_it->second.broker->is_closed()) {
         // We have a null broker pointer which means it's not connected yet, create a new instance...
         // Or it already failed and got disconnected internally, so we reset.
-        broker_it->second.broker = std::make_shared<Broker>(io_service_
-                                                           ,broker_it->second.config.host
-                                                           ,broker_it->second.config.port
-                                                           ,client_id_
-                                                           );
+        if (broker_it->second.had_broker) {
+            metrics_.reconnects.add();
+        }
+        broker_it->second.had_broker = true;
+        if (share_connections_) {
+            // Might be an existing connection another client is already using
+            broker_it->second.broker = BrokerRegistry::instance().get(io_service_for(broker_it->first)
+                                                                     ,broker_it->second.config.host
+                                                                     ,broker_it->second.config.port
+                                                                     ,client_id_
+                                                                     ,metrics_.broker(broker_it->first)
+                                                                     );
+        } else {
+            broker_it->second.broker = std::make_shared<Broker>(io_service_for(broker_it->first)
+                                                               ,broker_it->second.config.host
+                                                               ,broker_it->second.config.port
+                                                               ,client_id_
+                                                               ,metrics_.broker(broker_it->first)
+                                                               );
+        }
         broker_it->second.broker->set_node_id(broker_it->first);
+        broker_it->second.broker->set_socket_options(socket_options_);
+        // A shared connection may already have one, which we share too
+        if (adaptive_concurrency_ && !broker_it->second.broker->has_adaptive_concurrency()) {
+            broker_it->second.broker->set_adaptive_concurrency(concurrency_initial_limit_, concurrency_max_limit_);
+        }
     }
 
     return broker_it->second.broker;
@@ -265,26 +1222,76 @@ void ProducerClient::close_broker(std::shared_ptr<Broker> broker)
     // We should clean up the broker (close it as it's now failed, and reset our pointer so it is removed)
     std::lock_guard<std::mutex> lk(mu_);
 
-    // Close broker
-    broker->close();
+    // Close broker. A shared connection may still be fine for the other clients using it, and closing it
+    // would fail all of their requests too, so we only let go of ours: whoever holds the last reference
+    // closes it (as does dropping our own bootstrap brokers).
+    if (!share_connections_) {
+        broker->close();
+    }
 
     // Must go and locate this broker in the map if it's there and reset it
-    auto broker_it = brokers_.find(broker->get_config().node_id);
-    if (broker_it != brokers_.end()) {
-            if (broker_it->second.broker == broker) {
-                // Same broker pointer still in map, reset it to free the broker instance
-                // We will auto-create a new instance when someone next tries to connect to it
-                broker_it->second.broker.reset();
-            }
+    auto node_id = broker->get_config().node_id;
+    auto broker_it = brokers_.find(node_id);
+    if (broker_it == brokers_.end() || broker_it->second.broker != broker) {
+        // Not ours (a bootstrap broker) or someone already dealt with it
+        return;
     }
 
-    // Mark metadata as dirty so next call, reloads it
+    // Same broker pointer still in map, reset it to free the broker instance
+    // We will auto-create a new instance when someone next tries to connect to it
+    broker_it->second.broker.reset();
+    broker_it->second.breaker->record_failure();
+
+    // Mark metadata for the partitions it leads as dirty so the next call for them reloads it
     // we don't do it here in case this was being closed after a timeout and we will exceed time
     // blocked by also waiting to refresh meta.
     // This is necessary in several cases including if the leader for a partition dies: in this case
     // we must reload meta to discover who new leader is. Without this we would be stuck trying to contact
-    // old master indefinitely.
-    partition_map_.clear();
+    // old master indefinitely. Partitions on other brokers are unaffected so we leave them be.
+    for (auto it = partition_map_.begin(); it != partition_map_.end(); /* no increment */) {
+        if (it->second == node_id) {
+            partition_map_.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+}
+
+std::error_code ProducerClient::check_breaker(const std::shared_ptr<Broker>& broker)
+{
+    std::shared_ptr<CircuitBreaker> breaker;
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        auto broker_it = brokers_.find(broker->get_config().node_id);
+        if (broker_it == brokers_.end() || broker_it->second.broker != broker) {
+            return std::error_code();
+        }
+        breaker = broker_it->second.breaker;
+    }
+
+    bool start_probe = false;
+    if (breaker->allow(start_probe)) {
+        return std::error_code();
+    }
+
+    if (start_probe) {
+        // Find out in the background, this and everyone else keeps failing fast until it's done.
+        // The handler only touches the breaker so it's fine if it runs after we're gone.
+        auto node_id = broker->get_config().node_id;
+        SYNKAFKA_LOG_DEBUG("Probing broker ") << node_id << " after " << breaker->failures() << " failures";
+        broker->set_connect_timeout(connect_timeout_);
+        broker->async_connect([breaker, node_id](std::error_code ec) {
+            if (ec) {
+                breaker->record_failure();
+            } else {
+                SYNKAFKA_LOG_INFO("Broker ") << node_id << " is reachable again";
+                breaker->record_success();
+            }
+        });
+    }
+
+    metrics_.breaker_rejections.add();
+    return make_error_code(synkafka_error::broker_unavailable);
 }
 
 void ProducerClient::refresh_meta(int attempts)
@@ -300,35 +1307,49 @@ void ProducerClient::refresh_meta(int attempts)
     if (last_meta_fetch_ >= requested_at) {
         // Some other thread completed a meta fetch while we were waiting on lock. No need to
         // do it ourselves.
-        log()->debug("ProducerClient thread was waiting on meta update that happened elsewhere");
+        SYNKAFKA_LOG_DEBUG("ProducerClient thread was waiting on meta update that happened elsewhere");
         return;
     }
 
+    metrics_.meta_refreshes.add();
+    if (attempts > 0) {
+        metrics_.meta_refresh_retries.add();
+    }
+
+    auto started_at = std::chrono::steady_clock::now();
+    auto record_duration = [&]() {
+        auto took = std::chrono::steady_clock::now() - started_at;
+        metrics_.meta_refresh_duration_us.add(std::chrono::duration_cast<std::chrono::microseconds>(took).count());
+    };
+
     // Fetch meta data from one connected broker. If there are none, bootstrap from the initial config list
     std::shared_ptr<Broker> broker;
 
     {
         std::lock_guard<std::mutex> lk(mu_);
 
-        // First non-null broker will do...
+        // Use whichever open broker has the least queued up so we aren't stuck behind big produces
         for (auto& b : brokers_) {
-            if (b.second.broker != nullptr && !b.second.broker->is_closed()) {
+            if (b.second.broker != nullptr && !b.second.broker->is_closed()
+                && (broker == nullptr || b.second.broker->outstanding_requests() < broker->outstanding_requests())) {
                 broker = b.second.broker;
-                break;
             }
         }
 
         if (broker == nullptr) {
             // No connected brokers, try each one from config (they are randomly ordered on construction)
+            int32_t cfg_idx = 0;
             for (auto& cfg : broker_configs_) {
                 // Try creating a broker from this config and see if we can fetch metadata in the timeout
-                broker = std::make_shared<Broker>(io_service_
+                broker = std::make_shared<Broker>(io_service_for(cfg_idx++)
                                                  ,cfg.host
                                                  ,cfg.port
                                                  ,client_id_
+                                                 ,metrics_.broker(Metrics::BootstrapNodeId)
                                                  );
 
                 broker->set_connect_timeout(connect_timeout_);
+                broker->set_socket_options(socket_options_);
                 last_meta_error_ = broker->connect();
 
                 if (!last_meta_error_) {
@@ -340,6 +1361,8 @@ void ProducerClient::refresh_meta(int attempts)
 
         if (broker == nullptr || broker->is_closed()) {
             // Still not connected? not much more we can do
+            metrics_.meta_refresh_failures.add();
+            record_duration();
             return;
         }
     }
@@ -354,6 +1377,9 @@ void ProducerClient::refresh_meta(int attempts)
     std::error_code ec = broker->sync_call(req, resp, connect_timeout_);
 
     if (ec) {
+        metrics_.meta_refresh_failures.add();
+        record_duration();
+
         // Close and reset broker that failed
         close_broker(std::move(broker));
 
@@ -369,112 +1395,357 @@ void ProducerClient::refresh_meta(int attempts)
         return;
     }
 
-    // Now build our internal data structures
-
-    // First lets add Broker objects if we don't know about them already
     {
         std::lock_guard<std::mutex> lk(mu_);
 
         // No error, clear last error
         last_meta_error_ = make_error_code(synkafka_error::no_error);
 
-        std::set<int32_t> live_broker_ids;
+        apply_meta_locked(resp);
 
-        for (auto& broker : resp.brokers) {
-            live_broker_ids.insert(broker.node_id);
+        SYNKAFKA_LOG_INFO("Updated Cluster Meta:\n") << debug_dump_meta();
+    }
 
-            auto broker_it = brokers_.find(broker.node_id);
-            if (broker_it == brokers_.end()) {
-                // New broker, add it
-                brokers_.insert(std::make_pair(broker.node_id
-                                              ,BrokerContainer{broker
-                                                                ,{nullptr}
-                                                                }
-                                              )
-                               );
-            } else {
-                // We already know of broker by that id, sanity check it's still configured the same...
-                if (broker_it->second.config.host != broker.host || broker_it->second.config.port != broker.port) {
-                    // disconnect and create a new one...
-                    broker_it->second.broker->close();
+    // Still holding meta_fetch_mu_ so only one refresh writes the file at a time
+    if (meta_cache_ != nullptr) {
+        auto save_ec = meta_cache_->save(resp);
+        if (save_ec) {
+            SYNKAFKA_LOG_WARN("Failed to write metadata cache file ") << meta_cache_->path() << ": " << save_ec.message();
+        }
+    }
+
+    last_meta_fetch_ = std::chrono::system_clock::now();
+    record_duration();
+}
+
+void ProducerClient::apply_meta_locked(const proto::MetadataResponse& meta)
+{
+    // First lets add Broker objects if we don't know about them already
+    std::set<int32_t> live_broker_ids;
+
+    for (auto& broker : meta.brokers) {
+        live_broker_ids.insert(broker.node_id);
+
+        auto broker_it = brokers_.find(broker.node_id);
+        if (broker_it == brokers_.end()) {
+            // New broker, add it
+            brokers_.insert(std::make_pair(broker.node_id
+                                          ,BrokerContainer{broker
+                                                            ,{nullptr}
+                                                            ,false
+                                                            ,std::make_shared<CircuitBreaker>(reconnect_backoff_, reconnect_backoff_max_)
+                                                            }
+                                          )
+                           );
+        } else {
+            // We already know of broker by that id, sanity check it's still configured the same...
+            if (broker_it->second.config.host != broker.host || broker_it->second.config.port != broker.port) {
+                // disconnect and create a new one at the new address when it's next needed...
+                // (which can happen to cached meta after a broker moves)
+                if (broker_it->second.broker) {
+                    if (!share_connections_) {
+                        broker_it->second.broker->close();
+                    }
                     broker_it->second.broker.reset();
                 }
+                broker_it->second.config = broker;
+                broker_it->second.breaker->record_success();
             }
         }
+    }
 
-        if (live_broker_ids.size() < brokers_.size()) {
-            // Some brokers have been removed from cluster remove them from our state too
-            for (auto b_it = brokers_.cbegin(); b_it != brokers_.end(); /* no increment */) {
-                if (live_broker_ids.count(b_it->first) == 0) {
-                    if (b_it->second.broker) {
-                        b_it->second.broker->close();
-                    }
-                    brokers_.erase(b_it++);
-                } else {
-                    ++b_it;
+    if (live_broker_ids.size() < brokers_.size()) {
+        // Some brokers have been removed from cluster remove them from our state too
+        for (auto b_it = brokers_.cbegin(); b_it != brokers_.end(); /* no increment */) {
+            if (live_broker_ids.count(b_it->first) == 0) {
+                if (b_it->second.broker && !share_connections_) {
+                    b_it->second.broker->close();
                 }
+                brokers_.erase(b_it++);
+            } else {
+                ++b_it;
             }
         }
+    }
 
-        // Now update partition map too
-        std::map<Partition, int32_t> new_map;
+    // Now update partition map too
+    std::map<Partition, int32_t> new_map;
 
-        for (auto& topic : resp.topics) {
-            for (auto& part : topic.partitions) {
-                new_map.insert(std::make_pair(Partition{topic.name, part.partition_id}, part.leader));
-            }
+    for (auto& topic : meta.topics) {
+        for (auto& part : topic.partitions) {
+            new_map.insert(std::make_pair(Partition{topic.name, part.partition_id}, part.leader));
+        }
+    }
+
+    // Swap!
+    partition_map_.swap(new_map);
+}
+
+void ProducerClient::validate_cached_meta()
+{
+    // Fetch from one of the cached brokers rather than the bootstrap list, which is what
+    // lets a fleet restart without them all hitting the bootstrap brokers at once.
+    // refresh_meta() uses whichever broker is open so all we need to do is connect one.
+    std::vector<int32_t> node_ids;
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        for (auto& b : brokers_) {
+            node_ids.push_back(b.first);
+        }
+    }
+
+    std::random_device rd;
+    std::mt19937 g(rd());
+    std::shuffle(node_ids.begin(), node_ids.end(), g);
+
+    for (auto node_id : node_ids) {
+        if (stopping_.load()) {
+            return;
+        }
+
+        std::shared_ptr<Broker> broker;
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            broker = get_broker_for_node_locked(node_id);
+        }
+        if (broker == nullptr) {
+            continue;
         }
 
-        // Swap!
-        partition_map_.swap(new_map);
+        broker->set_connect_timeout(connect_timeout_);
+        if (!broker->connect()) {
+            break;
+        }
+        // A failed broker is closed and replaced on next use, the cached leaders on it are left for
+        // produce() to find out about so producing to other brokers isn't held up by this one
+    }
 
-        log()->info("Updated Cluster Meta:\n") << debug_dump_meta();
+    if (!stopping_.load()) {
+        refresh_meta();
     }
-    last_meta_fetch_ = std::chrono::system_clock::now();
 }
 
-void ProducerClient::close()
+void ProducerClient::close(int32_t drain_milliseconds)
 {
     {
         std::lock_guard<std::mutex> lg(mu_);
         stopping_ = true;
+        maintenance_cv_.notify_all();
+    }
+
+    // Maintenance may be mid-probe which needs the io threads so stop it first
+    if (maintenance_thread_.joinable()) {
+        maintenance_thread_.join();
+    }
+    if (meta_validate_thread_.joinable()) {
+        meta_validate_thread_.join();
+    }
+
+    {
+        std::unique_lock<std::mutex> lk(mu_);
+        auto drained = [this]() { return in_flight_produces_.load() == 0; };
+
+        if (!drain_cv_.wait_for(lk, std::chrono::milliseconds(drain_milliseconds), drained)) {
+            // Out of time. Closing connections fails everything queued or waiting for a response on them
+            // now rather than when it times out. Shared connections are still in use by others so instead
+            // our produces stop waiting on them. The producing threads should return almost immediately
+            // but may take as long as a connect attempt, which is the longest step that isn't affected.
+            SYNKAFKA_LOG_WARN("ProducerClient closing with ") << in_flight_produces_.load() << " produce calls still in flight";
+            cancel_waits_ = true;
+            cancel_cv_.notify_all();
+            if (!share_connections_) {
+                for (auto& b : brokers_) {
+                    if (b.second.broker) {
+                        b.second.broker->close();
+                    }
+                }
+            }
+            // They are still using us so we can't go any further until they're all done
+            drain_cv_.wait(lk, drained);
+        }
     }
 
     // Clear io service work to allow it to stop
-    work_.reset();
+    work_.clear();
 
-    // Stop io service
-    io_service_.stop();
+    // Stop io services. An external io_service isn't ours to stop (and isn't in io_services_)
+    for (auto& io : io_services_) {
+        io->stop();
+    }
 
-    // Wait for all asio thread to stop
-    // Currently this is a somewhat graceful shutdown - we stop making new requests but we wait
-    // for all brokers to finish any outstanding reads/writes they are making.
-    // TODO: figure out if that works as expected and if there is any case where we might wait
-    // longer than the produce_timeout to stop?
+    // Wait for all asio thread to stop. Anything still outstanding was either drained above
+    // or has been failed so we don't wait for the brokers.
     for (auto& t : asio_threads_) {
-        t.join();
+        // May already have been joined by an explicit close() before destruction
+        if (t.joinable()) {
+            t.join();
+        }
+    }
+}
+
+void ProducerClient::run_maintenance()
+{
+    std::unique_lock<std::mutex> lk(mu_);
+
+    while (!stopping_.load()) {
+        // Check often enough that nothing is more than half an interval late
+        int32_t tick = 0;
+        for (auto interval : {idle_timeout_, probe_interval_}) {
+            if (interval > 0 && (tick == 0 || interval < tick)) {
+                tick = interval;
+            }
+        }
+        tick = tick > 0 ? std::max(tick / 2, 1) : 1000;
+
+        maintenance_cv_.wait_for(lk, std::chrono::milliseconds(tick));
+
+        if (stopping_.load()) {
+            break;
+        }
+
+        lk.unlock();
+        maintain_connections();
+        lk.lock();
+    }
+}
+
+void ProducerClient::maintain_connections()
+{
+    auto now = std::chrono::steady_clock::now();
+
+    std::vector<std::pair<std::shared_ptr<Broker>, std::string>> to_probe;
+    std::set<int32_t> replace_nodes;
+
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+
+        // Leaders we may produce to, with a topic each leads to make the probe request small
+        std::map<int32_t, std::string> leaders;
+        for (auto& part : partition_map_) {
+            if (part.second >= 0) {
+                leaders.insert(std::make_pair(part.second, part.first.topic));
+            }
+        }
+
+        for (auto& b : brokers_) {
+            auto& broker = b.second.broker;
+            if (broker == nullptr) {
+                continue;
+            }
+
+            auto leader_it = leaders.find(b.first);
+
+            if (broker->is_closed()) {
+                // Died since it was last used. Replace it now if we'll need it rather than on the next produce
+                broker.reset();
+                if (leader_it != leaders.end()) {
+                    replace_nodes.insert(b.first);
+                }
+                continue;
+            }
+
+            if (broker->outstanding_requests() > 0) {
+                // Waiting on a response (maybe a slow produce) isn't idle, and the response will tell
+                // us soon enough if the connection is dead
+                continue;
+            }
+
+            auto idle_for = now - broker->last_activity();
+
+            if (idle_timeout_ > 0 && idle_for >= std::chrono::milliseconds(idle_timeout_)) {
+                SYNKAFKA_LOG_DEBUG("Closing idle connection to broker ") << b.first;
+                metrics_.idle_connections_closed.add();
+                // A shared connection may not be idle for other clients, just let go of ours
+                if (!share_connections_) {
+                    broker->close();
+                }
+                broker.reset();
+                continue;
+            }
+
+            if (probe_interval_ > 0 && leader_it != leaders.end() && broker->is_connected()
+                && idle_for >= std::chrono::milliseconds(probe_interval_)) {
+                to_probe.push_back(std::make_pair(broker, leader_it->second));
+            }
+        }
+    }
+
+    for (auto& probe : to_probe) {
+        proto::TopicMetadataRequest req;
+        req.topic_names.push_back(probe.second);
+        proto::MetadataResponse resp;
+
+        auto ec = probe.first->sync_call(req, resp, connect_timeout_);
+        if (ec) {
+            SYNKAFKA_LOG_WARN("Health probe failed for broker ") << probe.first->get_config().node_id << ": " << ec.message();
+            metrics_.health_probe_failures.add();
+            replace_nodes.insert(probe.first->get_config().node_id);
+            close_broker(probe.first);
+        }
+    }
+
+    if (replace_nodes.empty() || stopping_.load()) {
+        return;
+    }
+
+    // Leadership may have moved if the broker died
+    refresh_meta();
+
+    std::lock_guard<std::mutex> lk(mu_);
+
+    std::set<int32_t> leaders;
+    for (auto& part : partition_map_) {
+        leaders.insert(part.second);
+    }
+
+    for (auto node_id : replace_nodes) {
+        if (leaders.count(node_id) == 0) {
+            continue;
+        }
+        auto broker = get_broker_for_node_locked(node_id);
+        if (broker != nullptr && !broker->is_connected()) {
+            broker->set_connect_timeout(connect_timeout_);
+            broker->async_connect([node_id](std::error_code ec) {
+                if (ec) {
+                    SYNKAFKA_LOG_WARN("Failed to replace connection to broker ") << node_id << ": " << ec.message();
+                }
+            });
+        }
     }
 }
 
-void ProducerClient::run_asio()
+void ProducerClient::run_asio(size_t shard)
 {
+    auto& io = *io_services_[shard % io_services_.size()];
+
     try
     {
-        io_service_.run();
-        log()->info("synkafka::ProducerClient shutting asio thread shutdown cleanly");
+        io.run();
+        SYNKAFKA_LOG_INFO("synkafka::ProducerClient shutting asio thread shutdown cleanly");
     }
     catch (const std::error_code& e)
     {
-        log()->error("ProducerClient asio thread exits with error_code ") << e.value() << ": " << e.message();
+        SYNKAFKA_LOG_ERROR("ProducerClient asio thread exits with error_code ") << e.value() << ": " << e.message();
     }
     catch (const std::exception& e)
     {
-        log()->error("ProducerClient asio thread exits with exception: ") << e.what();
+        SYNKAFKA_LOG_ERROR("ProducerClient asio thread exits with exception: ") << e.what();
     }
     catch (...)
     {
-        log()->error("ProducerClient asio thread exits with unknown exception");
+        SYNKAFKA_LOG_ERROR("ProducerClient asio thread exits with unknown exception");
+    }
+}
+
+boost::asio::io_service& ProducerClient::io_service_for(int32_t node_id)
+{
+    if (external_io_service_ != nullptr) {
+        return *external_io_service_;
     }
+
+    // Node ids are non-negative in practice but don't trust that for indexing
+    auto idx = static_cast<uint32_t>(node_id) % io_services_.size();
+    return *io_services_[idx];
 }
 
 // Caller MUST hold lock on mu_
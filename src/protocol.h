@@ -2,8 +2,10 @@
 
 #include <deque>
 
+#include "buffer.h"
 #include "message_set.h"
 #include "packet.h"
+#include "record_batch.h"
 #include "slice.h"
 
 namespace synkafka {
@@ -40,6 +42,7 @@ inline void kafka_proto_io(PacketCodec& p, ResponseHeader& h)
 struct TopicMetadataRequest
 {
     static const int16_t api_key = ApiKey::MetadataRequest;
+    static const int16_t api_version = KafkaApiVersion;
 
     std::deque<std::string> topic_names;
 };
@@ -153,6 +156,7 @@ inline void kafka_proto_io(PacketCodec& p, ProduceTopic& pb)
 struct ProduceRequest
 {
     static const int16_t api_key = ApiKey::ProduceRequest;
+    static const int16_t api_version = KafkaApiVersion;
 
     int16_t                     required_acks;
     int32_t                     timeout;
@@ -205,4 +209,149 @@ inline void kafka_proto_io(PacketCodec& p, ProduceResponse& r)
     p.io(r.topics);
 }
 
-}}
\ No newline at end of file
+
+
+// Idempotent producer (Kafka 0.11+) requests follow. They use newer API versions than the
+// rest of the protocol above.
+
+struct InitProducerIdRequest
+{
+    static const int16_t api_key = ApiKey::InitProducerIdRequest;
+    static const int16_t api_version = 0;
+
+    slice       transactional_id; // empty (null) for idempotence without transactions
+    int32_t     transaction_timeout_ms;
+};
+
+inline void kafka_proto_io(PacketCodec& p, InitProducerIdRequest& r)
+{
+    p.io(r.transactional_id);
+    p.io(r.transaction_timeout_ms);
+}
+
+
+struct InitProducerIdResponse
+{
+    int32_t             throttle_time_ms;
+    std::error_code     err_code;
+    int64_t             producer_id;
+    int16_t             producer_epoch;
+};
+
+inline void kafka_proto_io(PacketCodec& p, InitProducerIdResponse& r)
+{
+    p.io(r.throttle_time_ms);
+    p.io(r.err_code);
+    p.io(r.producer_id);
+    p.io(r.producer_epoch);
+}
+
+
+struct RecordBatchPartition
+{
+    int32_t             partition_id;
+    MessageSet          messages;
+    ProducerIdentity    producer;
+    int64_t             timestamp_ms;
+    size_t              wire_size; // set when encoded
+};
+
+inline void kafka_proto_io(PacketCodec& p, RecordBatchPartition& rp)
+{
+    p.io(rp.partition_id);
+
+    if (!p.is_writer()) {
+        p.set_err(PacketCodec::ERR_LOGIC) << "Decoding v2 record batches is not supported";
+        return;
+    }
+
+    buffer_t batch;
+    auto ec = encode_record_batch(batch, rp.messages, rp.producer, rp.timestamp_ms);
+    if (ec) {
+        p.set_err(PacketCodec::ERR_COMPRESS_FAIL) << "Failed to encode record batch: " << ec.message();
+        return;
+    }
+
+    rp.wire_size = batch.size();
+
+    // Record set is length prefixed bytes, same as a plain bytes field
+    slice batch_slice(batch);
+    p.io_bytes(batch_slice, COMP_None);
+}
+
+struct ProduceTopicV3
+{
+    std::string                         name;
+    std::deque<RecordBatchPartition>    partitions;
+};
+
+inline void kafka_proto_io(PacketCodec& p, ProduceTopicV3& pt)
+{
+    p.io(pt.name);
+    p.io(pt.partitions);
+}
+
+
+struct ProduceRequestV3
+{
+    static const int16_t api_key = ApiKey::ProduceRequest;
+    static const int16_t api_version = 3;
+
+    slice                       transactional_id; // empty (null) unless transactional
+    int16_t                     required_acks;
+    int32_t                     timeout;
+    std::deque<ProduceTopicV3>  topics;
+};
+
+inline void kafka_proto_io(PacketCodec& p, ProduceRequestV3& r)
+{
+    p.io(r.transactional_id);
+    p.io(r.required_acks);
+    p.io(r.timeout);
+    p.io(r.topics);
+}
+
+
+struct ProduceResponsePartitionV3
+{
+    int32_t             partition_id;
+    std::error_code     err_code;
+    int64_t             offset;
+    int64_t             log_append_time;
+};
+
+inline void kafka_proto_io(PacketCodec& p, ProduceResponsePartitionV3& rp)
+{
+    p.io(rp.partition_id);
+    p.io(rp.err_code);
+    p.io(rp.offset);
+    p.io(rp.log_append_time);
+}
+
+
+struct ProduceResponseTopicV3
+{
+    std::string                                 name;
+    std::deque<ProduceResponsePartitionV3>      partitions;
+};
+
+inline void kafka_proto_io(PacketCodec& p, ProduceResponseTopicV3& rt)
+{
+    p.io(rt.name);
+    p.io(rt.partitions);
+}
+
+
+struct ProduceResponseV3
+{
+    std::deque<ProduceResponseTopicV3>  topics;
+    int32_t                             throttle_time_ms;
+};
+
+inline void kafka_proto_io(PacketCodec& p, ProduceResponseV3& r)
+{
+    p.io(r.topics);
+    p.io(r.throttle_time_ms);
+}
+
+}}
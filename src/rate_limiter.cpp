@@ -0,0 +1,67 @@
+
+#include <algorithm>
+
+#include "rate_limiter.h"
+
+namespace synkafka {
+
+TokenBucket::TokenBucket(double rate, double burst)
+    : mu_()
+    , rate_(rate)
+    , burst_(burst)
+    , tokens_(burst)
+    , last_refill_(clock_t::now())
+{}
+
+std::chrono::microseconds TokenBucket::take(double tokens)
+{
+    if (rate_ <= 0) {
+        return std::chrono::microseconds(0);
+    }
+
+    std::lock_guard<std::mutex> lk(mu_);
+
+    refill();
+    tokens_ -= tokens;
+
+    if (tokens_ >= 0) {
+        return std::chrono::microseconds(0);
+    }
+    return std::chrono::microseconds(static_cast<int64_t>(-tokens_ / rate_ * 1e6) + 1);
+}
+
+void TokenBucket::give_back(double tokens)
+{
+    if (rate_ <= 0) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lk(mu_);
+    tokens_ = std::min(burst_, tokens_ + tokens);
+}
+
+void TokenBucket::refill()
+{
+    auto now = clock_t::now();
+    auto elapsed = std::chrono::duration<double>(now - last_refill_).count();
+    tokens_ = std::min(burst_, tokens_ + elapsed * rate_);
+    last_refill_ = now;
+}
+
+RateLimiter::RateLimiter(double bytes_per_sec, double requests_per_sec)
+    : bytes_(bytes_per_sec, bytes_per_sec)
+    , requests_(requests_per_sec, std::max(requests_per_sec, 1.0)) // always room for at least one request
+{}
+
+std::chrono::microseconds RateLimiter::take(size_t bytes)
+{
+    return std::max(bytes_.take(static_cast<double>(bytes)), requests_.take(1));
+}
+
+void RateLimiter::give_back(size_t bytes)
+{
+    bytes_.give_back(static_cast<double>(bytes));
+    requests_.give_back(1);
+}
+
+}
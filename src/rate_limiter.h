@@ -0,0 +1,56 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <mutex>
+
+#include <boost/core/noncopyable.hpp>
+
+namespace synkafka {
+
+// Classic token bucket: refills at rate tokens per second up to burst tokens. Taking more
+// tokens than are available is allowed and leaves the bucket in debt, the caller is told
+// how long until the debt is paid off and should wait that long before going ahead. That
+// way a single take bigger than the whole burst still gets through, just slowly.
+// A rate of 0 means unlimited.
+class TokenBucket : private boost::noncopyable
+{
+public:
+    TokenBucket(double rate, double burst);
+
+    // Take tokens, returns how long to wait before using them (zero if they were there already)
+    std::chrono::microseconds take(double tokens);
+
+    // Return tokens from a take() that the caller decided not to wait for
+    void give_back(double tokens);
+
+private:
+    typedef std::chrono::steady_clock clock_t;
+
+    // Caller MUST hold lock on mu_
+    void refill();
+
+    std::mutex          mu_;
+    double              rate_;
+    double              burst_;
+    double              tokens_;
+    clock_t::time_point last_refill_;
+};
+
+// Bytes per second and requests per second limits for one topic or broker. Each allows
+// a burst of one second's worth. Either limit may be 0 for unlimited.
+class RateLimiter : private boost::noncopyable
+{
+public:
+    RateLimiter(double bytes_per_sec, double requests_per_sec);
+
+    // Account for one request of bytes, returns how long to wait before sending it
+    std::chrono::microseconds take(size_t bytes);
+    void give_back(size_t bytes);
+
+private:
+    TokenBucket bytes_;
+    TokenBucket requests_;
+};
+
+}
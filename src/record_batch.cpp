@@ -0,0 +1,210 @@
+
+#include <cstring>
+#include <limits>
+
+#include "portable_endian.h"
+
+#include "packet.h"
+#include "record_batch.h"
+
+namespace synkafka {
+
+namespace {
+
+// Castagnoli polynomial, reversed
+const uint32_t Crc32cPoly = 0x82F63B78;
+
+struct Crc32cTable
+{
+    uint32_t t[256];
+
+    Crc32cTable()
+    {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = (c & 1) ? (c >> 1) ^ Crc32cPoly : c >> 1;
+            }
+            t[i] = c;
+        }
+    }
+};
+
+// Fixed header size of a v2 batch from baseOffset through the record count
+const size_t BatchHeaderSize = 61;
+
+// Byte offsets of fields we fill in after writing the records
+const size_t BatchLengthOffset  = 8;
+const size_t CrcOffset          = 17;
+const size_t AttributesOffset   = 21;
+
+template<typename T>
+void put_be(buffer_t& out, T value);
+
+template<> void put_be(buffer_t& out, int8_t value) { out.push_back(static_cast<uint8_t>(value)); }
+
+template<> void put_be(buffer_t& out, int16_t value)
+{
+    auto v = htobe16(static_cast<uint16_t>(value));
+    auto p = reinterpret_cast<const uint8_t*>(&v);
+    out.insert(out.end(), p, p + sizeof(v));
+}
+
+template<> void put_be(buffer_t& out, int32_t value)
+{
+    auto v = htobe32(static_cast<uint32_t>(value));
+    auto p = reinterpret_cast<const uint8_t*>(&v);
+    out.insert(out.end(), p, p + sizeof(v));
+}
+
+template<> void put_be(buffer_t& out, int64_t value)
+{
+    auto v = htobe64(static_cast<uint64_t>(value));
+    auto p = reinterpret_cast<const uint8_t*>(&v);
+    out.insert(out.end(), p, p + sizeof(v));
+}
+
+void overwrite_be32(buffer_t& out, size_t offset, uint32_t value)
+{
+    auto v = htobe32(value);
+    std::memcpy(&out[offset], &v, sizeof(v));
+}
+
+uint64_t zigzag(int64_t value)
+{
+    return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+// Like the v0 format, empty keys and values are sent as null
+int64_t bytes_length(const slice& s)
+{
+    return s.size() == 0 ? -1 : static_cast<int64_t>(s.size());
+}
+
+void write_records(buffer_t& out, const MessageSet& messages)
+{
+    int32_t offset_delta = 0;
+
+    for (auto& m : messages.get_messages()) {
+        auto key_len = bytes_length(m.key);
+        auto value_len = bytes_length(m.value);
+
+        int64_t body_len = sizeof(int8_t)          // attributes
+                         + varint_size(0)          // timestamp delta
+                         + varint_size(offset_delta)
+                         + varint_size(key_len) + m.key.size()
+                         + varint_size(value_len) + m.value.size()
+                         + varint_size(0);         // header count
+
+        write_varint(out, body_len);
+        out.push_back(0); // attributes, unused
+        write_varint(out, 0);
+        write_varint(out, offset_delta);
+        write_varint(out, key_len);
+        out.insert(out.end(), m.key.data(), m.key.data() + m.key.size());
+        write_varint(out, value_len);
+        out.insert(out.end(), m.value.data(), m.value.data() + m.value.size());
+        write_varint(out, 0);
+
+        ++offset_delta;
+    }
+}
+
+}
+
+uint32_t crc32c(uint32_t crc, const uint8_t* data, size_t len)
+{
+    static const Crc32cTable table;
+
+    crc = ~crc;
+    for (size_t i = 0; i < len; ++i) {
+        crc = table.t[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+size_t varint_size(int64_t value)
+{
+    auto v = zigzag(value);
+    size_t n = 1;
+    while (v >= 0x80) {
+        v >>= 7;
+        ++n;
+    }
+    return n;
+}
+
+void write_varint(buffer_t& out, int64_t value)
+{
+    auto v = zigzag(value);
+    while (v >= 0x80) {
+        out.push_back(static_cast<uint8_t>(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(v));
+}
+
+int32_t next_sequence(int32_t base_sequence, int32_t count)
+{
+    auto next = static_cast<int64_t>(base_sequence) + count;
+    if (next > std::numeric_limits<int32_t>::max()) {
+        next -= static_cast<int64_t>(std::numeric_limits<int32_t>::max()) + 1;
+    }
+    return static_cast<int32_t>(next);
+}
+
+std::error_code encode_record_batch(buffer_t& out, const MessageSet& messages
+                                   ,const ProducerIdentity& producer, int64_t timestamp_ms)
+{
+    auto& msgs = messages.get_messages();
+    auto start = out.size();
+
+    out.reserve(start + BatchHeaderSize + messages.get_encoded_size());
+
+    put_be<int64_t>(out, 0);                                    // base offset, assigned by broker
+    put_be<int32_t>(out, 0);                                    // batch length, filled below
+    put_be<int32_t>(out, -1);                                   // partition leader epoch, only set by brokers
+    put_be<int8_t>(out, 2);                                     // magic
+    put_be<int32_t>(out, 0);                                    // crc, filled below
+    put_be<int16_t>(out, static_cast<int16_t>(messages.get_compression() & 0x7));
+    put_be<int32_t>(out, static_cast<int32_t>(msgs.size()) - 1); // last offset delta
+    put_be<int64_t>(out, timestamp_ms);                         // first timestamp
+    put_be<int64_t>(out, timestamp_ms);                         // max timestamp
+    put_be<int64_t>(out, producer.producer_id);
+    put_be<int16_t>(out, producer.producer_epoch);
+    put_be<int32_t>(out, producer.base_sequence);
+    put_be<int32_t>(out, static_cast<int32_t>(msgs.size()));
+
+    if (messages.get_compression() == COMP_None) {
+        write_records(out, messages);
+    } else {
+        // Compressed batches keep the header as is and compress just the records
+        buffer_t records;
+        records.reserve(messages.get_encoded_size());
+        write_records(records, messages);
+
+        // Reuse the encoder's compression, it writes a length prefix we don't want here
+        PacketEncoder pe(records.size());
+        slice records_slice(records);
+        pe.io_bytes(records_slice, messages.get_compression());
+
+        if (!pe.ok()) {
+            out.resize(start);
+            return make_error_code(synkafka_error::compression_lib_error);
+        }
+
+        auto compressed = pe.get_as_slice(false);
+        out.insert(out.end(), compressed.data() + sizeof(int32_t), compressed.data() + compressed.size());
+    }
+
+    // Batch length counts everything after the length field itself
+    overwrite_be32(out, start + BatchLengthOffset, static_cast<uint32_t>(out.size() - start - BatchLengthOffset - sizeof(int32_t)));
+
+    // CRC covers attributes to the end of the batch
+    auto crc = crc32c(0, &out[start + AttributesOffset], out.size() - start - AttributesOffset);
+    overwrite_be32(out, start + CrcOffset, crc);
+
+    return make_error_code(synkafka_error::no_error);
+}
+
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <system_error>
+
+#include "buffer.h"
+#include "message_set.h"
+
+namespace synkafka {
+
+// Encoding for the v2 "RecordBatch" message format introduced in Kafka 0.11. Unlike the 0.8.x
+// MessageSet format it carries a producer id, epoch and base sequence which lets brokers discard
+// duplicates when a producer retries, so this is what idempotent produce requests use.
+// Only encoding is supported since we never read batches back.
+
+// Identifies the idempotent producer a batch belongs to
+struct ProducerIdentity
+{
+    int64_t producer_id;
+    int16_t producer_epoch;
+    int32_t base_sequence;
+};
+
+// Append all messages in the set to out as a single RecordBatch using the set's compression.
+// timestamp_ms is used as the create time of every record.
+std::error_code encode_record_batch(buffer_t& out, const MessageSet& messages
+                                   ,const ProducerIdentity& producer, int64_t timestamp_ms);
+
+// Next sequence number after a batch of count records starting at base_sequence.
+// Kafka sequences wrap to 0 after INT32_MAX.
+int32_t next_sequence(int32_t base_sequence, int32_t count);
+
+// Exposed for testing
+uint32_t crc32c(uint32_t crc, const uint8_t* data, size_t len);
+void write_varint(buffer_t& out, int64_t value);
+size_t varint_size(int64_t value);
+
+}
@@ -0,0 +1,86 @@
+
+#include "resolver_cache.h"
+
+namespace synkafka {
+
+ResolverCache& ResolverCache::instance()
+{
+    static ResolverCache cache;
+    return cache;
+}
+
+ResolverCache::ResolverCache()
+    : mu_()
+    , entries_()
+    , ttl_(30000)
+    , negative_ttl_(5000)
+{}
+
+void ResolverCache::set_ttl(int32_t ttl_ms, int32_t negative_ttl_ms)
+{
+    std::lock_guard<std::mutex> lk(mu_);
+    ttl_ = std::chrono::milliseconds(ttl_ms);
+    negative_ttl_ = std::chrono::milliseconds(negative_ttl_ms);
+}
+
+bool ResolverCache::lookup(const std::string& host, const std::string& service
+                          ,std::vector<endpoint_t>& endpoints, boost::system::error_code& ec)
+{
+    std::lock_guard<std::mutex> lk(mu_);
+
+    auto it = entries_.find(std::make_pair(host, service));
+    if (it == entries_.end()) {
+        return false;
+    }
+
+    auto& entry = it->second;
+
+    if (clock_t::now() >= entry.expires) {
+        entries_.erase(it);
+        return false;
+    }
+
+    ec = entry.ec;
+    endpoints.clear();
+
+    if (!entry.endpoints.empty()) {
+        auto start = entry.next_start % entry.endpoints.size();
+        endpoints.reserve(entry.endpoints.size());
+        endpoints.insert(endpoints.end(), entry.endpoints.begin() + start, entry.endpoints.end());
+        endpoints.insert(endpoints.end(), entry.endpoints.begin(), entry.endpoints.begin() + start);
+        entry.next_start = start + 1;
+    }
+
+    return true;
+}
+
+void ResolverCache::store(const std::string& host, const std::string& service, const std::vector<endpoint_t>& endpoints)
+{
+    std::lock_guard<std::mutex> lk(mu_);
+
+    if (ttl_.count() <= 0 || endpoints.empty()) {
+        return;
+    }
+
+    // The caller is about to try endpoints in the order given, so the next lookup starts one on
+    entries_[std::make_pair(host, service)] = Entry{endpoints, boost::system::error_code(), clock_t::now() + ttl_, 1};
+}
+
+void ResolverCache::store_failure(const std::string& host, const std::string& service, const boost::system::error_code& ec)
+{
+    std::lock_guard<std::mutex> lk(mu_);
+
+    if (negative_ttl_.count() <= 0) {
+        return;
+    }
+
+    entries_[std::make_pair(host, service)] = Entry{{}, ec, clock_t::now() + negative_ttl_, 0};
+}
+
+void ResolverCache::clear()
+{
+    std::lock_guard<std::mutex> lk(mu_);
+    entries_.clear();
+}
+
+}
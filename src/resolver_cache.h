@@ -0,0 +1,63 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/core/noncopyable.hpp>
+
+namespace synkafka {
+
+// Process wide cache of broker host name resolutions shared by all connections.
+// Reconnecting after a broker fails otherwise means resolving the same names over and
+// over, which adds the resolver's latency to every produce that has to reconnect.
+// Failed resolutions are cached too (for a shorter time) so a name that doesn't resolve
+// doesn't get hammered either.
+class ResolverCache : private boost::noncopyable
+{
+public:
+    typedef boost::asio::ip::tcp::endpoint endpoint_t;
+
+    static ResolverCache& instance();
+
+    ResolverCache();
+
+    // How long successful and failed resolutions are cached for.
+    // Defaults are 30 seconds and 5 seconds. 0 disables caching of that kind.
+    void set_ttl(int32_t ttl_ms, int32_t negative_ttl_ms);
+
+    // Returns true if we have a current entry for host:service. On a cached success endpoints
+    // holds all the resolved addresses, rotated one place further on each lookup so that
+    // successive connections spread their first attempt across them. On a cached failure
+    // endpoints is empty and ec holds the original error.
+    bool lookup(const std::string& host, const std::string& service
+               ,std::vector<endpoint_t>& endpoints, boost::system::error_code& ec);
+
+    void store(const std::string& host, const std::string& service, const std::vector<endpoint_t>& endpoints);
+    void store_failure(const std::string& host, const std::string& service, const boost::system::error_code& ec);
+
+    void clear();
+
+private:
+    typedef std::chrono::steady_clock clock_t;
+
+    struct Entry
+    {
+        std::vector<endpoint_t>     endpoints;
+        boost::system::error_code   ec;
+        clock_t::time_point         expires;
+        size_t                      next_start; // rotation offset for the next lookup
+    };
+
+    std::mutex                                              mu_;
+    std::map<std::pair<std::string, std::string>, Entry>    entries_;
+    std::chrono::milliseconds                               ttl_;
+    std::chrono::milliseconds                               negative_ttl_;
+};
+
+}
@@ -1,13 +1,17 @@
+#include <algorithm>
+#include <cstring>
 #include <stdexcept>
 
 #include <cassert>
 #include <boost/bind.hpp>
 
+#include "buffer_pool.h"
+#include "portable_endian.h"
 #include "protocol.h"
 #include "rpc.h"
 
 #define DBG_LOG() \
-    log()->debug() << pimpl_->conn_ << queue_type() << " RPC[" << rpc->get_seq() << "] "
+    SYNKAFKA_LOG_DEBUG() << pimpl_->conn_ << queue_type() << " RPC[" << rpc->get_seq() << "] "
 
 using boost::asio::ip::tcp;
 using boost::system::error_code;
@@ -15,17 +19,27 @@ using boost::system::error_code;
 namespace synkafka
 {
 
-RPC::RPC(int16_t api_key, std::unique_ptr<PacketEncoder> encoder, slice client_id)
+RPC::RPC(int16_t api_key, std::unique_ptr<PacketEncoder> encoder, slice client_id, int16_t api_version)
     : seq_(0)
     , api_key_(api_key)
+    , api_version_(api_version)
     , client_id_(std::move(client_id))
     , header_encoder_(nullptr)
     , encoder_(std::move(encoder))
-    , response_buffer_(make_shared_buffer(1024))
+    , response_buffer_(ResponseBufferPool::instance().acquire(api_key))
     , decoder_(new PacketDecoder(response_buffer_))
     , response_promise_()
+    , trace_()
+    , created_at_(std::chrono::steady_clock::now())
+    , limiter_()
 {}
 
+RPC::~RPC()
+{
+    // Never got an answer either way
+    release_limiter(true);
+}
+
 void RPC::set_seq(int32_t seq)
 {
     seq_ = seq;
@@ -41,6 +55,13 @@ int16_t RPC::get_api_key() const
     return api_key_;
 }
 
+bool RPC::is_priority() const
+{
+    return api_key_ == ApiKey::MetadataRequest
+        || api_key_ == ApiKey::ConsumerMetadataRequest
+        || api_key_ == ApiKey::InitProducerIdRequest;
+}
+
 PacketDecoder* RPC::get_decoder()
 {
     return decoder_.get();
@@ -53,7 +74,7 @@ const std::vector<boost::asio::const_buffer> RPC::encode_request()
     // without copying again, but we need to include full length in the header buffer prefix.
     if (!header_encoder_) {
         header_encoder_.reset(new PacketEncoder(20));
-        proto::RequestHeader header{api_key_, KafkaApiVersion, seq_, client_id_};
+        proto::RequestHeader header{api_key_, api_version_, seq_, client_id_};
         header_encoder_->io(header);
     }
 
@@ -80,25 +101,148 @@ std::future<PacketDecoder> RPC::get_future()
     return response_promise_.get_future();
 }
 
+size_t RPC::body_size()
+{
+    return encoder_->get_as_slice(false).size();
+}
+
 void RPC::fail(std::error_code ec)
 {
+    release_limiter(true);
+    if (trace_) {
+        trace_->interceptor->on_error(trace_->trace, ec);
+    }
     response_promise_.set_exception(std::make_exception_ptr(ec));
 }
 
 void RPC::resolve()
 {
+    release_limiter(false);
     response_promise_.set_value(std::move(*decoder_));
 }
 
-RPCQueue::Impl::Impl(Connection conn, rpc_success_handler_t on_success)
+void RPC::release_limiter(bool dropped)
+{
+    if (limiter_) {
+        limiter_->release(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - created_at_)
+                         ,dropped);
+        limiter_.reset();
+    }
+}
+
+InFlightTable::InFlightTable(size_t capacity)
+    : slots_()
+    , size_(0)
+{
+    size_t n = 2;
+    while (n < capacity) {
+        n <<= 1;
+    }
+    slots_.resize(n);
+}
+
+void InFlightTable::insert(std::unique_ptr<RPC> rpc)
+{
+    if ((size_ + 1) * 2 > slots_.size()) {
+        grow();
+    }
+
+    auto mask = slots_.size() - 1;
+    auto i = slot_for(rpc->get_seq());
+    while (slots_[i]) {
+        i = (i + 1) & mask;
+    }
+
+    slots_[i] = std::move(rpc);
+    ++size_;
+}
+
+RPC* InFlightTable::find(int32_t correlation_id) const
+{
+    auto mask = slots_.size() - 1;
+    for (auto i = slot_for(correlation_id); slots_[i]; i = (i + 1) & mask) {
+        if (slots_[i]->get_seq() == correlation_id) {
+            return slots_[i].get();
+        }
+    }
+    return nullptr;
+}
+
+std::unique_ptr<RPC> InFlightTable::remove(int32_t correlation_id)
+{
+    auto mask = slots_.size() - 1;
+    auto i = slot_for(correlation_id);
+
+    while (slots_[i] && slots_[i]->get_seq() != correlation_id) {
+        i = (i + 1) & mask;
+    }
+
+    if (!slots_[i]) {
+        return nullptr;
+    }
+
+    auto rpc = std::move(slots_[i]);
+    --size_;
+
+    // Shift back any following entries that would no longer be reachable past the hole
+    auto hole = i;
+    for (auto j = (i + 1) & mask; slots_[j]; j = (j + 1) & mask) {
+        auto home = slot_for(slots_[j]->get_seq());
+        // Entry at j can move to the hole unless it's home lies cyclically in (hole, j]
+        bool stays = (hole <= j) ? (hole < home && home <= j) : (hole < home || home <= j);
+        if (!stays) {
+            slots_[hole] = std::move(slots_[j]);
+            hole = j;
+        }
+    }
+
+    return rpc;
+}
+
+std::deque<std::unique_ptr<RPC>> InFlightTable::take_all()
+{
+    std::deque<std::unique_ptr<RPC>> all;
+    for (auto& slot : slots_) {
+        if (slot) {
+            all.push_back(std::move(slot));
+        }
+    }
+    size_ = 0;
+    return all;
+}
+
+void InFlightTable::grow()
+{
+    std::vector<std::unique_ptr<RPC>> old(slots_.size() * 2);
+    std::swap(old, slots_);
+    size_ = 0;
+
+    for (auto& rpc : old) {
+        if (rpc) {
+            insert(std::move(rpc));
+        }
+    }
+}
+
+RPCQueue::Impl::Impl(Connection conn, rpc_success_handler_t on_success, std::shared_ptr<BrokerMetrics> metrics)
     : conn_(std::move(conn))
     , q_()
     , next_seq_(0)
     , on_success_(std::move(on_success))
+    , coro_()
+    , metrics_(std::move(metrics))
+    , write_bufs_()
+    , write_batch_(0)
+    , in_flight_()
+    , header_buf_()
+    , response_len_(0)
+    , correlation_id_(0)
+    , reading_(nullptr)
+    , discard_buf_()
 {}
 
-RPCQueue::RPCQueue(Connection conn, rpc_success_handler_t on_success)
-    :pimpl_(std::make_shared<Impl>(std::move(conn), std::move(on_success)))
+RPCQueue::RPCQueue(Connection conn, rpc_success_handler_t on_success, std::shared_ptr<BrokerMetrics> metrics)
+    :pimpl_(std::make_shared<Impl>(std::move(conn), std::move(on_success), std::move(metrics)))
 {}
 
 void RPCQueue::push(std::unique_ptr<RPC> rpc)
@@ -123,14 +267,22 @@ void RPCQueue::stranded_push(RPC* rpc)
 {
     if (should_increment_seq_on_push()) {
         rpc->set_seq(pimpl_->next_seq_++);
+
+        if (rpc->traced()) {
+            rpc->trace(&Interceptor::on_enqueue, rpc->body_size());
+        }
     }
 
     DBG_LOG() << "Stranded Queue Push";
 
     // Transfer the pointed to RPC, we are giving the queue ownership of the pointed to RPC again
-    pimpl_->q_.emplace_back(rpc);
+    add(std::unique_ptr<RPC>(rpc));
+
+    if (auto g = depth_gauge()) {
+        g->add();
+    }
 
-    if (pimpl_->q_.size() == 1) {
+    if (queued() == 1) {
         // Was empty before, start coroutine processing
         if (pimpl_->coro_.is_complete()) {
             pimpl_->coro_ = boost::asio::coroutine();
@@ -153,9 +305,11 @@ void RPCQueue::fail_all(std::error_code ec)
     // Make a local copy of the queue since as soon as we fail() RPC the calling
     // thread might destruct the broker from under us which will invalidate pimpl_'s memory
     // so do all the state mutations we need first, and only start failing things after that.
-    std::deque<std::unique_ptr<RPC>> local_q;
+    auto local_q = take_all();
 
-    std::swap(pimpl_->q_, local_q);
+    if (auto g = depth_gauge()) {
+        g->sub(local_q.size());
+    }
 
     // Close (in case it isn't already closed due to boost error)
     pimpl_->conn_.close();
@@ -169,6 +323,38 @@ void RPCQueue::fail_all(std::error_code ec)
     }
 }
 
+void RPCQueue::add(std::unique_ptr<RPC> rpc)
+{
+    auto& q = pimpl_->q_;
+
+    if (!rpc->is_priority()) {
+        q.push_back(std::move(rpc));
+        return;
+    }
+
+    // Priority lane: ahead of everything not yet being written, behind any priority requests already
+    // waiting. The first write_batch_ entries are in the write currently in flight and must stay put.
+    // Responses come back in the order requests are written, which the recv queue copes with since
+    // it matches them by correlation id.
+    auto it = q.begin() + std::min(pimpl_->write_batch_, q.size());
+    while (it != q.end() && (*it)->is_priority()) {
+        ++it;
+    }
+    q.insert(it, std::move(rpc));
+}
+
+size_t RPCQueue::queued() const
+{
+    return pimpl_->q_.size();
+}
+
+std::deque<std::unique_ptr<RPC>> RPCQueue::take_all()
+{
+    std::deque<std::unique_ptr<RPC>> all;
+    std::swap(pimpl_->q_, all);
+    return all;
+}
+
 RPC* RPCQueue::next()
 {
     if (!pimpl_->q_.empty()) {
@@ -182,6 +368,9 @@ std::unique_ptr<RPC> RPCQueue::pop()
     if (!pimpl_->q_.empty()) {
         auto rpc = std::move(pimpl_->q_.front());
         pimpl_->q_.pop_front();
+        if (auto g = depth_gauge()) {
+            g->sub();
+        }
         return rpc;
     }
     return std::unique_ptr<RPC>(nullptr);
@@ -194,6 +383,22 @@ void RPCSendQueue::operator()(error_code ec, size_t length)
 {
     RPC* rpc = next();
 
+    if (!ec && !pimpl_->conn_.is_connected() && !pimpl_->conn_.is_closed()) {
+        // Not connected yet. Leave everything queued (later pushes just queue up behind it) and
+        // start again from the top once the connection is up. The connection never goes back to
+        // connecting once connected so this can only happen before our first write.
+        DBG_LOG() << "waiting for connection";
+        RPCSendQueue self(*this);
+        pimpl_->conn_.async_connect([self](error_code connect_ec) mutable {
+            if (connect_ec) {
+                self.fail_all(make_error_code(synkafka_error::network_fail));
+            } else {
+                self();
+            }
+        });
+        return;
+    }
+
     if (!ec && !pimpl_->conn_.is_connected()) {
         // Can't easily fall through to below code since
         // we have different error_code types from boost and std mismatched here
@@ -211,19 +416,48 @@ void RPCSendQueue::operator()(error_code ec, size_t length)
     reenter (pimpl_->coro_)
     {
         while (rpc) {
-            DBG_LOG() << "starting send, api_key: " << rpc->get_api_key();
-            yield pimpl_->conn_.async_write(rpc->encode_request(), *this);
+            // Send everything that has queued up while the last write was in flight in one
+            // gather write. Under load this means one syscall for many requests rather than one each.
+            pimpl_->write_batch_ = prepare_write_batch();
+
+            // Preparing may have dropped RPCs that failed to encode
+            rpc = next();
+
+            if (pimpl_->write_batch_ == 0) {
+                // Everything queued failed to encode and has been failed already
+                continue;
+            }
 
-            // Write was successful, handle success on the RPC and then
+            DBG_LOG() << "starting send of " << pimpl_->write_batch_ << " rpcs, api_key: " << rpc->get_api_key();
+            for (size_t i = 0; i < pimpl_->write_batch_; ++i) {
+                pimpl_->q_[i]->trace(&Interceptor::on_write_start);
+            }
+
+            yield pimpl_->conn_.async_write(pimpl_->write_bufs_, *this);
+
+            // Write was successful, handle success on each RPC in the batch and then
             // pop it from queue.
             {
                 DBG_LOG() << "write complete, length: " << length;
-                auto complete_rpc = pop();
 
-                if (pimpl_->on_success_) {
-                    pimpl_->on_success_(std::move(complete_rpc));
-                    DBG_LOG() << "success handler run, popped rpc, queue length now: " << pimpl_->q_.size();
+                if (pimpl_->metrics_) {
+                    pimpl_->metrics_->bytes_sent.add(length);
+                    pimpl_->metrics_->requests_sent.add(pimpl_->write_batch_);
+                    pimpl_->metrics_->writes_sent.add();
                 }
+
+                pimpl_->write_bufs_.clear();
+
+                for (; pimpl_->write_batch_ > 0; --pimpl_->write_batch_) {
+                    auto complete_rpc = pop();
+                    complete_rpc->trace(&Interceptor::on_write_complete);
+
+                    if (pimpl_->on_success_) {
+                        pimpl_->on_success_(std::move(complete_rpc));
+                    }
+                }
+
+                DBG_LOG() << "success handlers run, queue length now: " << pimpl_->q_.size();
             }
 
             rpc = next();
@@ -231,67 +465,145 @@ void RPCSendQueue::operator()(error_code ec, size_t length)
     }
 }
 
-void RPCRecvQueue::operator()(error_code ec, size_t length)
+size_t RPCSendQueue::prepare_write_batch()
 {
-    RPC* rpc = next();
+    auto& q = pimpl_->q_;
+    auto& bufs = pimpl_->write_bufs_;
+
+    bufs.clear();
+
+    size_t batch = 0;
+    size_t bytes = 0;
+
+    auto it = q.begin();
+    while (it != q.end() && batch < MaxWriteBatchRPCs) {
+        auto rpc_bufs = (*it)->encode_request();
+
+        if (rpc_bufs.empty()) {
+            // Header encoding failed and RPC has already been failed. Drop it
+            // from the queue so it doesn't get passed on to wait for a response.
+            it = q.erase(it);
+            if (auto g = depth_gauge()) {
+                g->sub();
+            }
+            continue;
+        }
+
+        size_t rpc_bytes = boost::asio::buffer_size(rpc_bufs);
+        if (batch > 0 && bytes + rpc_bytes > MaxWriteBatchBytes) {
+            break;
+        }
 
+        (*it)->trace(&Interceptor::on_encoded, rpc_bytes);
+
+        bufs.insert(bufs.end(), rpc_bufs.begin(), rpc_bufs.end());
+        bytes += rpc_bytes;
+        ++batch;
+        ++it;
+    }
+
+    return batch;
+}
+
+void RPCRecvQueue::add(std::unique_ptr<RPC> rpc)
+{
+    pimpl_->in_flight_.insert(std::move(rpc));
+}
+
+size_t RPCRecvQueue::queued() const
+{
+    return pimpl_->in_flight_.size();
+}
+
+std::deque<std::unique_ptr<RPC>> RPCRecvQueue::take_all()
+{
+    pimpl_->reading_ = nullptr;
+    return pimpl_->in_flight_.take_all();
+}
+
+void RPCRecvQueue::operator()(error_code ec, size_t length)
+{
     if (ec) {
-        DBG_LOG() << "failing all";
+        SYNKAFKA_LOG_DEBUG() << pimpl_->conn_ << queue_type() << " failing all";
         fail_all(ec);
         return;
     }
 
-    shared_buffer_t buffer = rpc->get_recv_buffer();
-    PacketDecoder* pd = rpc->get_decoder();
-    int32_t response_len = 0;
+    auto& impl = *pimpl_;
 
-    reenter (pimpl_->coro_)
+    reenter (impl.coro_)
     {
-        while (rpc) {
-            DBG_LOG() << "starting recv, api_key: " << rpc->get_api_key();
+        while (!impl.in_flight_.empty()) {
+            // Read the length and correlation id first so we know which RPC the response belongs to
+            // before reading the rest of it into that RPC's buffer.
+            yield impl.conn_.async_read(boost::asio::buffer(impl.header_buf_, sizeof(impl.header_buf_)), *this);
 
-            // First up we need to read the response length
-            assert(buffer->size() > sizeof(response_len));
-            yield pimpl_->conn_.async_read(boost::asio::buffer(&(*buffer)[0], sizeof(response_len)), *this);
+            {
+                uint32_t len_be, id_be;
+                std::memcpy(&len_be, impl.header_buf_, sizeof(len_be));
+                std::memcpy(&id_be, impl.header_buf_ + sizeof(len_be), sizeof(id_be));
+                impl.response_len_ = static_cast<int32_t>(be32toh(len_be));
+                impl.correlation_id_ = static_cast<int32_t>(be32toh(id_be));
+            }
 
-            // Now we have the response length
-            pd->set_readable_length(sizeof(response_len));
-            pd->io(response_len);
-            if (!pd->ok()) {
+            if (impl.response_len_ < static_cast<int32_t>(sizeof(int32_t))) {
+                // Can't even hold the correlation id, the stream is broken
                 fail_all(make_error_code(synkafka_error::decoding_error));
                 return;
             }
 
-            DBG_LOG() << "recvd response length: " << response_len
-                << " (in " << length << " bytes)";
+            impl.reading_ = impl.in_flight_.find(impl.correlation_id_);
+
+            if (impl.reading_ == nullptr) {
+                // Nobody is waiting for this one, read and drop it without disturbing anything else in flight
+                SYNKAFKA_LOG_WARN() << impl.conn_ << queue_type() << " discarding response with unknown correlation_id: "
+                    << impl.correlation_id_ << ", length: " << impl.response_len_;
+
+                impl.discard_buf_.resize(impl.response_len_ - sizeof(int32_t));
+                yield impl.conn_.async_read(boost::asio::buffer(impl.discard_buf_), *this);
+
+                impl.discard_buf_.clear();
+                continue;
+            }
+
+            {
+                // Let the next buffer for this api key start big enough
+                ResponseBufferPool::instance().record(impl.reading_->get_api_key(), sizeof(int32_t) + impl.response_len_);
 
-            // Read that many more bytes
-            if (response_len > 0) {
-                // See if our buffer is big enough for all of them (we need size of the length prefix + the length)
-                if (buffer->size() < (sizeof(response_len) + response_len)) {
-                    buffer->resize(sizeof(response_len) + response_len);
+                auto buffer = impl.reading_->get_recv_buffer();
+                if (buffer->size() < sizeof(int32_t) + impl.response_len_) {
+                    buffer->resize(sizeof(int32_t) + impl.response_len_);
                 }
 
-                // Now read the rest of the response
-                // Start from after the length prefix
-                yield pimpl_->conn_.async_read(boost::asio::buffer(&(*buffer)[0] + sizeof(response_len)
-                                                                  ,response_len
-                                                                  )
-                                              ,*this
-                                              );
-
-                // Note that we re-entered after yield so response_len is initialised to 0 again
-                // but we are guaranteed that async_read either read the whole length we asked for or
-                // failed with an error which we would have caught above. So we can reset response_len from
-                // the number of bytes that were actually read.
-                // Tis' but a minor stain on the illusion of synchronous programming from this coroutine ;).
-                response_len = length;
-
-                // Read response header
-                pd->set_readable_length(sizeof(response_len) + response_len);
+                // Decoder expects the whole response, header included, in it's buffer
+                std::memcpy(&(*buffer)[0], impl.header_buf_, sizeof(impl.header_buf_));
+            }
+
+            SYNKAFKA_LOG_DEBUG() << impl.conn_ << queue_type() << " RPC[" << impl.correlation_id_ << "] recvd response header, length: "
+                << impl.response_len_;
 
+            if (impl.response_len_ > static_cast<int32_t>(sizeof(int32_t))) {
+                yield impl.conn_.async_read(boost::asio::buffer(&(*impl.reading_->get_recv_buffer())[0] + sizeof(impl.header_buf_)
+                                                               ,impl.response_len_ - sizeof(int32_t)
+                                                               )
+                                           ,*this
+                                           );
+
+                if (impl.reading_ == nullptr) {
+                    // Failed while we were reading
+                    return;
+                }
+            }
+
+            {
+                // Leave the decoder positioned at the start of the response body
+                PacketDecoder* pd = impl.reading_->get_decoder();
+                int32_t response_len = 0;
                 proto::ResponseHeader h;
 
+                pd->set_readable_length(sizeof(response_len));
+                pd->io(response_len);
+                pd->set_readable_length(sizeof(response_len) + response_len);
                 pd->io(h);
 
                 if (!pd->ok()) {
@@ -299,29 +611,31 @@ void RPCRecvQueue::operator()(error_code ec, size_t length)
                     return;
                 }
 
-                DBG_LOG() << "recvd response, length: " << response_len
-                    << ", correlation_id: " << h.correlation_id;
+                impl.reading_->trace(&Interceptor::on_response_header, sizeof(response_len) + response_len);
 
-                if (h.correlation_id != rpc->get_seq()) {
-                    fail_all(make_error_code(synkafka_error::decoding_error));
-                    return;
+                if (impl.metrics_) {
+                    impl.metrics_->bytes_received.add(sizeof(response_len) + response_len);
+                    impl.metrics_->responses_received.add();
+
+                    // Only updated here on the connection's strand so a plain read then set is good enough.
+                    // Each response moves the average 1/8 of the way towards it's own latency.
+                    auto took = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now()
+                                                                                     - impl.reading_->created_at()).count();
+                    auto avg = impl.metrics_->latency_ewma_us.value();
+                    impl.metrics_->latency_ewma_us.set(avg == 0 ? took : avg + (took - avg) / 8);
                 }
-            }
 
-            // Read was successful, handle success on the RPC and then
-            // pop it from queue.
-            pop()->resolve();
+                auto rpc = impl.in_flight_.remove(impl.correlation_id_);
+                impl.reading_ = nullptr;
 
-            DBG_LOG() << "resolved and popped rpc, queue length now: " << pimpl_->q_.size();
+                if (auto g = depth_gauge()) {
+                    g->sub();
+                }
 
-            rpc = next();
+                SYNKAFKA_LOG_DEBUG() << impl.conn_ << queue_type() << " RPC[" << impl.correlation_id_
+                    << "] resolved, still in flight: " << impl.in_flight_.size();
 
-            if (rpc) {
-                // Reset loop variables otherwise we'll still be looking at
-                // previous rpc's buffers/decoder
-                buffer = rpc->get_recv_buffer();
-                pd = rpc->get_decoder();
-                response_len = 0;
+                rpc->resolve();
             }
         }
     }
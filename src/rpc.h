@@ -1,5 +1,6 @@
 #pragma once
 
+#include <chrono>
 #include <deque>
 #include <functional>
 #include <future>
@@ -10,10 +11,13 @@
 #include <boost/asio/coroutine.hpp>
 
 #include "buffer.h"
+#include "concurrency_limiter.h"
 #include "connection.h"
 #include "constants.h"
+#include "interceptor.h"
 #include "packet.h"
 #include "log.h"
+#include "metrics.h"
 
 namespace synkafka
 {
@@ -25,12 +29,16 @@ class RPC
 {
 public:
     RPC() = default;
-    RPC(int16_t api_key, std::unique_ptr<PacketEncoder> encoder, slice client_id);
+    RPC(int16_t api_key, std::unique_ptr<PacketEncoder> encoder, slice client_id, int16_t api_version = KafkaApiVersion);
+    ~RPC();
 
     void set_seq(int32_t seq);
     int32_t get_seq() const;
     int16_t get_api_key() const;
+    // Control plane requests (metadata and the like) that should skip ahead of queued produces
+    bool is_priority() const;
     PacketDecoder* get_decoder();
+    std::chrono::steady_clock::time_point created_at() const { return created_at_; }
 
     const std::vector<boost::asio::const_buffer> encode_request();
 
@@ -47,19 +55,79 @@ public:
 
     void resolve();
 
+    // Slot this RPC holds in limiter, given back with it's round trip time when it resolves or fails
+    void set_limiter(std::shared_ptr<ConcurrencyLimiter> limiter) { limiter_ = std::move(limiter); }
+
+    // Tracing. Requests without a trace context skip all of this after a single null check.
+    void set_trace(trace_context_t trace) { trace_ = std::move(trace); }
+    bool traced() const { return trace_ != nullptr; }
+    size_t body_size();
+
+    // Call hook on the interceptor with bytes (or whatever bytes were last reported if not given)
+    void trace(void (Interceptor::*hook)(const RequestTrace&))
+    {
+        if (trace_) {
+            trace_->trace.correlation_id = seq_;
+            (*trace_->interceptor.*hook)(trace_->trace);
+        }
+    }
+
+    void trace(void (Interceptor::*hook)(const RequestTrace&), size_t bytes)
+    {
+        if (trace_) {
+            trace_->trace.bytes = bytes;
+            trace(hook);
+        }
+    }
+
 private:
     int32_t                         seq_;
     int16_t                         api_key_;
+    int16_t                         api_version_;
     slice                           client_id_;
     std::unique_ptr<PacketEncoder>  header_encoder_;
     std::unique_ptr<PacketEncoder>  encoder_;
     shared_buffer_t                 response_buffer_;
     std::unique_ptr<PacketDecoder>  decoder_;
     std::promise<PacketDecoder>     response_promise_;
+    trace_context_t                 trace_; // null unless traced
+    std::chrono::steady_clock::time_point created_at_;
+    std::shared_ptr<ConcurrencyLimiter> limiter_; // null unless holding a slot
+
+    void release_limiter(bool dropped);
 };
 
 typedef std::function<void (std::unique_ptr<RPC>)> rpc_success_handler_t;
 
+// RPCs waiting for a response, keyed by correlation id so responses can be matched up in any order.
+// Open addressed with linear probing: a connection hands out correlation ids sequentially so masking
+// the id spreads them out with almost no collisions. Deletes shift later entries back rather than
+// leaving tombstones. Slots are only allocated when the table grows (doubling when half full) so in
+// steady state inserting and removing allocate nothing.
+class InFlightTable
+{
+public:
+    // capacity is rounded up to a power of 2
+    explicit InFlightTable(size_t capacity = 64);
+
+    void insert(std::unique_ptr<RPC> rpc); // keyed by rpc->get_seq()
+    RPC* find(int32_t correlation_id) const;
+    std::unique_ptr<RPC> remove(int32_t correlation_id); // nullptr if not present
+
+    // Remove everything
+    std::deque<std::unique_ptr<RPC>> take_all();
+
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+private:
+    size_t slot_for(int32_t correlation_id) const { return static_cast<uint32_t>(correlation_id) & (slots_.size() - 1); }
+    void grow();
+
+    std::vector<std::unique_ptr<RPC>>   slots_; // null when empty
+    size_t                              size_;
+};
+
 // Abstract Queue for seqentially performing async work on a connection
 // Needed since we must have both senders and recievers synchronised.
 // Uses boost::asio::coroutin stackless coroutine implementation but NOT
@@ -76,7 +144,7 @@ typedef std::function<void (std::unique_ptr<RPC>)> rpc_success_handler_t;
 class RPCQueue
 {
 public:
-    RPCQueue(Connection conn, rpc_success_handler_t on_success);
+    RPCQueue(Connection conn, rpc_success_handler_t on_success, std::shared_ptr<BrokerMetrics> metrics = nullptr);
 
     // This is the coroutine entry point
     virtual void operator()(error_code ec = error_code()
@@ -93,6 +161,14 @@ protected:
     virtual const std::string& queue_type() const = 0;
     virtual bool should_increment_seq_on_push() const = 0;
 
+    // Gauge tracking the length of this queue, or nullptr if we have no metrics
+    virtual Gauge* depth_gauge() const = 0;
+
+    // Storage for queued RPCs, the send queue keeps them in order in q_
+    virtual void add(std::unique_ptr<RPC> rpc);
+    virtual size_t queued() const;
+    virtual std::deque<std::unique_ptr<RPC>> take_all();
+
     void fail_all(std::error_code ec);
     void fail_all(error_code ec); // Boost error_code..
     RPC* next();
@@ -100,13 +176,26 @@ protected:
 
     struct Impl
     {
-        Impl(Connection conn, rpc_success_handler_t on_success);
+        Impl(Connection conn, rpc_success_handler_t on_success, std::shared_ptr<BrokerMetrics> metrics);
 
         Connection                          conn_;
         std::deque<std::unique_ptr<RPC>>    q_;
         int32_t                             next_seq_; // only really needed for send queue but..
         rpc_success_handler_t               on_success_;
         boost::asio::coroutine              coro_;
+        std::shared_ptr<BrokerMetrics>      metrics_; // may be null
+
+        // Send queue only: buffers and number of RPCs in the write currently in flight
+        std::vector<boost::asio::const_buffer>  write_bufs_;
+        size_t                                  write_batch_;
+
+        // Recv queue only: RPCs waiting for responses, and the response currently being read
+        InFlightTable                           in_flight_;
+        uint8_t                                 header_buf_[8]; // length and correlation id
+        int32_t                                 response_len_;
+        int32_t                                 correlation_id_;
+        RPC*                                    reading_; // null when discarding a response nobody is waiting for
+        buffer_t                                discard_buf_;
     };
 
     std::shared_ptr<Impl> pimpl_;
@@ -115,8 +204,8 @@ protected:
 class RPCSendQueue : public RPCQueue
 {
 public:
-    RPCSendQueue(Connection conn, rpc_success_handler_t on_success)
-        : RPCQueue(std::move(conn), on_success)
+    RPCSendQueue(Connection conn, rpc_success_handler_t on_success, std::shared_ptr<BrokerMetrics> metrics = nullptr)
+        : RPCQueue(std::move(conn), on_success, std::move(metrics))
     {}
 
     virtual void operator()(error_code ec = error_code()
@@ -129,15 +218,29 @@ public:
         return t;
     }
 
+    // Limits on how many queued RPCs are gathered into a single socket write.
+    // A single RPC larger than MaxWriteBatchBytes is still sent on it's own.
+    static const size_t MaxWriteBatchRPCs   = 64;
+    static const size_t MaxWriteBatchBytes  = 1024 * 1024;
+
 protected:
     virtual bool should_increment_seq_on_push() const { return true; }
+
+    // Gather buffers for as many queued RPCs as limits allow into pimpl_->write_bufs_
+    // returns the number of RPCs from the front of the queue included.
+    size_t prepare_write_batch();
+
+    virtual Gauge* depth_gauge() const override
+    {
+        return pimpl_->metrics_ ? &pimpl_->metrics_->send_queue_depth : nullptr;
+    }
 };
 
 class RPCRecvQueue : public RPCQueue
 {
 public:
-    RPCRecvQueue(Connection conn, rpc_success_handler_t on_success)
-        : RPCQueue(std::move(conn), on_success)
+    RPCRecvQueue(Connection conn, rpc_success_handler_t on_success, std::shared_ptr<BrokerMetrics> metrics = nullptr)
+        : RPCQueue(std::move(conn), on_success, std::move(metrics))
     {}
 
     virtual void operator()(error_code ec = error_code()
@@ -151,6 +254,16 @@ public:
     }
 
     virtual bool should_increment_seq_on_push() const { return false; }
+
+protected:
+    virtual Gauge* depth_gauge() const override
+    {
+        return pimpl_->metrics_ ? &pimpl_->metrics_->recv_queue_depth : nullptr;
+    }
+
+    virtual void add(std::unique_ptr<RPC> rpc) override;
+    virtual size_t queued() const override;
+    virtual std::deque<std::unique_ptr<RPC>> take_all() override;
 };
 
 }
\ No newline at end of file
@@ -2,6 +2,7 @@
 
 #include <atomic>
 #include <chrono>
+#include <condition_variable>
 #include <deque>
 #include <string>
 #include <system_error>
@@ -9,16 +10,52 @@
 #include <mutex>
 #include <thread>
 #include <map>
+#include <set>
+#include <utility>
+#include <vector>
 
 #include <boost/asio.hpp>
 #include <boost/core/noncopyable.hpp>
 
 #include "broker.h"
+#include "circuit_breaker.h"
+#include "interceptor.h"
+#include "memory_budget.h"
+#include "meta_cache.h"
+#include "metrics.h"
 #include "protocol.h"
+#include "rate_limiter.h"
+#include "record_batch.h"
 #include "slice.h"
 
 namespace synkafka {
 
+// How the client's background io threads are organised
+enum class IOThreadMode
+{
+    // All io threads run a single shared io_service and any of them may handle
+    // any broker connection. Connections serialise their handlers through a strand.
+    Shared,
+
+    // Each io thread runs it's own io_service, optionally pinned to a CPU core (see
+    // ProducerClient::set_shard_core_affinity()). Every broker connection is owned by exactly one shard so all network handling for it
+    // happens on one thread and never contends with other shards.
+    ShardPerCore,
+};
+
+// How produce_any() chooses between the partitions it could produce to
+enum class PartitionPolicy
+{
+    // Take turns
+    RoundRobin,
+
+    // Whichever partition's leader has the fewest requests queued or waiting for a response
+    LeastOutstanding,
+
+    // Whichever partition's leader has the lowest recent request latency (a moving average)
+    LowestLatency,
+};
+
 class ProducerClient : private boost::noncopyable
 {
 public:
@@ -27,7 +64,16 @@ public:
     // If you miss out port for anyone we assume default 9092
     // Most uses probably only need one background io thread for networking but increasing it
     // *might* improve latency/throughput in some situations
-    ProducerClient(const std::string& brokers, int num_io_threads = 1);
+    // With IOThreadMode::ShardPerCore num_io_threads is the number of shards, it's probably only
+    // worthwhile when talking to many brokers with high request rates.
+    ProducerClient(const std::string& brokers, int num_io_threads = 1, IOThreadMode io_mode = IOThreadMode::Shared);
+
+    // Start a client that does all of it's networking on an io_service owned and run by the caller
+    // instead of starting it's own threads. The io_service must outlive the client and close() will not stop it.
+    // With share_connections, broker connections are shared (via BrokerRegistry) with any other client
+    // that also shares connections on the same io_service and client_id, so many clients talking to one
+    // cluster use a single socket per broker.
+    ProducerClient(const std::string& brokers, boost::asio::io_service& io_service, bool share_connections = true);
     ~ProducerClient();
 
     // Set the timeout in milliseconds sent to kafka to wait for acks.
@@ -72,6 +118,108 @@ public:
     // Defaults to "synkafka_client"
     void set_client_id(std::string client_id);
 
+    // How threads blocked in produce() wait for the broker's response. See SyncWaitMode in broker.h.
+    // spin_microseconds is how long SpinThenPark busy-polls (or RunIOLoop runs handlers) before
+    // blocking, it should be a little more than the typical produce round trip for it to help.
+    // RunIOLoop throws std::invalid_argument with IOThreadMode::ShardPerCore, each shard must only
+    // be run by its own thread.
+    // Default is SyncWaitMode::Park (plain blocking wait)
+    void set_sync_wait(SyncWaitMode mode, int32_t spin_microseconds = 50);
+
+    // Pin io shard i to CPU core (first_core + i) modulo the number of cores (Linux only, ignored
+    // elsewhere) so each shard's connections stay hot in one cache. Clients in the same process should
+    // use different first_cores so their shards don't all pile onto the same cores. Failing to pin is
+    // logged but otherwise harmless.
+    // Throws std::invalid_argument unless using IOThreadMode::ShardPerCore or if first_core is negative.
+    // Default is not to pin at all
+    void set_shard_core_affinity(int first_core);
+
+    // Limit the total bytes of produce data held by in-flight requests across all threads using this client.
+    // When a produce() would exceed it, the call waits for others to finish for up to the block timeout
+    // below and then fails with synkafka_error::buffer_memory_exhausted. A single MessageSet bigger than
+    // the whole budget always fails. Usage is reported in metrics().
+    // Default is 0 (unlimited)
+    void set_buffer_memory(size_t bytes);
+
+    // How long produce() may block waiting for buffer memory. 0 means fail immediately.
+    // Default is 0
+    void set_buffer_memory_block_timeout(int32_t milliseconds);
+
+    // Enable the idempotent producer (needs Kafka 0.11 or later). Each produce() is sent as a v2 record batch
+    // tagged with a producer id and per-partition sequence number, so the broker discards duplicates. That makes
+    // it safe for many threads to have produces in flight to the same partition at once, and lets the client
+    // retry failed produces itself up to max_retries times, waiting retry_backoff milliseconds before each,
+    // without risking duplicate messages. Retried errors are network failures and timeouts, leadership changes
+    // and not enough replicas.
+    // Requires required_acks of -1, produce() returns synkafka_error::bad_config otherwise.
+    // Default is disabled
+    void set_idempotent(bool enable, int32_t max_retries = 3, int32_t retry_backoff = 100);
+
+    // TCP tuning for broker connections, see SocketOptions in connection.h. Only affects connections
+    // made after it's called.
+    // Default enables TCP_NODELAY and leaves everything else as the OS default
+    void set_socket_options(const SocketOptions& opts);
+
+    // Background upkeep of broker connections. Connections that haven't had a request for idle_timeout
+    // milliseconds are closed. Connections to partition leaders that have been idle for probe_interval
+    // milliseconds are sent a small metadata request, and if that fails they are dropped and a new
+    // connection made (after refreshing metadata) so the next produce doesn't find it dead.
+    // Probes count as activity, so with a probe_interval shorter than idle_timeout leader connections
+    // stay open and only connections we no longer need are closed.
+    // Runs on a thread of it's own, started by the first call that enables either.
+    // Defaults are 0 (disabled) for both
+    void set_connection_maintenance(int32_t idle_timeout, int32_t probe_interval);
+
+    // Report every produce request's progress through the client to interceptor, see interceptor.h.
+    // Only produce requests are traced. Must be set before producing.
+    // Default is none, which costs nothing
+    void set_interceptor(std::shared_ptr<Interceptor> interceptor);
+
+    // Keep the last known brokers and partition leaders in a file at path, rewritten after each
+    // successful metadata refresh. If the file already exists when this is called it's loaded
+    // straight away so produce() can go to the cached leaders without waiting for a metadata fetch
+    // from the bootstrap brokers. Cached metadata is checked by a background refresh, asking the
+    // cached brokers rather than the bootstrap list, and stale leaders are corrected the same way as
+    // after any leadership change. Call it right after construction, before producing.
+    // Default is no cache file
+    void set_metadata_cache_file(const std::string& path);
+
+    // Circuit breaker for each broker. After a broker fails (a connect fails or a request on it
+    // fails or times out) requests to it fail straight away with synkafka_error::broker_unavailable for
+    // initial_backoff milliseconds, doubling with each failure in a row up to max_backoff, instead of
+    // every call waiting out the connect timeout. Once the backoff has passed the next call starts a
+    // single reconnect in the background and the breaker closes if it succeeds. Metadata for the
+    // partitions the broker led is refreshed on next use as before, so if leadership moves off the
+    // broker producing resumes without waiting for it.
+    // Default initial_backoff is 0 (disabled), max_backoff is 10 seconds
+    void set_reconnect_backoff(int32_t initial_backoff, int32_t max_backoff);
+
+    // Cap the rate produce() sends to topic at, in bytes (of encoded MessageSet) and requests per
+    // second, allowing bursts of up to one second's worth. 0 for either means no limit on it, both 0
+    // removes the topic's limits. Produces over the limit are held back before being queued to send,
+    // see set_rate_limit_timeout().
+    // Default is no limits
+    void set_topic_rate_limit(const std::string& topic, double bytes_per_sec, double requests_per_sec);
+
+    // As above but limits produces to each broker (to every broker separately, not all of them put together).
+    // Default is no limits
+    void set_broker_rate_limit(double bytes_per_sec, double requests_per_sec);
+
+    // How long produce() may wait to stay within rate limits. If it would have to wait longer it fails
+    // straight away with synkafka_error::rate_limited without sending anything. 0 means never wait.
+    // Time spent waiting is reported in metrics().
+    // Default is 0
+    void set_rate_limit_timeout(int32_t milliseconds);
+
+    // Adaptively limit how many produce requests are pipelined on each broker connection, see
+    // ConcurrencyLimiter in concurrency_limiter.h. Each broker's limit starts at initial_limit and moves
+    // between 1 and max_limit as round trip times show whether the broker is keeping up. Waiting for a
+    // slot counts against the produce timeout, a produce() that can't get one in time fails with
+    // synkafka_error::in_flight_limit.
+    // Current limits are reported per broker in metrics(). Only affects connections made after it's called.
+    // Default is disabled (no limit)
+    void set_adaptive_concurrency(bool enable, int32_t initial_limit = 16, int32_t max_limit = 256);
+
 private:
     // Defaults
     int32_t produce_timeout_                = 10000;
@@ -79,6 +227,22 @@ private:
     int32_t connect_timeout_                = 1000;
     int16_t required_acks_                  = -1;
     int32_t retry_attempts_                 = 1;
+    SyncWaitPolicy sync_wait_               = SyncWaitPolicy{SyncWaitMode::Park, 0, nullptr};
+    int32_t buffer_memory_block_timeout_    = 0;
+    bool    idempotent_                     = false;
+    SocketOptions socket_options_           = SocketOptions();
+    int32_t idempotent_retries_             = 3;
+    int32_t idempotent_retry_backoff_       = 100;
+    int32_t idle_timeout_                   = 0;
+    int32_t probe_interval_                 = 0;
+    int32_t reconnect_backoff_              = 0;
+    int32_t reconnect_backoff_max_          = 10000;
+    double  broker_rate_limit_bytes_        = 0;
+    double  broker_rate_limit_requests_     = 0;
+    int32_t rate_limit_timeout_             = 0;
+    bool    adaptive_concurrency_           = false;
+    int32_t concurrency_initial_limit_      = 16;
+    int32_t concurrency_max_limit_          = 256;
 
 public:
 
@@ -95,6 +259,13 @@ public:
     // Use with care, this is really only exposed to allow for thorough testing.
     std::error_code check_topic_partition_leader_available(const std::string& topic, int32_t partition_id, int32_t* leader_id);
 
+    // Bulk version of check_topic_partition_leader_available() for checking many partitions at once.
+    // All leaders are resolved from one metadata snapshot (refreshed at most once if any partition is unknown)
+    // and each distinct leader is connected to at most once, in parallel, so this blocks for roughly one
+    // connect_timeout at worst however many partitions are passed.
+    // Returns one error_code per (topic, partition_id) pair in the same order as given.
+    std::vector<std::error_code> check_topic_partitions_leader_available(const std::vector<std::pair<std::string, int32_t>>& partitions);
+
     // Synchronously produce a batch of messages
     // We assume the messages were already built using the MessageSet class which validates
     // for known issues like maximum message size.
@@ -102,15 +273,37 @@ public:
     // The returned error_code
     std::error_code produce(const std::string& topic, int32_t partition_id, MessageSet& messages);
 
+    // Produce to any partition of topic, for callers that don't care which as long as the messages get
+    // written. Only partitions whose leader we currently have a connection to (and whose circuit breaker
+    // isn't open) are considered, chosen between according to policy. If none are connected every leader
+    // of the topic is connected to first (like check_topic_partitions_leader_available()). If the chosen
+    // leader says it no longer leads the partition, or the produce failed before anything was sent (the
+    // connection failed, the breaker opened, a rate limit was hit or there was no concurrency slot free)
+    // the next best partition is tried.
+    // Other errors are returned without trying another since the messages may have been written.
+    // partition_id, if given, is set to the partition produced to (or last tried), -1 if none was tried.
+    std::error_code produce_any(const std::string& topic, MessageSet& messages
+                               ,PartitionPolicy policy = PartitionPolicy::RoundRobin, int32_t* partition_id = nullptr);
+
+    // Client metrics registry. Use metrics().snapshot() to read current values and
+    // format_prometheus() from metrics.h to expose them.
+    Metrics& metrics() { return metrics_; }
+
     // Stop client and it's worker threads. Disconnects. The object cannot be used again after this is called.
-    void close();
+    // New produce() calls fail with synkafka_error::client_stopping straight away. Produces already in
+    // flight are given drain_milliseconds to complete normally, after which connections are closed and any
+    // still waiting fail with client_stopping. Connections shared with other clients are left open, produces
+    // waiting on them give up instead and their requests are left to finish on the shared connection.
+    // Produces waiting for a rate limit or a concurrency slot give up at the same time.
+    // Either way close() returns only once every produce() call has.
+    void close(int32_t drain_milliseconds = 0);
 
     // Parse broker structs form config string. Used in constructor, public mostly for testing
     static std::deque<proto::Broker> string_to_brokers(const std::string& brokers);
 
     // The internal asio thread entry point, should not be used outside of class
     // although must be public for std::thread to run.
-    void run_asio();
+    void run_asio(size_t shard);
 private:
 
     struct Partition
@@ -133,15 +326,59 @@ private:
         }
     };
 
+    // Idempotent producer sequence state for one partition
+    struct PartitionSequence
+    {
+        std::mutex          mu; // held while assigning a sequence and queuing the batch
+        int32_t             next = 0;
+        std::set<int32_t>   in_flight; // base sequences of batches not yet finished
+    };
+
     struct BrokerContainer
     {
         proto::Broker                 config;
         std::shared_ptr<Broker>     broker;
+        bool                        had_broker; // true once we've created a broker for this node at least once
+        std::shared_ptr<CircuitBreaker> breaker; // shared with any reconnect probe still running
     };
 
+    // produce() that also sets sent (if given) once the request may have reached the broker
+    std::error_code produce_partition(const std::string& topic, int32_t partition_id, MessageSet& messages, bool* sent);
+    std::error_code do_produce(const std::string& topic, int32_t partition_id, MessageSet& messages, bool* sent);
+    // Best connected partition of topic for produce_any() ignoring those in exclude and those whose
+    // leader's breaker is open, -1 if there are none
+    int32_t choose_partition(const std::string& topic, PartitionPolicy policy, const std::set<int32_t>& exclude);
+    std::error_code produce_idempotent(const Partition& p, MessageSet& messages, bool* sent);
+    // Get (fetching if needed) our producer id and the partition's sequence state that goes with it
+    std::error_code ensure_producer_id(Broker& broker, const Partition& p
+                                      ,ProducerIdentity& producer, std::shared_ptr<PartitionSequence>& seq);
+    void reset_producer_id(const ProducerIdentity& failed);
+    // Trace context for a produce to p, nullptr if no interceptor is set
+    trace_context_t make_trace(const Partition& p);
+    // Drop partition from meta if ec says our idea of it's leader is out of date
+    void forget_stale_partition(const Partition& p, const std::error_code& ec, int32_t node_id);
     std::shared_ptr<Broker> get_broker_for_partition(const Partition& p, bool refresh_meta = true);
+    // Get (creating if needed) the broker instance for a known node id, nullptr if node isn't in meta.
+    // Caller MUST hold lock on mu_
+    std::shared_ptr<Broker> get_broker_for_node_locked(int32_t node_id);
     void close_broker(std::shared_ptr<Broker> broker);
+    // synkafka_error::broker_unavailable if broker's circuit breaker is open (starting a probe if one is due)
+    std::error_code check_breaker(const std::shared_ptr<Broker>& broker);
+    // Wait as needed to keep a produce of bytes to p on node_id within rate limits, synkafka_error::rate_limited
+    // if that would take too long
+    std::error_code wait_for_rate_limits(const Partition& p, int32_t node_id, size_t bytes);
     void refresh_meta(int attempts = 0);
+    // Replace our brokers and partition map with meta. Caller MUST hold lock on mu_
+    void apply_meta_locked(const proto::MetadataResponse& meta);
+    // Background refresh after starting from cached metadata
+    void validate_cached_meta();
+    void init_broker_configs(const std::string& brokers);
+    void run_maintenance();
+    void maintain_connections();
+
+    // The io_service a broker connection should live on. In sharded mode
+    // this picks the owning shard from a node id (or bootstrap config index)
+    boost::asio::io_service& io_service_for(int32_t node_id);
 
     // Caller MUST hold lock on mu_
     std::string debug_dump_meta();
@@ -149,6 +386,9 @@ private:
     std::deque<proto::Broker>                           broker_configs_; // Only the brokers that were initially passed as bootstrap - we don't have ids just host/ports
     std::map<int32_t, BrokerContainer>                  brokers_;
     std::map<Partition, int32_t>                        partition_map_;
+    std::map<std::string, uint32_t>                     next_partition_; // produce_any() round robin position per topic
+    std::map<std::string, std::shared_ptr<RateLimiter>> topic_rate_limits_;
+    std::map<int32_t, std::shared_ptr<RateLimiter>>     broker_rate_limits_; // created as each broker is first produced to
     std::mutex                                          mu_; // protects all internal state - any state reads should be synchronized
 
     // If multiple threads waiting on meta data ensure only one connects
@@ -157,12 +397,33 @@ private:
     std::chrono::time_point<std::chrono::system_clock>  last_meta_fetch_;
     std::error_code                                     last_meta_error_;
 
-    boost::asio::io_service                             io_service_;
-    std::unique_ptr<boost::asio::io_service::work>      work_;
+    IOThreadMode                                        io_mode_;
+    std::vector<std::unique_ptr<boost::asio::io_service>>   io_services_; // just one unless sharded, none if external
+    boost::asio::io_service*                            external_io_service_; // not owned, nullptr unless given to constructor
+    bool                                                share_connections_;
+    std::vector<std::unique_ptr<boost::asio::io_service::work>> work_;
     std::vector<std::thread>                            asio_threads_;
     std::atomic<bool>                                   stopping_;
+    std::thread                                         maintenance_thread_; // only started if enabled
+    std::condition_variable                             maintenance_cv_; // used with mu_, wakes maintenance on close
+    std::shared_ptr<Interceptor>                        interceptor_;
+    std::unique_ptr<MetaCacheFile>                      meta_cache_; // nullptr unless enabled
+    std::thread                                         meta_validate_thread_; // only started if cached meta was loaded
+    std::atomic<int32_t>                                in_flight_produces_;
+    std::condition_variable                             drain_cv_; // used with mu_, signalled when close() is waiting and the last produce returns
+    std::atomic<bool>                                   cancel_waits_; // set by close() once it stops waiting for produces to drain
+    std::condition_variable                             cancel_cv_; // used with mu_, signalled when cancel_waits_ is set
 
     std::string                                         client_id_;
+
+    Metrics                                             metrics_;
+    MemoryBudget                                        memory_budget_; // after metrics_ which it reports to
+
+    // Idempotent producer state, producer_id_ is -1 until we've been given one
+    std::mutex                                          producer_mu_;
+    int64_t                                             producer_id_;
+    int16_t                                             producer_epoch_;
+    std::map<Partition, std::shared_ptr<PartitionSequence>> sequences_;
 };
 
 }
\ No newline at end of file
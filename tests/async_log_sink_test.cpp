@@ -0,0 +1,129 @@
+#include "gtest/gtest.h"
+
+#include <condition_variable>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <string>
+
+#include "spdlog/spdlog.h"
+
+#include "async_log_sink.h"
+#include "log.h"
+
+using namespace synkafka;
+
+TEST(AsyncLogSink, WritesAllLinesBeforeDestruction)
+{
+    std::ostringstream out;
+
+    {
+        auto sink = std::make_shared<AsyncLogSink>(out, 100);
+        spdlog::logger logger("async_test", sink);
+        logger.set_pattern("%v");
+
+        for (int i = 0; i < 50; ++i) {
+            logger.warn() << "line " << i;
+        }
+
+        EXPECT_EQ(0ul, sink->dropped());
+        // Destroying the logger and sink must flush the remaining lines
+    }
+
+    auto s = out.str();
+    EXPECT_NE(std::string::npos, s.find("line 0\n"));
+    EXPECT_NE(std::string::npos, s.find("line 49\n"));
+}
+
+namespace {
+
+// Holds up the first write to it until opened, so the sink's writer can be stuck part way through
+class GatedBuf : public std::stringbuf
+{
+public:
+    void wait_for_writer()
+    {
+        std::unique_lock<std::mutex> lk(mu_);
+        cv_.wait(lk, [this]() { return entered_; });
+    }
+
+    void open()
+    {
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            open_ = true;
+        }
+        cv_.notify_all();
+    }
+
+protected:
+    std::streamsize xsputn(const char* s, std::streamsize n) override
+    {
+        {
+            std::unique_lock<std::mutex> lk(mu_);
+            entered_ = true;
+            cv_.notify_all();
+            cv_.wait(lk, [this]() { return open_; });
+        }
+        return std::stringbuf::xsputn(s, n);
+    }
+
+private:
+    std::mutex              mu_;
+    std::condition_variable cv_;
+    bool                    entered_ = false;
+    bool                    open_ = false;
+};
+
+}
+
+TEST(AsyncLogSink, DropsAndReportsLinesWhenFull)
+{
+    GatedBuf buf;
+    std::ostream out(&buf);
+
+    {
+        auto sink = std::make_shared<AsyncLogSink>(out, 4);
+        spdlog::logger logger("async_full_test", sink);
+        logger.set_pattern("%v");
+
+        // Writer takes line 0 off the queue and gets stuck writing it
+        logger.warn() << "line 0";
+        buf.wait_for_writer();
+
+        // Room for 4 more, the rest are dropped
+        for (int i = 1; i <= 10; ++i) {
+            logger.warn() << "line " << i;
+        }
+        EXPECT_EQ(6ul, sink->dropped());
+
+        buf.open();
+    }
+
+    auto s = buf.str();
+    EXPECT_NE(std::string::npos, s.find("line 0\n"));
+    EXPECT_NE(std::string::npos, s.find("line 4\n"));
+    EXPECT_EQ(std::string::npos, s.find("line 5\n"));
+    EXPECT_NE(std::string::npos, s.find("dropped 6 log messages"));
+}
+
+TEST(AsyncLogSink, QueueSizeFromEnvironment)
+{
+    unsetenv("LOG_ASYNC_QUEUE_SIZE");
+    EXPECT_EQ(8192u, detail::async_log_queue_size());
+
+    setenv("LOG_ASYNC_QUEUE_SIZE", "16", 1);
+    EXPECT_EQ(16u, detail::async_log_queue_size());
+
+    setenv("LOG_ASYNC_QUEUE_SIZE", "0", 1);
+    EXPECT_EQ(8192u, detail::async_log_queue_size());
+
+    setenv("LOG_ASYNC_QUEUE_SIZE", "lots", 1);
+    EXPECT_EQ(8192u, detail::async_log_queue_size());
+
+    unsetenv("LOG_ASYNC_QUEUE_SIZE");
+}
+
@@ -0,0 +1,42 @@
+#include "gtest/gtest.h"
+
+#include <memory>
+
+#include <boost/asio.hpp>
+
+#include "broker_registry.h"
+
+using namespace synkafka;
+
+TEST(BrokerRegistry, SharesOpenBrokersOnly)
+{
+    boost::asio::io_service io_service;
+    auto& registry = BrokerRegistry::instance();
+
+    auto a = registry.get(io_service, "127.0.0.1", 9092, "client", nullptr);
+    auto b = registry.get(io_service, "127.0.0.1", 9092, "client", nullptr);
+    EXPECT_EQ(a, b);
+
+    // Different client_id or io_service must not share
+    auto c = registry.get(io_service, "127.0.0.1", 9092, "other_client", nullptr);
+    EXPECT_NE(a, c);
+
+    boost::asio::io_service other_io_service;
+    auto d = registry.get(other_io_service, "127.0.0.1", 9092, "client", nullptr);
+    EXPECT_NE(a, d);
+
+    EXPECT_EQ(3u, registry.size());
+
+    // A closed broker is replaced rather than handed out again
+    a->close();
+    auto e = registry.get(io_service, "127.0.0.1", 9092, "client", nullptr);
+    EXPECT_NE(a, e);
+
+    // Entries go once nobody holds the broker
+    a.reset();
+    b.reset();
+    c.reset();
+    d.reset();
+    e.reset();
+    EXPECT_EQ(0u, registry.size());
+}
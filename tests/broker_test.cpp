@@ -0,0 +1,499 @@
+#include "gtest/gtest.h"
+
+#include <atomic>
+#include <future>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "broker.h"
+#include "metrics.h"
+#include "protocol.h"
+
+#include "mock_broker.h"
+
+using namespace synkafka;
+
+namespace {
+
+// Empty MetadataResponse: zero brokers, zero topics
+const std::string empty_meta_response("\x00\x00\x00\x00\x00\x00\x00\x00", 8);
+
+class BrokerUnitTest : public ::testing::Test
+{
+protected:
+    virtual void SetUp()
+    {
+        work_.reset(new boost::asio::io_service::work(io_service_));
+        asio_thread_ = std::thread([this]() { io_service_.run(); });
+    }
+
+    virtual void TearDown()
+    {
+        work_.reset();
+        io_service_.stop();
+        asio_thread_.join();
+    }
+
+    // Keep the asio thread busy until the returned promise is set, so everything
+    // pushed onto a queue meanwhile is waiting there together when it's let go
+    std::promise<void> hold_io()
+    {
+        std::promise<void> release;
+        auto released = release.get_future().share();
+        io_service_.post([released]() { released.wait(); });
+        return release;
+    }
+
+    boost::asio::io_service                         io_service_;
+    std::unique_ptr<boost::asio::io_service::work>  work_;
+    std::thread                                     asio_thread_;
+};
+
+
+std::unique_ptr<PacketEncoder> meta_request()
+{
+    proto::TopicMetadataRequest rq;
+    auto enc = std::unique_ptr<PacketEncoder>(new PacketEncoder(64));
+    enc->io(rq);
+    return enc;
+}
+
+// Request body of about size bytes, the mock broker doesn't look at it
+std::unique_ptr<PacketEncoder> big_request(size_t size)
+{
+    std::string body(size, 'x');
+    auto enc = std::unique_ptr<PacketEncoder>(new PacketEncoder(size + 64));
+    enc->io_bytes(body, COMP_None);
+    return enc;
+}
+
+void expect_resolved(std::vector<std::future<PacketDecoder>>& futures)
+{
+    for (auto& f : futures) {
+        ASSERT_EQ(std::future_status::ready, f.wait_for(std::chrono::seconds(5)));
+        EXPECT_NO_THROW(f.get());
+    }
+}
+
+}
+
+TEST_F(BrokerUnitTest, PipelinedCallsAllResolve)
+{
+    MockBroker mock([](const MockBroker::Request&) { return empty_meta_response; });
+
+    auto metrics = std::make_shared<BrokerMetrics>();
+    Broker b(io_service_, "127.0.0.1", mock.port(), "test", metrics);
+
+    ASSERT_FALSE(b.connect());
+
+    const int n = 50;
+    std::vector<std::future<PacketDecoder>> futures;
+
+    auto release = hold_io();
+    for (int i = 0; i < n; ++i) {
+        futures.push_back(b.call(ApiKey::MetadataRequest, meta_request()));
+    }
+    release.set_value();
+
+    for (auto& f : futures) {
+        ASSERT_EQ(std::future_status::ready, f.wait_for(std::chrono::seconds(5)));
+        auto decoder = f.get();
+        proto::MetadataResponse resp;
+        decoder.io(resp);
+        EXPECT_TRUE(decoder.ok()) << decoder.err_str();
+    }
+
+    EXPECT_EQ(n, mock.requests());
+    EXPECT_EQ(static_cast<uint64_t>(n), metrics->requests_sent.value());
+    // The first call starts a write on it's own, everything queued up behind it goes out in the next one
+    EXPECT_EQ(2u, metrics->writes_sent.value());
+    EXPECT_EQ(static_cast<uint64_t>(n), metrics->responses_received.value());
+    EXPECT_EQ(0, metrics->send_queue_depth.value());
+    EXPECT_EQ(0, metrics->recv_queue_depth.value());
+
+    b.close();
+}
+
+TEST_F(BrokerUnitTest, SyncCallWaitModes)
+{
+    MockBroker mock([](const MockBroker::Request&) { return empty_meta_response; });
+
+    Broker b(io_service_, "127.0.0.1", mock.port(), "test");
+
+    ASSERT_FALSE(b.connect());
+
+    std::vector<SyncWaitPolicy> policies{SyncWaitPolicy{SyncWaitMode::Park, 0, nullptr}
+                                        ,SyncWaitPolicy{SyncWaitMode::SpinThenPark, 100, nullptr}
+                                        ,SyncWaitPolicy{SyncWaitMode::RunIOLoop, 100, nullptr}
+                                        };
+
+    for (auto& policy : policies) {
+        proto::TopicMetadataRequest rq;
+        proto::MetadataResponse resp;
+
+        auto ec = b.sync_call(rq, resp, 5000, policy);
+        EXPECT_FALSE(ec) << "wait mode " << static_cast<int>(policy.mode) << ": " << ec.message();
+    }
+
+    b.close();
+}
+
+TEST_F(BrokerUnitTest, RequestsCarryTheirApiVersion)
+{
+    std::atomic<int> init_pid_version(-1);
+
+    MockBroker mock([&](const MockBroker::Request& r) {
+        if (r.api_key == ApiKey::InitProducerIdRequest) {
+            init_pid_version = r.api_version;
+            proto::InitProducerIdResponse resp{0, make_error_code(kafka_error::NoError), 1234, 7};
+            return MockBroker::encode(resp);
+        }
+        return empty_meta_response;
+    });
+
+    Broker b(io_service_, "127.0.0.1", mock.port(), "test");
+
+    ASSERT_FALSE(b.connect());
+
+    proto::InitProducerIdRequest rq{slice(), 60000};
+    proto::InitProducerIdResponse resp;
+
+    ASSERT_FALSE(b.sync_call(rq, resp, 5000));
+    EXPECT_EQ(0, init_pid_version.load());
+    EXPECT_FALSE(resp.err_code);
+    EXPECT_EQ(1234, resp.producer_id);
+    EXPECT_EQ(7, resp.producer_epoch);
+
+    b.close();
+}
+
+TEST_F(BrokerUnitTest, SocketOptionsApplied)
+{
+    MockBroker mock([](const MockBroker::Request&) { return empty_meta_response; });
+
+    SocketOptions opts;
+    opts.no_delay = true;
+    opts.send_buffer_bytes = 1 << 20;
+    opts.receive_buffer_bytes = 1 << 20;
+    opts.keep_alive = true;
+    opts.quick_ack = true;
+
+    Broker b(io_service_, "127.0.0.1", mock.port(), "test");
+    b.set_socket_options(opts);
+
+    ASSERT_FALSE(b.connect());
+
+    proto::TopicMetadataRequest rq;
+    proto::MetadataResponse resp;
+    EXPECT_FALSE(b.sync_call(rq, resp, 5000));
+
+    b.close();
+}
+
+TEST_F(BrokerUnitTest, CallsBeforeConnectAreSentOnceConnected)
+{
+    MockBroker mock([](const MockBroker::Request&) { return empty_meta_response; });
+
+    Broker b(io_service_, "127.0.0.1", mock.port(), "test");
+
+    // Start the connect from an asio thread, where the blocking connect() isn't allowed
+    std::promise<std::error_code> connected;
+    io_service_.post([&]() {
+        b.async_connect([&](std::error_code ec) { connected.set_value(ec); });
+    });
+
+    // Don't wait for it, these should queue until the connection is up
+    std::vector<std::future<PacketDecoder>> futures;
+    for (int i = 0; i < 10; ++i) {
+        proto::TopicMetadataRequest rq;
+        auto enc = std::unique_ptr<PacketEncoder>(new PacketEncoder(64));
+        enc->io(rq);
+        futures.push_back(b.call(ApiKey::MetadataRequest, std::move(enc)));
+    }
+
+    auto connected_f = connected.get_future();
+    ASSERT_EQ(std::future_status::ready, connected_f.wait_for(std::chrono::seconds(5)));
+    EXPECT_FALSE(connected_f.get());
+
+    for (auto& f : futures) {
+        ASSERT_EQ(std::future_status::ready, f.wait_for(std::chrono::seconds(5)));
+        EXPECT_NO_THROW(f.get());
+    }
+
+    EXPECT_EQ(10, mock.requests());
+    EXPECT_EQ(1, mock.connections());
+
+    b.close();
+}
+
+TEST_F(BrokerUnitTest, AsyncConnectFailureFailsQueuedCalls)
+{
+    // Find a port nobody is listening on
+    int32_t port;
+    {
+        boost::asio::ip::tcp::acceptor a(io_service_, boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+        port = a.local_endpoint().port();
+    }
+
+    Broker b(io_service_, "127.0.0.1", port, "test");
+
+    proto::TopicMetadataRequest rq;
+    auto enc = std::unique_ptr<PacketEncoder>(new PacketEncoder(64));
+    enc->io(rq);
+    auto f = b.call(ApiKey::MetadataRequest, std::move(enc));
+
+    std::promise<std::error_code> connected;
+    b.async_connect([&](std::error_code ec) { connected.set_value(ec); });
+
+    auto connected_f = connected.get_future();
+    ASSERT_EQ(std::future_status::ready, connected_f.wait_for(std::chrono::seconds(5)));
+    EXPECT_EQ(make_error_code(synkafka_error::network_fail), connected_f.get());
+
+    ASSERT_EQ(std::future_status::ready, f.wait_for(std::chrono::seconds(5)));
+    try {
+        f.get();
+        FAIL() << "call on failed connection should throw";
+    } catch (const std::error_code& ec) {
+        EXPECT_EQ(make_error_code(synkafka_error::network_fail), ec);
+    }
+}
+
+TEST_F(BrokerUnitTest, UnknownCorrelationIdsAreDiscarded)
+{
+    MockBroker mock([](const MockBroker::Request&) { return empty_meta_response; });
+    mock.set_stray_responses(true);
+
+    Broker b(io_service_, "127.0.0.1", mock.port(), "test");
+
+    ASSERT_FALSE(b.connect());
+
+    for (int i = 0; i < 5; ++i) {
+        proto::TopicMetadataRequest rq;
+        proto::MetadataResponse resp;
+        EXPECT_FALSE(b.sync_call(rq, resp, 5000));
+    }
+
+    // Connection survived all of them
+    EXPECT_TRUE(b.is_connected());
+    EXPECT_EQ(1, mock.connections());
+
+    b.close();
+}
+
+TEST_F(BrokerUnitTest, MetadataSkipsAheadOfQueuedProduces)
+{
+    std::mutex mu;
+    std::vector<int16_t> api_keys;
+
+    MockBroker mock([&](const MockBroker::Request& r) {
+        std::lock_guard<std::mutex> lk(mu);
+        api_keys.push_back(r.api_key);
+        return empty_meta_response;
+    });
+
+    Broker b(io_service_, "127.0.0.1", mock.port(), "test");
+
+    // Hold up the io thread so everything below is queued before the connection can come up
+    std::promise<void> release;
+    auto released = release.get_future().share();
+    io_service_.post([released]() { released.wait(); });
+
+    std::vector<std::future<PacketDecoder>> futures;
+    for (int i = 0; i < 3; ++i) {
+        auto enc = std::unique_ptr<PacketEncoder>(new PacketEncoder(64));
+        enc->io(i);
+        futures.push_back(b.call(ApiKey::ProduceRequest, std::move(enc)));
+    }
+    for (int i = 0; i < 2; ++i) {
+        proto::TopicMetadataRequest rq;
+        auto enc = std::unique_ptr<PacketEncoder>(new PacketEncoder(64));
+        enc->io(rq);
+        futures.push_back(b.call(ApiKey::MetadataRequest, std::move(enc)));
+    }
+
+    release.set_value();
+
+    for (auto& f : futures) {
+        ASSERT_EQ(std::future_status::ready, f.wait_for(std::chrono::seconds(5)));
+    }
+
+    EXPECT_EQ(0, b.outstanding_requests());
+
+    std::lock_guard<std::mutex> lk(mu);
+    EXPECT_EQ((std::vector<int16_t>{ApiKey::MetadataRequest, ApiKey::MetadataRequest
+                                   ,ApiKey::ProduceRequest, ApiKey::ProduceRequest, ApiKey::ProduceRequest
+                                   }), api_keys);
+
+    b.close();
+}
+
+TEST_F(BrokerUnitTest, AdaptiveConcurrencyLimitsInFlightProduces)
+{
+    std::promise<void> release;
+    auto released = release.get_future().share();
+
+    MockBroker mock([released](const MockBroker::Request& r) {
+        if (r.api_key == ApiKey::ProduceRequest) {
+            released.wait();
+        }
+        return empty_meta_response;
+    });
+
+    auto metrics = std::make_shared<BrokerMetrics>();
+    Broker b(io_service_, "127.0.0.1", mock.port(), "test", metrics);
+    b.set_adaptive_concurrency(2, 4);
+    EXPECT_EQ(2, metrics->concurrency_limit.value());
+
+    ASSERT_FALSE(b.connect());
+
+    auto produce = [&b]() {
+        int32_t body = 1;
+        auto enc = std::unique_ptr<PacketEncoder>(new PacketEncoder(64));
+        enc->io(body);
+        return b.call(ApiKey::ProduceRequest, std::move(enc));
+    };
+
+    auto f1 = produce();
+    auto f2 = produce();
+
+    // No slot comes free in time for a third
+    auto f3 = produce();
+    ASSERT_EQ(std::future_status::ready, f3.wait_for(std::chrono::seconds(0)));
+    try {
+        f3.get();
+        FAIL() << "produce over the limit should fail";
+    } catch (const std::error_code& ec) {
+        EXPECT_EQ(make_error_code(synkafka_error::in_flight_limit), ec);
+    }
+
+    // Waiting for one gives up at the deadline
+    ConcurrencySlot slot;
+    auto start = std::chrono::steady_clock::now();
+    EXPECT_EQ(make_error_code(synkafka_error::in_flight_limit)
+             ,b.acquire_slot(ApiKey::ProduceRequest, start + std::chrono::milliseconds(50), slot));
+    EXPECT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(50));
+    EXPECT_TRUE(slot.empty());
+
+    // Other requests aren't limited
+    proto::TopicMetadataRequest rq;
+    auto enc = std::unique_ptr<PacketEncoder>(new PacketEncoder(64));
+    enc->io(rq);
+    auto meta = b.call(ApiKey::MetadataRequest, std::move(enc));
+
+    release.set_value();
+
+    for (auto f : {&f1, &f2, &meta}) {
+        ASSERT_EQ(std::future_status::ready, f->wait_for(std::chrono::seconds(5)));
+        EXPECT_NO_THROW(f->get());
+    }
+
+    // Both slots were in use when they came back quickly enough
+    EXPECT_GT(metrics->concurrency_limit.value(), 2);
+
+    b.close();
+}
+
+TEST_F(BrokerUnitTest, WriteBatchesAreLimitedInCount)
+{
+    MockBroker mock([](const MockBroker::Request&) { return empty_meta_response; });
+
+    auto metrics = std::make_shared<BrokerMetrics>();
+    Broker b(io_service_, "127.0.0.1", mock.port(), "test", metrics);
+
+    // Not connected yet so everything queues up until the connection is made
+    const size_t n = 2 * RPCSendQueue::MaxWriteBatchRPCs + 1;
+    std::vector<std::future<PacketDecoder>> futures;
+
+    auto release = hold_io();
+    for (size_t i = 0; i < n; ++i) {
+        futures.push_back(b.call(ApiKey::MetadataRequest, meta_request()));
+    }
+    release.set_value();
+
+    expect_resolved(futures);
+
+    EXPECT_EQ(static_cast<uint64_t>(n), metrics->requests_sent.value());
+    EXPECT_EQ(3u, metrics->writes_sent.value());
+
+    b.close();
+}
+
+TEST_F(BrokerUnitTest, WriteBatchesAreLimitedInBytes)
+{
+    MockBroker mock([](const MockBroker::Request&) { return empty_meta_response; });
+
+    auto metrics = std::make_shared<BrokerMetrics>();
+    Broker b(io_service_, "127.0.0.1", mock.port(), "test", metrics);
+
+    // Three fit under the limit but not four: sent as 3, 3 then the 1 left over. A request
+    // bigger than the limit on it's own still goes out, in a write to itself.
+    const size_t size = RPCSendQueue::MaxWriteBatchBytes * 3 / 10;
+    std::vector<std::future<PacketDecoder>> futures;
+
+    auto release = hold_io();
+    for (int i = 0; i < 7; ++i) {
+        futures.push_back(b.call(ApiKey::MetadataRequest, big_request(size)));
+    }
+    futures.push_back(b.call(ApiKey::MetadataRequest, big_request(RPCSendQueue::MaxWriteBatchBytes + 1)));
+    futures.push_back(b.call(ApiKey::MetadataRequest, meta_request()));
+    release.set_value();
+
+    expect_resolved(futures);
+
+    EXPECT_EQ(9u, metrics->requests_sent.value());
+    // The 7th can't share with the big one, and neither can the small one after it
+    EXPECT_EQ(5u, metrics->writes_sent.value());
+
+    b.close();
+}
+
+TEST_F(BrokerUnitTest, RPCThatFailsToEncodeIsDroppedFromItsBatch)
+{
+    MockBroker mock([](const MockBroker::Request&) { return empty_meta_response; });
+
+    auto metrics = std::make_shared<BrokerMetrics>();
+    Connection conn(io_service_, "127.0.0.1", mock.port());
+    RPCRecvQueue recv_q(conn, nullptr, metrics);
+    RPCSendQueue send_q(conn, [&recv_q](std::unique_ptr<RPC> rpc) { recv_q.push(std::move(rpc)); }, metrics);
+
+    // Too long for the request header's int16 length prefix
+    std::string good_id("test");
+    std::string bad_id(40000, 'x');
+
+    std::vector<std::future<PacketDecoder>> futures;
+    std::future<PacketDecoder> bad_future;
+
+    auto release = hold_io();
+    for (int i = 0; i < 5; ++i) {
+        std::unique_ptr<RPC> rpc(new RPC(ApiKey::MetadataRequest, meta_request(), slice(i == 2 ? bad_id : good_id)));
+        if (i == 2) {
+            bad_future = rpc->get_future();
+        } else {
+            futures.push_back(rpc->get_future());
+        }
+        send_q.push(std::move(rpc));
+    }
+    release.set_value();
+
+    ASSERT_EQ(std::future_status::ready, bad_future.wait_for(std::chrono::seconds(5)));
+    try {
+        bad_future.get();
+        FAIL() << "RPC with an unencodable header should fail";
+    } catch (const std::error_code& ec) {
+        EXPECT_EQ(make_error_code(synkafka_error::encoding_error), ec);
+    }
+
+    expect_resolved(futures);
+
+    EXPECT_EQ(4, mock.requests());
+    EXPECT_EQ(4u, metrics->requests_sent.value());
+    EXPECT_EQ(1u, metrics->writes_sent.value());
+    EXPECT_EQ(0, metrics->send_queue_depth.value());
+    EXPECT_EQ(0, metrics->recv_queue_depth.value());
+
+    conn.close();
+}
@@ -0,0 +1,57 @@
+#include "gtest/gtest.h"
+
+#include "buffer_pool.h"
+
+using namespace synkafka;
+
+TEST(ResponseBufferPool, SizeAdaptsPerApiKey)
+{
+    ResponseBufferPool pool;
+
+    EXPECT_EQ(1024u, pool.size_for(3));
+    EXPECT_EQ(1024u, pool.acquire(3)->size());
+
+    // One big response is enough to size the next buffer for it
+    pool.record(3, 300 * 1024);
+    EXPECT_EQ(512u * 1024, pool.size_for(3));
+    EXPECT_LE(300u * 1024, pool.acquire(3)->size());
+
+    // Other keys are unaffected
+    EXPECT_EQ(1024u, pool.size_for(0));
+
+    // Small responses shrink it only gradually
+    pool.record(3, 100);
+    EXPECT_EQ(512u * 1024, pool.size_for(3));
+    for (int i = 0; i < 200; ++i) {
+        pool.record(3, 100);
+    }
+    EXPECT_EQ(1024u, pool.size_for(3));
+
+    // Out of range keys get the minimum
+    pool.record(-1, 1 << 20);
+    EXPECT_EQ(1024u, pool.size_for(-1));
+}
+
+TEST(ResponseBufferPool, BuffersAreRecycled)
+{
+    ResponseBufferPool pool;
+
+    pool.record(3, 100 * 1024);
+
+    buffer_t* raw;
+    {
+        auto b = pool.acquire(3);
+        raw = b.get();
+        EXPECT_EQ(0u, pool.idle_buffers());
+    }
+    EXPECT_EQ(1u, pool.idle_buffers());
+
+    auto b = pool.acquire(3);
+    EXPECT_EQ(raw, b.get());
+    EXPECT_EQ(0u, pool.idle_buffers());
+
+    // A buffer grown past it's class is still reused for the smaller class
+    b->resize(300 * 1024);
+    b.reset();
+    EXPECT_EQ(raw, pool.acquire(3).get());
+}
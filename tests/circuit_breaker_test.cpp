@@ -0,0 +1,58 @@
+#include "gtest/gtest.h"
+
+#include <chrono>
+#include <thread>
+
+#include "circuit_breaker.h"
+
+using namespace synkafka;
+
+TEST(CircuitBreaker, OpensAndProbesOncePerBackoff)
+{
+    CircuitBreaker breaker(50, 1000);
+    bool probe = true;
+
+    EXPECT_TRUE(breaker.allow(probe));
+    EXPECT_FALSE(probe);
+
+    breaker.record_failure();
+    EXPECT_TRUE(breaker.is_open());
+    EXPECT_FALSE(breaker.allow(probe));
+    EXPECT_FALSE(probe);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(70));
+
+    // Only the first caller after the backoff gets to probe
+    EXPECT_FALSE(breaker.allow(probe));
+    EXPECT_TRUE(probe);
+    EXPECT_FALSE(breaker.allow(probe));
+    EXPECT_FALSE(probe);
+
+    // Probe failed, backoff doubles to 100ms
+    breaker.record_failure();
+    EXPECT_EQ(2, breaker.failures());
+    std::this_thread::sleep_for(std::chrono::milliseconds(60));
+    EXPECT_FALSE(breaker.allow(probe));
+    EXPECT_FALSE(probe);
+    std::this_thread::sleep_for(std::chrono::milliseconds(60));
+    EXPECT_FALSE(breaker.allow(probe));
+    EXPECT_TRUE(probe);
+
+    breaker.record_success();
+    EXPECT_FALSE(breaker.is_open());
+    EXPECT_TRUE(breaker.allow(probe));
+    EXPECT_FALSE(probe);
+}
+
+TEST(CircuitBreaker, ZeroBackoffNeverOpens)
+{
+    CircuitBreaker breaker(0, 1000);
+    bool probe = true;
+
+    breaker.record_failure();
+    breaker.record_failure();
+
+    EXPECT_FALSE(breaker.is_open());
+    EXPECT_TRUE(breaker.allow(probe));
+    EXPECT_FALSE(probe);
+}
@@ -0,0 +1,87 @@
+#include "gtest/gtest.h"
+
+#include <chrono>
+#include <memory>
+
+#include "concurrency_limiter.h"
+#include "metrics.h"
+
+using namespace synkafka;
+using std::chrono::microseconds;
+
+namespace {
+
+std::chrono::steady_clock::time_point now()
+{
+    return std::chrono::steady_clock::now();
+}
+
+}
+
+TEST(ConcurrencyLimiter, GrowsWhileLatencyHolds)
+{
+    auto metrics = std::make_shared<BrokerMetrics>();
+    ConcurrencyLimiter limiter(4, 6, metrics);
+    EXPECT_EQ(4, metrics->concurrency_limit.value());
+
+    // Use the whole limit, with nothing more to be had
+    for (int i = 0; i < 4; ++i) {
+        ASSERT_TRUE(limiter.acquire(now()));
+    }
+    EXPECT_FALSE(limiter.acquire(now()));
+
+    // Quick responses while it's fully used raise the limit, up to the max
+    for (int i = 0; i < 4; ++i) {
+        limiter.release(microseconds(1000), false);
+        ASSERT_TRUE(limiter.acquire(now()));
+    }
+    EXPECT_EQ(6, limiter.limit());
+    EXPECT_EQ(6, metrics->concurrency_limit.value());
+}
+
+TEST(ConcurrencyLimiter, BacksOffOnQueueingAndFailures)
+{
+    ConcurrencyLimiter limiter(10, 100);
+
+    ASSERT_TRUE(limiter.acquire(now()));
+    limiter.release(microseconds(1000), false);
+    int32_t before = limiter.limit();
+
+    // Well over twice the quickest we've seen
+    ASSERT_TRUE(limiter.acquire(now()));
+    limiter.release(microseconds(5000), false);
+    EXPECT_LT(limiter.limit(), before);
+    before = limiter.limit();
+
+    ASSERT_TRUE(limiter.acquire(now()));
+    limiter.release(microseconds(1000), true);
+    EXPECT_LT(limiter.limit(), before);
+
+    // Never below one
+    for (int i = 0; i < 100; ++i) {
+        ASSERT_TRUE(limiter.acquire(now()));
+        limiter.release(microseconds(1000), true);
+    }
+    EXPECT_EQ(ConcurrencyLimiter::MinLimit, limiter.limit());
+    EXPECT_EQ(0, limiter.in_flight());
+}
+
+TEST(ConcurrencyLimiter, UnusedSlotsGoBackUnchanged)
+{
+    auto limiter = std::make_shared<ConcurrencyLimiter>(1, 4);
+
+    ASSERT_TRUE(limiter->acquire(now()));
+    {
+        ConcurrencySlot slot(limiter);
+        EXPECT_FALSE(limiter->acquire(now() + std::chrono::milliseconds(20)));
+
+        ConcurrencySlot moved(std::move(slot));
+        EXPECT_TRUE(slot.empty());
+        EXPECT_EQ(1, limiter->in_flight());
+    }
+
+    // Neither raised nor cut by a slot nobody used
+    EXPECT_EQ(0, limiter->in_flight());
+    EXPECT_EQ(1, limiter->limit());
+    EXPECT_TRUE(limiter->acquire(now()));
+}
@@ -0,0 +1,75 @@
+#include "gtest/gtest.h"
+
+#include <chrono>
+#include <thread>
+
+#include "errors.h"
+#include "memory_budget.h"
+#include "metrics.h"
+
+using namespace synkafka;
+
+TEST(MemoryBudget, FailFastAndRelease)
+{
+    Gauge used;
+    MemoryBudget budget(&used);
+    budget.set_limit(100);
+
+    MemoryReservation a, b;
+    EXPECT_FALSE(budget.reserve(60, 0, a));
+    EXPECT_EQ(60u, budget.used());
+    EXPECT_EQ(60, used.value());
+
+    // Doesn't fit and we don't wait
+    EXPECT_EQ(synkafka_error::buffer_memory_exhausted, budget.reserve(60, 0, b));
+    EXPECT_EQ(0u, b.bytes());
+
+    // Bigger than the whole limit can never fit
+    EXPECT_EQ(synkafka_error::buffer_memory_exhausted, budget.reserve(101, 1000, b));
+
+    a.release();
+    EXPECT_EQ(0u, budget.used());
+
+    EXPECT_FALSE(budget.reserve(60, 0, b));
+    {
+        // Moved reservations are released exactly once
+        MemoryReservation c(std::move(b));
+        EXPECT_EQ(60u, budget.used());
+    }
+    EXPECT_EQ(0u, budget.used());
+    EXPECT_EQ(0, used.value());
+}
+
+TEST(MemoryBudget, BlocksUntilReleased)
+{
+    Counter waited;
+    MemoryBudget budget(nullptr, &waited);
+    budget.set_limit(100);
+
+    MemoryReservation a;
+    ASSERT_FALSE(budget.reserve(100, 0, a));
+
+    std::thread releaser([&a]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        a.release();
+    });
+
+    MemoryReservation b;
+    EXPECT_FALSE(budget.reserve(50, 5000, b));
+    EXPECT_GT(waited.value(), 0u);
+
+    releaser.join();
+
+    // Times out while b is still held
+    MemoryReservation c;
+    EXPECT_EQ(synkafka_error::buffer_memory_exhausted, budget.reserve(60, 10, c));
+}
+
+TEST(MemoryBudget, UnlimitedStillTracksUsage)
+{
+    MemoryBudget budget;
+
+    MemoryReservation a;
+    EXPECT_FALSE(budget.reserve(1 << 30, 0, a));
+    EXPECT_EQ(static_cast<size_t>(1 << 30), budget.used());
+}
@@ -1,5 +1,8 @@
 #include "gtest/gtest.h"
 
+#include <memory>
+#include <string>
+
 #include "message_set.h"
 
 using namespace synkafka;
@@ -32,4 +35,39 @@ TEST(MessageSet, Construction)
 
     EXPECT_TRUE((bool)ec);
     EXPECT_EQ(synkafka_error::message_set_full, ec);
-}
\ No newline at end of file
+}
+
+TEST(MessageSet, PushTakesOwnership)
+{
+    MessageSet ms;
+
+    // Long enough not to fit in a small string buffer so the move keeps the same heap memory
+    std::string value(100, 'v');
+    const char* value_data = value.data();
+
+    EXPECT_FALSE(ms.push(std::move(value), std::string("key")));
+
+    buffer_t buf_value(10, 'b');
+    const uint8_t* buf_data = buf_value.data();
+    EXPECT_FALSE(ms.push(std::move(buf_value), buffer_t(2, 'k')));
+
+    auto shared = std::make_shared<std::string>("shared message");
+    std::weak_ptr<std::string> weak = shared;
+    EXPECT_FALSE(ms.push(slice(*shared), slice(), shared));
+    shared.reset();
+
+    // Set keeps the refcounted buffer alive
+    EXPECT_FALSE(weak.expired());
+
+    auto& msgs = ms.get_messages();
+    ASSERT_EQ(3u, msgs.size());
+
+    EXPECT_EQ(reinterpret_cast<const uint8_t*>(value_data), msgs[0].value.data());
+    EXPECT_EQ(std::string(100, 'v'), msgs[0].value.str());
+    EXPECT_EQ("key", msgs[0].key.str());
+
+    EXPECT_EQ(buf_data, msgs[1].value.data());
+    EXPECT_EQ(2u, msgs[1].key.size());
+
+    EXPECT_EQ("shared message", msgs[2].value.str());
+}
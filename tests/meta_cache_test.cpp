@@ -0,0 +1,66 @@
+#include "gtest/gtest.h"
+
+#include <cstdio>
+#include <string>
+
+#include "meta_cache.h"
+
+using namespace synkafka;
+
+TEST(MetaCacheFile, RoundTrip)
+{
+    proto::MetadataResponse meta{{proto::Broker{1, "kafka1.example.com", 9092}
+                                 ,proto::Broker{2, "10.0.0.2", 9093}
+                                 }
+                                ,{proto::TopicMetaData{make_error_code(kafka_error::NoError)
+                                                      ,"events"
+                                                      ,{proto::PartitionMetaData{make_error_code(kafka_error::NoError), 0, 1, {1, 2}, {1}}
+                                                       ,proto::PartitionMetaData{make_error_code(kafka_error::NoError), 1, 2, {2, 1}, {2}}
+                                                       }
+                                                      }
+                                 ,proto::TopicMetaData{make_error_code(kafka_error::NoError)
+                                                      ,"no_leader"
+                                                      ,{proto::PartitionMetaData{make_error_code(kafka_error::NoError), 0, -1, {}, {}}}
+                                                      }
+                                 }
+                                };
+
+    auto path = "/tmp/synkafka_meta_cache_file_test";
+    MetaCacheFile file(path);
+    ASSERT_FALSE(file.save(meta));
+
+    proto::MetadataResponse loaded;
+    ASSERT_FALSE(file.load(loaded));
+    std::remove(path);
+
+    ASSERT_EQ(2u, loaded.brokers.size());
+    EXPECT_EQ(2, loaded.brokers[1].node_id);
+    EXPECT_EQ("10.0.0.2", loaded.brokers[1].host);
+    EXPECT_EQ(9093, loaded.brokers[1].port);
+
+    ASSERT_EQ(2u, loaded.topics.size());
+    EXPECT_EQ("events", loaded.topics[0].name);
+    ASSERT_EQ(2u, loaded.topics[0].partitions.size());
+    EXPECT_EQ(1, loaded.topics[0].partitions[1].partition_id);
+    EXPECT_EQ(2, loaded.topics[0].partitions[1].leader);
+    EXPECT_EQ(-1, loaded.topics[1].partitions[0].leader);
+
+    // Same file again
+    EXPECT_EQ(MetaCacheFile::serialize(meta), MetaCacheFile::serialize(loaded));
+}
+
+TEST(MetaCacheFile, RejectsBadFiles)
+{
+    proto::MetadataResponse meta;
+
+    EXPECT_TRUE(MetaCacheFile::parse("synkafka_meta 1\n", meta));
+    EXPECT_FALSE(MetaCacheFile::parse("", meta));
+    EXPECT_FALSE(MetaCacheFile::parse("synkafka_meta 2\n", meta));
+    EXPECT_FALSE(MetaCacheFile::parse("something_else 1\n", meta));
+    EXPECT_FALSE(MetaCacheFile::parse("synkafka_meta 1\nbroker 1 host\n", meta));
+    EXPECT_FALSE(MetaCacheFile::parse("synkafka_meta 1\npartition events zero 1\n", meta));
+    EXPECT_FALSE(MetaCacheFile::parse("synkafka_meta 1\nreplica 1 2\n", meta));
+
+    MetaCacheFile missing("/tmp/synkafka_meta_cache_does_not_exist");
+    EXPECT_EQ(std::errc::no_such_file_or_directory, missing.load(meta));
+}
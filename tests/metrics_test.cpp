@@ -0,0 +1,72 @@
+#include "gtest/gtest.h"
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "errors.h"
+#include "metrics.h"
+
+using namespace synkafka;
+
+TEST(Metrics, CounterSumsAcrossThreads)
+{
+    Counter c;
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; ++i) {
+        threads.emplace_back([&c]() {
+            for (int j = 0; j < 1000; ++j) {
+                c.add();
+            }
+        });
+    }
+
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    EXPECT_EQ(4000ul, c.value());
+}
+
+TEST(Metrics, Snapshot)
+{
+    Metrics m;
+
+    m.produce_requests.add(3);
+    m.broker(2)->bytes_sent.add(100);
+    m.broker(2)->send_queue_depth.add(2);
+    m.broker(2)->send_queue_depth.sub();
+
+    m.record_error(make_error_code(kafka_error::NotLeaderForPartition));
+    m.record_error(make_error_code(kafka_error::Unknown));
+    m.record_error(make_error_code(synkafka_error::network_timeout));
+    m.record_error(std::make_error_code(std::errc::connection_refused));
+
+    auto s = m.snapshot();
+
+    EXPECT_EQ(3ul, s.produce_requests);
+    ASSERT_EQ(1ul, s.brokers.count(2));
+    EXPECT_EQ(100ul, s.brokers[2].bytes_sent);
+    EXPECT_EQ(1, s.brokers[2].send_queue_depth);
+
+    EXPECT_EQ(1ul, s.kafka_errors[static_cast<int>(kafka_error::NotLeaderForPartition)]);
+    EXPECT_EQ(1ul, s.kafka_errors[static_cast<int>(kafka_error::Unknown)]);
+    EXPECT_EQ(1ul, s.client_errors[static_cast<int>(synkafka_error::network_timeout)]);
+    EXPECT_EQ(1ul, s.other_errors);
+}
+
+TEST(Metrics, PrometheusFormat)
+{
+    Metrics m;
+
+    m.produce_requests.add(5);
+    m.broker(1)->bytes_received.add(42);
+    m.record_error(make_error_code(kafka_error::NotLeaderForPartition));
+
+    auto out = format_prometheus(m.snapshot(), "test");
+
+    EXPECT_NE(std::string::npos, out.find("# TYPE test_produce_requests_total counter\ntest_produce_requests_total 5\n"));
+    EXPECT_NE(std::string::npos, out.find("test_broker_bytes_received_total{node_id=\"1\"} 42\n"));
+    EXPECT_NE(std::string::npos, out.find("test_errors_total{category=\"kafka\",code=\"6\"} 1\n"));
+}
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "packet.h"
+#include "portable_endian.h"
+
+// Minimal in-process stand-in for a Kafka broker for unit tests.
+// Accepts any number of connections and answers each request with a response carrying the
+// request's correlation id and whatever body the handler returns for it. Each connection is
+// served on it's own thread so handlers must be thread safe.
+class MockBroker
+{
+public:
+    struct Request
+    {
+        int16_t     api_key;
+        int16_t     api_version;
+        int32_t     correlation_id;
+        std::string body; // everything after the header
+    };
+
+    typedef std::function<std::string (const Request&)> handler_t;
+
+    explicit MockBroker(handler_t handler = nullptr)
+        : io_service_()
+        , acceptor_(io_service_, boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0))
+        , handler_(std::move(handler))
+        , stopping_(false)
+        , stray_responses_(false)
+        , requests_(0)
+        , connections_(0)
+        , mu_()
+        , sockets_()
+        , threads_()
+        , accept_thread_(&MockBroker::accept_loop, this)
+    {}
+
+    ~MockBroker()
+    {
+        boost::system::error_code ec;
+        stopping_ = true;
+
+        {
+            // Closing the acceptor doesn't reliably wake a blocked accept() so connect to it ourselves
+            boost::asio::ip::tcp::socket s(io_service_);
+            s.connect(acceptor_.local_endpoint(), ec);
+            accept_thread_.join();
+        }
+
+        std::lock_guard<std::mutex> lk(mu_);
+        for (auto& s : sockets_) {
+            s->shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
+        }
+        for (auto& t : threads_) {
+            t.join();
+        }
+    }
+
+    int32_t port() const { return acceptor_.local_endpoint().port(); }
+    int requests() const { return requests_.load(); }
+    int connections() const { return connections_.load(); }
+
+    // Precede every real response with one carrying a correlation id nobody asked for
+    void set_stray_responses(bool stray) { stray_responses_ = stray; }
+
+    // Encode a response body struct the way a broker would
+    template<typename T>
+    static std::string encode(T& body)
+    {
+        synkafka::PacketEncoder enc(256);
+        enc.io(body);
+        return enc.get_as_slice(false).str();
+    }
+
+private:
+    void accept_loop()
+    {
+        for (;;) {
+            auto socket = std::make_shared<boost::asio::ip::tcp::socket>(io_service_);
+            boost::system::error_code ec;
+
+            acceptor_.accept(*socket, ec);
+            if (ec || stopping_.load()) {
+                return;
+            }
+
+            ++connections_;
+
+            std::lock_guard<std::mutex> lk(mu_);
+            sockets_.push_back(socket);
+            threads_.emplace_back(&MockBroker::serve, this, socket);
+        }
+    }
+
+    void serve(std::shared_ptr<boost::asio::ip::tcp::socket> socket)
+    {
+        using namespace boost::asio;
+        boost::system::error_code ec;
+
+        for (;;) {
+            uint32_t len_be = 0;
+            read(*socket, buffer(&len_be, sizeof(len_be)), ec);
+            if (ec) return;
+
+            std::string packet(be32toh(len_be), '\0');
+            read(*socket, buffer(&packet[0], packet.size()), ec);
+            if (ec) return;
+
+            Request r;
+            r.api_key = static_cast<int16_t>(be16toh(*reinterpret_cast<const uint16_t*>(&packet[0])));
+            r.api_version = static_cast<int16_t>(be16toh(*reinterpret_cast<const uint16_t*>(&packet[2])));
+            r.correlation_id = static_cast<int32_t>(be32toh(*reinterpret_cast<const uint32_t*>(&packet[4])));
+            auto client_id_len = static_cast<int16_t>(be16toh(*reinterpret_cast<const uint16_t*>(&packet[8])));
+            r.body = packet.substr(10 + (client_id_len > 0 ? client_id_len : 0));
+
+            ++requests_;
+
+            std::string body = handler_ ? handler_(r) : std::string();
+
+            if (stray_responses_.load()) {
+                uint32_t stray_len = htobe32(static_cast<uint32_t>(sizeof(int32_t) + 3));
+                uint32_t stray_corr = htobe32(static_cast<uint32_t>(r.correlation_id + 1000000));
+                std::vector<const_buffer> stray{buffer(&stray_len, sizeof(stray_len))
+                                               ,buffer(&stray_corr, sizeof(stray_corr))
+                                               ,buffer("xyz", 3)
+                                               };
+                write(*socket, stray, ec);
+                if (ec) return;
+            }
+
+            uint32_t resp_len = htobe32(static_cast<uint32_t>(sizeof(int32_t) + body.size()));
+            uint32_t corr = htobe32(static_cast<uint32_t>(r.correlation_id));
+
+            std::vector<const_buffer> bufs{buffer(&resp_len, sizeof(resp_len))
+                                          ,buffer(&corr, sizeof(corr))
+                                          ,buffer(body)
+                                          };
+            write(*socket, bufs, ec);
+            if (ec) return;
+        }
+    }
+
+    boost::asio::io_service                         io_service_;
+    boost::asio::ip::tcp::acceptor                  acceptor_;
+    handler_t                                       handler_;
+    std::atomic<bool>                               stopping_;
+    std::atomic<bool>                               stray_responses_;
+    std::atomic<int>                                requests_;
+    std::atomic<int>                                connections_;
+    std::mutex                                      mu_; // protects sockets_ and threads_
+    std::vector<std::shared_ptr<boost::asio::ip::tcp::socket>> sockets_;
+    std::vector<std::thread>                        threads_;
+    std::thread                                     accept_thread_;
+};
@@ -1,13 +1,32 @@
 #include "gtest/gtest.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <tuple>
 #include <vector>
 
+#include <boost/asio.hpp>
+
+#include "portable_endian.h"
+
 #include "protocol.h"
 #include "slice.h"
 #include "synkafka.h"
 
+#include "mock_broker.h"
+
 using namespace synkafka;
 
 
@@ -38,4 +57,1104 @@ TEST(ProducerClient, ParseBrokerString)
         }
     }
 
-}
\ No newline at end of file
+}
+
+TEST(ProducerClient, ShardedModeFailsCleanlyWithoutCluster)
+{
+    // Nothing listens on port 1 so connecting is refused straight away
+    ProducerClient client("127.0.0.1:1", 2, IOThreadMode::ShardPerCore);
+    client.set_connect_timeout(100);
+
+    MessageSet messages;
+    messages.push("test message", "");
+
+    auto ec = client.produce("test", 0, messages);
+    EXPECT_TRUE((bool)ec);
+
+    client.close();
+    // Destructor will call close() again which must be safe
+}
+
+TEST(ProducerClient, ShardedModeRejectsRunIOLoopWait)
+{
+    ProducerClient client("127.0.0.1:1", 2, IOThreadMode::ShardPerCore);
+
+    EXPECT_THROW(client.set_sync_wait(SyncWaitMode::RunIOLoop), std::invalid_argument);
+    EXPECT_NO_THROW(client.set_sync_wait(SyncWaitMode::SpinThenPark));
+}
+
+TEST(ProducerClient, ShardCoreAffinityOnlyWhenSharded)
+{
+    ProducerClient shared("127.0.0.1:1");
+    EXPECT_THROW(shared.set_shard_core_affinity(0), std::invalid_argument);
+
+    ProducerClient sharded("127.0.0.1:1", 2, IOThreadMode::ShardPerCore);
+    EXPECT_THROW(sharded.set_shard_core_affinity(-1), std::invalid_argument);
+    EXPECT_NO_THROW(sharded.set_shard_core_affinity(1));
+}
+
+TEST(ProducerClient, BulkAvailabilityReturnsErrorPerPartition)
+{
+    ProducerClient client("127.0.0.1:1");
+    client.set_connect_timeout(100);
+
+    std::vector<std::pair<std::string, int32_t>> partitions{{"test", 0}, {"test", 1}, {"other", 0}};
+
+    auto errors = client.check_topic_partitions_leader_available(partitions);
+
+    ASSERT_EQ(partitions.size(), errors.size());
+    for (auto& ec : errors) {
+        EXPECT_TRUE((bool)ec);
+    }
+
+    client.close();
+
+    errors = client.check_topic_partitions_leader_available(partitions);
+    ASSERT_EQ(partitions.size(), errors.size());
+    for (auto& ec : errors) {
+        EXPECT_EQ(make_error_code(synkafka_error::client_stopping), ec);
+    }
+}
+
+TEST(ProducerClient, ExternalIOServiceIsNotStoppedByClose)
+{
+    boost::asio::io_service io_service;
+    std::unique_ptr<boost::asio::io_service::work> work(new boost::asio::io_service::work(io_service));
+    std::thread io_thread([&io_service]() { io_service.run(); });
+
+    {
+        ProducerClient a("127.0.0.1:1", io_service);
+        ProducerClient b("127.0.0.1:1", io_service);
+        a.set_connect_timeout(100);
+        b.set_connect_timeout(100);
+
+        MessageSet messages;
+        messages.push("test message", "");
+
+        EXPECT_TRUE((bool)a.produce("test", 0, messages));
+        a.close();
+
+        EXPECT_FALSE(io_service.stopped());
+        EXPECT_TRUE((bool)b.produce("test", 0, messages));
+    }
+
+    EXPECT_FALSE(io_service.stopped());
+
+    work.reset();
+    io_thread.join();
+}
+
+namespace {
+
+// Metadata for a one broker cluster where the mock is broker 1 and leads "test" partition 0
+std::string single_broker_meta(int32_t port)
+{
+    proto::MetadataResponse resp{{proto::Broker{1, "127.0.0.1", port}}
+                                ,{proto::TopicMetaData{make_error_code(kafka_error::NoError)
+                                                      ,"test"
+                                                      ,{proto::PartitionMetaData{make_error_code(kafka_error::NoError), 0, 1, {1}, {1}}}
+                                                      }
+                                 }
+                                };
+    return MockBroker::encode(resp);
+}
+
+}
+
+TEST(ProducerClient, IdleConnectionsAreClosed)
+{
+    int32_t port = 0;
+    MockBroker mock([&](const MockBroker::Request&) { return single_broker_meta(port); });
+    port = mock.port();
+
+    ProducerClient client("127.0.0.1:" + std::to_string(port));
+    client.set_connection_maintenance(50, 0);
+
+    ASSERT_FALSE(client.check_topic_partition_leader_available("test", 0));
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    EXPECT_EQ(1u, client.metrics().snapshot().idle_connections_closed);
+
+    // Closed connection is transparently replaced when next needed
+    EXPECT_FALSE(client.check_topic_partition_leader_available("test", 0));
+
+    client.close();
+}
+
+TEST(ProducerClient, ProbesKeepLeaderConnectionsAlive)
+{
+    int32_t port = 0;
+    std::atomic<int> probes(0);
+    MockBroker mock([&](const MockBroker::Request& r) {
+        // Probes ask about just the one topic, full refreshes ask for all (empty array)
+        if (r.body.size() > 4) {
+            ++probes;
+        }
+        return single_broker_meta(port);
+    });
+    port = mock.port();
+
+    ProducerClient client("127.0.0.1:" + std::to_string(port));
+    client.set_connection_maintenance(300, 20);
+
+    ASSERT_FALSE(client.check_topic_partition_leader_available("test", 0));
+    auto connections = mock.connections();
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    auto m = client.metrics().snapshot();
+    EXPECT_GT(probes.load(), 0);
+    EXPECT_EQ(0u, m.idle_connections_closed);
+    EXPECT_EQ(0u, m.health_probe_failures);
+    EXPECT_EQ(connections, mock.connections());
+
+    client.close();
+}
+
+TEST(ProducerClient, StartsFromCachedMetadata)
+{
+    int32_t port = 0;
+    std::atomic<int> meta_requests(0);
+    MockBroker mock([&](const MockBroker::Request&) {
+        ++meta_requests;
+        return single_broker_meta(port);
+    });
+    port = mock.port();
+
+    auto cache_path = "/tmp/synkafka_meta_cache_test." + std::to_string(port);
+    std::remove(cache_path.c_str());
+
+    {
+        // No file yet so this bootstraps as usual, and saves what it finds
+        ProducerClient client("127.0.0.1:" + std::to_string(port));
+        client.set_metadata_cache_file(cache_path);
+        ASSERT_FALSE(client.check_topic_partition_leader_available("test", 0));
+        client.close();
+    }
+    ASSERT_EQ(1, meta_requests.load());
+
+    // Nothing listens on the bootstrap port this time, only the cache can tell us the leader
+    int32_t dead_port;
+    {
+        boost::asio::io_service io;
+        boost::asio::ip::tcp::acceptor a(io, boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+        dead_port = a.local_endpoint().port();
+    }
+
+    {
+        ProducerClient client("127.0.0.1:" + std::to_string(dead_port));
+        client.set_metadata_cache_file(cache_path);
+
+        int32_t leader = -1;
+        EXPECT_FALSE(client.check_topic_partition_leader_available("test", 0, &leader));
+        EXPECT_EQ(1, leader);
+
+        // Cached meta is validated in the background by asking the cached broker
+        for (int i = 0; i < 500 && meta_requests.load() < 2; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        client.close();
+
+        EXPECT_EQ(2, meta_requests.load());
+        EXPECT_EQ(0u, client.metrics().snapshot().meta_refresh_failures);
+    }
+
+    std::remove(cache_path.c_str());
+}
+
+TEST(ProducerClient, CloseDrainsInFlightProduces)
+{
+    int32_t port = 0;
+    MockBroker mock([&](const MockBroker::Request& r) {
+        if (r.api_key == ApiKey::MetadataRequest) {
+            return single_broker_meta(port);
+        }
+        // Slow but well within the drain deadline
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        proto::ProduceResponse resp{{proto::ProduceResponseTopic{"test", {proto::ProduceResponsePartition{0, make_error_code(kafka_error::NoError), 0}}}}};
+        return MockBroker::encode(resp);
+    });
+    port = mock.port();
+
+    ProducerClient client("127.0.0.1:" + std::to_string(port));
+    ASSERT_FALSE(client.check_topic_partition_leader_available("test", 0));
+
+    std::error_code produce_ec = make_error_code(synkafka_error::unknown);
+    std::thread producer([&]() {
+        MessageSet messages;
+        messages.push("test message", "");
+        produce_ec = client.produce("test", 0, messages);
+    });
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    client.close(2000);
+    producer.join();
+
+    EXPECT_FALSE(produce_ec) << produce_ec.message();
+
+    // Nothing new is accepted
+    MessageSet messages;
+    messages.push("test message", "");
+    EXPECT_EQ(synkafka_error::client_stopping, client.produce("test", 0, messages));
+}
+
+TEST(ProducerClient, CloseFailsProducesLeftAfterDrainDeadline)
+{
+    std::mutex mu;
+    std::condition_variable cv;
+    bool release = false;
+    int32_t port = 0;
+
+    MockBroker mock([&](const MockBroker::Request& r) {
+        if (r.api_key == ApiKey::MetadataRequest) {
+            return single_broker_meta(port);
+        }
+        // Never answer until the test is done
+        std::unique_lock<std::mutex> lk(mu);
+        cv.wait_for(lk, std::chrono::seconds(5), [&]() { return release; });
+        return std::string();
+    });
+    port = mock.port();
+
+    ProducerClient client("127.0.0.1:" + std::to_string(port));
+    ASSERT_FALSE(client.check_topic_partition_leader_available("test", 0));
+
+    std::error_code produce_ec;
+    std::thread producer([&]() {
+        MessageSet messages;
+        messages.push("test message", "");
+        produce_ec = client.produce("test", 0, messages);
+    });
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    auto start = std::chrono::steady_clock::now();
+    client.close(100);
+    producer.join();
+    auto took = std::chrono::steady_clock::now() - start;
+
+    EXPECT_EQ(make_error_code(synkafka_error::client_stopping), produce_ec);
+    // Much less than the 10 second produce timeout
+    EXPECT_LT(took, std::chrono::seconds(2));
+
+    {
+        std::lock_guard<std::mutex> lk(mu);
+        release = true;
+    }
+    cv.notify_all();
+}
+
+namespace {
+
+class RecordingInterceptor : public Interceptor
+{
+public:
+    void on_enqueue(const RequestTrace& t) override { record("enqueue", t); }
+    void on_encoded(const RequestTrace& t) override { record("encoded", t); }
+    void on_write_start(const RequestTrace& t) override { record("write_start", t); }
+    void on_write_complete(const RequestTrace& t) override { record("write_complete", t); }
+    void on_response_header(const RequestTrace& t) override { record("response_header", t); }
+    void on_decoded(const RequestTrace& t) override { record("decoded", t); }
+    void on_error(const RequestTrace& t, const std::error_code&) override { record("error", t); }
+
+    std::mutex                                          mu;
+    std::vector<std::pair<std::string, RequestTrace>>   events;
+
+private:
+    void record(const char* name, const RequestTrace& t)
+    {
+        std::lock_guard<std::mutex> lk(mu);
+        events.push_back(std::make_pair(name, t));
+    }
+};
+
+}
+
+TEST(ProducerClient, InterceptorSeesEachStep)
+{
+    int32_t port = 0;
+    std::atomic<int> produces(0);
+    MockBroker mock([&](const MockBroker::Request& r) {
+        if (r.api_key == ApiKey::MetadataRequest) {
+            return single_broker_meta(port);
+        }
+        auto err = (produces++ == 0) ? kafka_error::NoError : kafka_error::MessageSizeTooLarge;
+        proto::ProduceResponse resp{{proto::ProduceResponseTopic{"test", {proto::ProduceResponsePartition{0, make_error_code(err), 0}}}}};
+        return MockBroker::encode(resp);
+    });
+    port = mock.port();
+
+    auto interceptor = std::make_shared<RecordingInterceptor>();
+
+    ProducerClient client("127.0.0.1:" + std::to_string(port));
+    client.set_interceptor(interceptor);
+
+    MessageSet messages;
+    messages.push("test message", "");
+
+    ASSERT_FALSE(client.produce("test", 0, messages));
+
+    {
+        std::lock_guard<std::mutex> lk(interceptor->mu);
+
+        // Metadata requests aren't traced
+        std::vector<std::string> names;
+        for (auto& e : interceptor->events) {
+            names.push_back(e.first);
+        }
+        EXPECT_EQ((std::vector<std::string>{"enqueue", "encoded", "write_start", "write_complete", "response_header", "decoded"}), names);
+
+        for (auto& e : interceptor->events) {
+            EXPECT_EQ(interceptor->events[0].second.correlation_id, e.second.correlation_id) << e.first;
+            EXPECT_EQ(1, e.second.broker_id) << e.first;
+            EXPECT_EQ(ApiKey::ProduceRequest, e.second.api_key) << e.first;
+            EXPECT_EQ("test", e.second.topic) << e.first;
+            EXPECT_EQ(0, e.second.partition_id) << e.first;
+            EXPECT_GT(e.second.bytes, 0u) << e.first;
+        }
+
+        // Header adds to the body size
+        EXPECT_GT(interceptor->events[1].second.bytes, interceptor->events[0].second.bytes);
+
+        interceptor->events.clear();
+    }
+
+    EXPECT_EQ(kafka_error::MessageSizeTooLarge, client.produce("test", 0, messages));
+
+    {
+        std::lock_guard<std::mutex> lk(interceptor->mu);
+        ASSERT_FALSE(interceptor->events.empty());
+        EXPECT_EQ("error", interceptor->events.back().first);
+    }
+
+    client.close();
+}
+
+namespace {
+
+// Topic "test" with partition 0 led by broker 1 and partition 1 by broker 2
+std::string two_broker_meta(int32_t port1, int32_t port2)
+{
+    proto::MetadataResponse resp{{proto::Broker{1, "127.0.0.1", port1}, proto::Broker{2, "127.0.0.1", port2}}
+                                ,{proto::TopicMetaData{make_error_code(kafka_error::NoError)
+                                                      ,"test"
+                                                      ,{proto::PartitionMetaData{make_error_code(kafka_error::NoError), 0, 1, {1}, {1}}
+                                                       ,proto::PartitionMetaData{make_error_code(kafka_error::NoError), 1, 2, {2}, {2}}
+                                                       }
+                                                      }
+                                 }
+                                };
+    return MockBroker::encode(resp);
+}
+
+std::string produce_response(int32_t partition_id, kafka_error err)
+{
+    proto::ProduceResponse resp{{proto::ProduceResponseTopic{"test", {proto::ProduceResponsePartition{partition_id, make_error_code(err), 0}}}}};
+    return MockBroker::encode(resp);
+}
+
+}
+
+TEST(ProducerClient, ProduceAnyRoundRobinsAndFailsOver)
+{
+    int32_t port1 = 0, port2 = 0;
+    std::atomic<bool> broker2_leads(true);
+
+    MockBroker mock1([&](const MockBroker::Request& r) {
+        if (r.api_key == ApiKey::MetadataRequest) {
+            return two_broker_meta(port1, port2);
+        }
+        return produce_response(0, kafka_error::NoError);
+    });
+    MockBroker mock2([&](const MockBroker::Request& r) {
+        if (r.api_key == ApiKey::MetadataRequest) {
+            return two_broker_meta(port1, port2);
+        }
+        return produce_response(1, broker2_leads ? kafka_error::NoError : kafka_error::NotLeaderForPartition);
+    });
+    port1 = mock1.port();
+    port2 = mock2.port();
+
+    ProducerClient client("127.0.0.1:" + std::to_string(port1));
+
+    MessageSet messages;
+    messages.push("test message", "");
+
+    // Nothing connected to start with, both leaders get connected and then used in turn
+    std::vector<int32_t> chosen;
+    for (int i = 0; i < 4; ++i) {
+        int32_t partition_id = -1;
+        ASSERT_FALSE(client.produce_any("test", messages, PartitionPolicy::RoundRobin, &partition_id));
+        chosen.push_back(partition_id);
+    }
+    std::sort(chosen.begin(), chosen.end());
+    EXPECT_EQ((std::vector<int32_t>{0, 0, 1, 1}), chosen);
+
+    // Broker 2 loses leadership, anything sent to it is redirected to partition 0
+    broker2_leads = false;
+    for (int i = 0; i < 3; ++i) {
+        int32_t partition_id = -1;
+        ASSERT_FALSE(client.produce_any("test", messages, PartitionPolicy::RoundRobin, &partition_id));
+        EXPECT_EQ(0, partition_id);
+    }
+    // The two produces before and the one it turned away, once it did we stopped asking it
+    EXPECT_EQ(3, mock2.requests());
+
+    client.close();
+}
+
+TEST(ProducerClient, ProduceAnyFailsOverWithoutConcurrencySlot)
+{
+    int32_t port1 = 0, port2 = 0;
+    std::promise<void> release;
+    auto released = release.get_future().share();
+
+    MockBroker mock1([&](const MockBroker::Request& r) {
+        if (r.api_key == ApiKey::MetadataRequest) {
+            return two_broker_meta(port1, port2);
+        }
+        return produce_response(0, kafka_error::NoError);
+    });
+    MockBroker mock2([&](const MockBroker::Request& r) {
+        if (r.api_key == ApiKey::MetadataRequest) {
+            return two_broker_meta(port1, port2);
+        }
+        released.wait();
+        return produce_response(1, kafka_error::NoError);
+    });
+    port1 = mock1.port();
+    port2 = mock2.port();
+
+    ProducerClient client("127.0.0.1:" + std::to_string(port1));
+    client.set_adaptive_concurrency(true, 1, 1);
+    client.set_produce_timeout(200);
+    client.set_produce_timeout_rtt_allowance(100);
+
+    for (auto& ec : client.check_topic_partitions_leader_available({{"test", 0}, {"test", 1}})) {
+        ASSERT_FALSE(ec);
+    }
+
+    MessageSet messages;
+    messages.push("test message", "");
+
+    // Round robin starts with partition 0, then 1
+    int32_t partition_id = -1;
+    ASSERT_FALSE(client.produce_any("test", messages, PartitionPolicy::RoundRobin, &partition_id));
+    EXPECT_EQ(0, partition_id);
+
+    // Take broker 2's only slot until it times out
+    std::thread holder([&]() {
+        MessageSet held;
+        held.push("test message", "");
+        client.produce("test", 1, held);
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    auto broker2_requests = mock2.requests();
+
+    // Never got a slot on broker 2 so nothing was sent there and partition 0 can have it
+    EXPECT_FALSE(client.produce_any("test", messages, PartitionPolicy::RoundRobin, &partition_id));
+    EXPECT_EQ(0, partition_id);
+    EXPECT_EQ(broker2_requests, mock2.requests());
+
+    holder.join();
+    release.set_value();
+    client.close();
+}
+
+TEST(ProducerClient, ProduceAnySkipsDeadLeader)
+{
+    int32_t port1 = 0, port2 = 0;
+
+    {
+        // Nothing will be listening on broker 2's port
+        boost::asio::io_service io;
+        boost::asio::ip::tcp::acceptor acceptor(io, boost::asio::ip::tcp::endpoint(boost::asio::ip::address::from_string("127.0.0.1"), 0));
+        port2 = acceptor.local_endpoint().port();
+    }
+
+    MockBroker mock1([&](const MockBroker::Request& r) {
+        if (r.api_key == ApiKey::MetadataRequest) {
+            return two_broker_meta(port1, port2);
+        }
+        return produce_response(0, kafka_error::NoError);
+    });
+    port1 = mock1.port();
+
+    ProducerClient client("127.0.0.1:" + std::to_string(port1));
+    client.set_connect_timeout(100);
+    client.set_reconnect_backoff(10000, 10000);
+
+    MessageSet messages;
+    messages.push("test message", "");
+
+    // Broker 2 fails to connect and it's breaker opens so every produce goes to partition 0
+    for (int i = 0; i < 4; ++i) {
+        int32_t partition_id = -1;
+        ASSERT_FALSE(client.produce_any("test", messages, PartitionPolicy::RoundRobin, &partition_id));
+        EXPECT_EQ(0, partition_id);
+    }
+
+    // With broker 1 limited to one request a second there's nowhere left to send the second one
+    client.set_broker_rate_limit(0, 1);
+    EXPECT_FALSE(client.produce_any("test", messages));
+    EXPECT_EQ(synkafka_error::rate_limited, client.produce_any("test", messages));
+
+    client.close();
+}
+
+TEST(ProducerClient, ProduceAnyPrefersLowLatencyLeader)
+{
+    int32_t port1 = 0, port2 = 0;
+
+    MockBroker mock1([&](const MockBroker::Request& r) {
+        if (r.api_key == ApiKey::MetadataRequest) {
+            return two_broker_meta(port1, port2);
+        }
+        return produce_response(0, kafka_error::NoError);
+    });
+    MockBroker mock2([&](const MockBroker::Request& r) {
+        if (r.api_key == ApiKey::MetadataRequest) {
+            return two_broker_meta(port1, port2);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(30));
+        return produce_response(1, kafka_error::NoError);
+    });
+    port1 = mock1.port();
+    port2 = mock2.port();
+
+    ProducerClient client("127.0.0.1:" + std::to_string(port1));
+
+    MessageSet messages;
+    messages.push("test message", "");
+
+    // Give both brokers a latency
+    ASSERT_FALSE(client.produce("test", 0, messages));
+    ASSERT_FALSE(client.produce("test", 1, messages));
+
+    for (int i = 0; i < 5; ++i) {
+        int32_t partition_id = -1;
+        ASSERT_FALSE(client.produce_any("test", messages, PartitionPolicy::LowestLatency, &partition_id));
+        EXPECT_EQ(0, partition_id);
+    }
+
+    auto brokers = client.metrics().snapshot().brokers;
+    EXPECT_GT(brokers[2].latency_ewma_us, brokers[1].latency_ewma_us);
+
+    client.close();
+}
+
+TEST(ProducerClient, OpenBreakerFailsFastAndKeepsOtherMeta)
+{
+    int32_t port1 = 0;
+    int32_t dead_port;
+    {
+        boost::asio::io_service io;
+        boost::asio::ip::tcp::acceptor a(io, boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+        dead_port = a.local_endpoint().port();
+    }
+
+    // Broker 2, leader of partition 1, is down
+    MockBroker mock1([&](const MockBroker::Request& r) {
+        if (r.api_key == ApiKey::MetadataRequest) {
+            return two_broker_meta(port1, dead_port);
+        }
+        return produce_response(0, kafka_error::NoError);
+    });
+    port1 = mock1.port();
+
+    ProducerClient client("127.0.0.1:" + std::to_string(port1));
+    client.set_reconnect_backoff(10000, 60000);
+
+    MessageSet messages;
+    messages.push("test message", "");
+
+    EXPECT_EQ(synkafka_error::network_fail, client.produce("test", 1, messages));
+    EXPECT_EQ(synkafka_error::broker_unavailable, client.produce("test", 1, messages));
+    EXPECT_EQ(synkafka_error::broker_unavailable, client.produce("test", 1, messages));
+    EXPECT_EQ(2u, client.metrics().snapshot().breaker_rejections);
+
+    // Partition 0's leader is fine and we still know it without asking again
+    auto refreshes = client.metrics().snapshot().meta_refreshes;
+    EXPECT_FALSE(client.produce("test", 0, messages));
+    EXPECT_EQ(refreshes, client.metrics().snapshot().meta_refreshes);
+
+    client.close();
+}
+
+TEST(ProducerClient, TopicRateLimitFailsFastOrWaits)
+{
+    int32_t port = 0;
+    MockBroker mock([&](const MockBroker::Request& r) {
+        if (r.api_key == ApiKey::MetadataRequest) {
+            return single_broker_meta(port);
+        }
+        return produce_response(0, kafka_error::NoError);
+    });
+    port = mock.port();
+
+    ProducerClient client("127.0.0.1:" + std::to_string(port));
+    client.set_topic_rate_limit("test", 0, 2);
+
+    MessageSet messages;
+    messages.push("test message", "");
+
+    // Burst of one second's worth, then we're out
+    EXPECT_FALSE(client.produce("test", 0, messages));
+    EXPECT_FALSE(client.produce("test", 0, messages));
+    EXPECT_EQ(synkafka_error::rate_limited, client.produce("test", 0, messages));
+    EXPECT_EQ(0u, client.metrics().snapshot().rate_limit_delays);
+
+    // Willing to wait long enough for the next token
+    client.set_rate_limit_timeout(1000);
+    auto start = std::chrono::steady_clock::now();
+    EXPECT_FALSE(client.produce("test", 0, messages));
+    EXPECT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(300));
+
+    auto snapshot = client.metrics().snapshot();
+    EXPECT_EQ(1u, snapshot.rate_limit_delays);
+    EXPECT_GE(snapshot.rate_limit_wait_us, 300000u);
+
+    // Only produces to that topic are limited
+    EXPECT_EQ(kafka_error::UnknownTopicOrPartition, client.produce("other", 0, messages));
+
+    client.close();
+}
+
+TEST(ProducerClient, IdempotentProduceRetriesWithSameSequence)
+{
+    std::mutex mu;
+    std::vector<int32_t> sequences;
+    std::vector<int64_t> producer_ids;
+    int produce_calls = 0;
+    int32_t port = 0;
+
+    MockBroker mock([&](const MockBroker::Request& r) {
+        std::lock_guard<std::mutex> lk(mu);
+
+        if (r.api_key == ApiKey::MetadataRequest) {
+            proto::MetadataResponse resp{{proto::Broker{1, "127.0.0.1", port}}
+                                        ,{proto::TopicMetaData{make_error_code(kafka_error::NoError)
+                                                              ,"test"
+                                                              ,{proto::PartitionMetaData{make_error_code(kafka_error::NoError), 0, 1, {1}, {1}}}
+                                                              }
+                                         }
+                                        };
+            return MockBroker::encode(resp);
+        }
+
+        if (r.api_key == ApiKey::InitProducerIdRequest) {
+            proto::InitProducerIdResponse resp{0, make_error_code(kafka_error::NoError), 99, 0};
+            return MockBroker::encode(resp);
+        }
+
+        // Produce v3: null transactional id (2), acks (2), timeout (4), topic count (4), "test" (6),
+        // partition count (4), partition (4), record set length (4) then the batch
+        EXPECT_EQ(ApiKey::ProduceRequest, r.api_key);
+        EXPECT_EQ(3, r.api_version);
+
+        const size_t batch_start = 2 + 2 + 4 + 4 + 6 + 4 + 4 + 4;
+        uint64_t pid;
+        uint32_t seq;
+        std::memcpy(&pid, &r.body[batch_start + 43], sizeof(pid));
+        std::memcpy(&seq, &r.body[batch_start + 53], sizeof(seq));
+        producer_ids.push_back(static_cast<int64_t>(be64toh(pid)));
+        sequences.push_back(static_cast<int32_t>(be32toh(seq)));
+
+        // First attempt claims leadership moved so the client must resend
+        auto err = (produce_calls++ == 0) ? kafka_error::NotLeaderForPartition : kafka_error::NoError;
+
+        proto::ProduceResponseV3 resp{{proto::ProduceResponseTopicV3{"test", {proto::ProduceResponsePartitionV3{0, make_error_code(err), 0, -1}}}}, 0};
+        return MockBroker::encode(resp);
+    });
+
+    port = mock.port();
+
+    ProducerClient client("127.0.0.1:" + std::to_string(port));
+    client.set_idempotent(true);
+
+    MessageSet messages;
+    messages.push("test message", "");
+
+    EXPECT_FALSE(client.produce("test", 0, messages));
+    EXPECT_FALSE(client.produce("test", 0, messages));
+
+    std::lock_guard<std::mutex> lk(mu);
+    EXPECT_EQ((std::vector<int32_t>{0, 0, 1}), sequences);
+    EXPECT_EQ((std::vector<int64_t>{99, 99, 99}), producer_ids);
+    EXPECT_EQ(1u, client.metrics().snapshot().produce_retries);
+
+    client.close();
+}
+
+TEST(ProducerClient, IdempotentRetriesBackOffWithoutBroker)
+{
+    // Nothing listens on port 1 so every attempt fails to find a broker straight away
+    ProducerClient client("127.0.0.1:1");
+    client.set_connect_timeout(100);
+    client.set_idempotent(true, 3, 50);
+
+    MessageSet messages;
+    messages.push("test message", "");
+
+    auto start = std::chrono::steady_clock::now();
+    EXPECT_TRUE((bool)client.produce("test", 0, messages));
+    EXPECT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(150));
+
+    EXPECT_EQ(3u, client.metrics().snapshot().produce_retries);
+
+    client.close();
+}
+
+TEST(ProducerClient, IdempotentNeedsAllAcks)
+{
+    ProducerClient client("127.0.0.1:1");
+    client.set_idempotent(true);
+    client.set_required_acks(1);
+
+    MessageSet messages;
+    messages.push("test message", "");
+
+    EXPECT_EQ(synkafka_error::bad_config, client.produce("test", 0, messages));
+
+    client.close();
+}
+
+TEST(ProducerClient, CloseFailsWaitsOnSharedConnectionsPromptly)
+{
+    std::promise<void> release;
+    auto released = release.get_future().share();
+    std::atomic<int> produces(0);
+    int32_t port = 0;
+
+    // The second produce (client a's) isn't answered until we say so
+    MockBroker mock([&](const MockBroker::Request& r) {
+        if (r.api_key == ApiKey::MetadataRequest) {
+            return single_broker_meta(port);
+        }
+        if (++produces == 2) {
+            released.wait();
+        }
+        return produce_response(0, kafka_error::NoError);
+    });
+    port = mock.port();
+
+    boost::asio::io_service io_service;
+    std::unique_ptr<boost::asio::io_service::work> work(new boost::asio::io_service::work(io_service));
+    std::thread io_thread([&io_service]() { io_service.run(); });
+
+    ProducerClient a("127.0.0.1:" + std::to_string(port), io_service, true);
+    ProducerClient b("127.0.0.1:" + std::to_string(port), io_service, true);
+    a.set_produce_timeout(10000);
+
+    MessageSet messages;
+    messages.push("test message", "");
+
+    EXPECT_FALSE(b.produce("test", 0, messages));
+
+    std::error_code produce_ec;
+    std::thread producer([&]() {
+        produce_ec = a.produce("test", 0, messages);
+    });
+
+    // Wait for a's metadata request and produce to reach the broker
+    for (int i = 0; i < 500 && mock.requests() < 4; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    a.close();
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(2));
+
+    producer.join();
+    EXPECT_EQ(synkafka_error::client_stopping, produce_ec);
+
+    // The shared connection is still fine for b
+    release.set_value();
+    EXPECT_FALSE(b.produce("test", 0, messages));
+
+    b.close();
+    work.reset();
+    io_thread.join();
+}
+
+TEST(ProducerClient, LeaderMissingFromBrokersStopsClientWithoutHanging)
+{
+    int32_t port = 0;
+    MockBroker mock([&](const MockBroker::Request&) {
+        // Partition 0's leader isn't one of the brokers
+        proto::MetadataResponse resp{{proto::Broker{1, "127.0.0.1", port}}
+                                    ,{proto::TopicMetaData{make_error_code(kafka_error::NoError)
+                                                          ,"test"
+                                                          ,{proto::PartitionMetaData{make_error_code(kafka_error::NoError), 0, 5, {5}, {5}}}
+                                                          }
+                                     }
+                                    };
+        return MockBroker::encode(resp);
+    });
+    port = mock.port();
+
+    ProducerClient client("127.0.0.1:" + std::to_string(port));
+
+    MessageSet messages;
+    messages.push("test message", "");
+
+    EXPECT_THROW(client.produce("test", 0, messages), std::runtime_error);
+    EXPECT_EQ(synkafka_error::client_stopping, client.produce("test", 0, messages));
+
+    // Must not wait for the produce that threw
+    auto start = std::chrono::steady_clock::now();
+    client.close(1000);
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(500));
+}
+
+TEST(ProducerClient, SlowResponsesArentIdle)
+{
+    int32_t port = 0;
+    MockBroker mock([&](const MockBroker::Request& r) {
+        if (r.api_key == ApiKey::MetadataRequest) {
+            return single_broker_meta(port);
+        }
+        // Many times the idle timeout
+        std::this_thread::sleep_for(std::chrono::milliseconds(300));
+        return produce_response(0, kafka_error::NoError);
+    });
+    port = mock.port();
+
+    ProducerClient client("127.0.0.1:" + std::to_string(port));
+    client.set_connection_maintenance(50, 0);
+
+    MessageSet messages;
+    messages.push("test message", "");
+
+    EXPECT_FALSE(client.produce("test", 0, messages));
+    EXPECT_EQ(0u, client.metrics().snapshot().idle_connections_closed);
+
+    // Once nothing is waiting it is idle
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    EXPECT_EQ(1u, client.metrics().snapshot().idle_connections_closed);
+
+    client.close();
+}
+
+TEST(ProducerClient, CloseFailsProducesWaitingForConcurrencySlot)
+{
+    std::mutex mu;
+    std::condition_variable cv;
+    bool release = false;
+    int32_t port = 0;
+
+    MockBroker mock([&](const MockBroker::Request& r) {
+        if (r.api_key == ApiKey::MetadataRequest) {
+            return single_broker_meta(port);
+        }
+        // Never answer until the test is done
+        std::unique_lock<std::mutex> lk(mu);
+        cv.wait_for(lk, std::chrono::seconds(5), [&]() { return release; });
+        return std::string();
+    });
+    port = mock.port();
+
+    boost::asio::io_service io_service;
+    std::unique_ptr<boost::asio::io_service::work> work(new boost::asio::io_service::work(io_service));
+    std::thread io_thread([&io_service]() { io_service.run(); });
+
+    // Our own connections are closed to fail the waits, shared ones can't be
+    for (bool shared : {false, true}) {
+        std::unique_ptr<ProducerClient> client(shared ? new ProducerClient("127.0.0.1:" + std::to_string(port), io_service, true)
+                                                      : new ProducerClient("127.0.0.1:" + std::to_string(port)));
+        client->set_adaptive_concurrency(true, 1, 1);
+        ASSERT_FALSE(client->check_topic_partition_leader_available("test", 0));
+
+        // The first takes the only slot and waits for a response, the second waits for the slot
+        std::error_code produce_ec[2];
+        std::vector<std::thread> producers;
+        for (int i = 0; i < 2; ++i) {
+            producers.emplace_back([&, i]() {
+                MessageSet messages;
+                messages.push("test message", "");
+                produce_ec[i] = client->produce("test", 0, messages);
+            });
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        client->close(100);
+        for (auto& t : producers) {
+            t.join();
+        }
+        auto took = std::chrono::steady_clock::now() - start;
+
+        EXPECT_EQ(make_error_code(synkafka_error::client_stopping), produce_ec[0]) << "shared: " << shared;
+        EXPECT_EQ(make_error_code(synkafka_error::client_stopping), produce_ec[1]) << "shared: " << shared;
+        // Much less than the 10 second produce timeout
+        EXPECT_LT(took, std::chrono::seconds(2)) << "shared: " << shared;
+    }
+
+    {
+        std::lock_guard<std::mutex> lk(mu);
+        release = true;
+    }
+    cv.notify_all();
+
+    work.reset();
+    io_thread.join();
+}
+
+TEST(ProducerClient, CloseFailsProducesWaitingForRateLimit)
+{
+    int32_t port = 0;
+    MockBroker mock([&](const MockBroker::Request& r) {
+        if (r.api_key == ApiKey::MetadataRequest) {
+            return single_broker_meta(port);
+        }
+        return produce_response(0, kafka_error::NoError);
+    });
+    port = mock.port();
+
+    ProducerClient client("127.0.0.1:" + std::to_string(port));
+    client.set_topic_rate_limit("test", 1000, 0);
+    client.set_rate_limit_timeout(20000);
+
+    MessageSet small;
+    small.push("test message", "");
+    EXPECT_FALSE(client.produce("test", 0, small));
+
+    // Ten times the burst so it has to wait about ten seconds for tokens
+    std::error_code produce_ec;
+    std::string value(10000, 'v');
+    std::thread producer([&]() {
+        MessageSet big;
+        big.push(value, "");
+        produce_ec = client.produce("test", 0, big);
+    });
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    auto start = std::chrono::steady_clock::now();
+    client.close(100);
+    producer.join();
+    auto took = std::chrono::steady_clock::now() - start;
+
+    EXPECT_EQ(make_error_code(synkafka_error::client_stopping), produce_ec);
+    EXPECT_EQ(1u, client.metrics().snapshot().rate_limit_delays);
+    EXPECT_LT(took, std::chrono::seconds(2));
+}
+
+TEST(ProducerClient, TimeoutDoesntCloseSharedConnection)
+{
+    int32_t port = 0;
+    MockBroker mock([&](const MockBroker::Request& r) {
+        if (r.api_key == ApiKey::MetadataRequest) {
+            return single_broker_meta(port);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(300));
+        return produce_response(0, kafka_error::NoError);
+    });
+    port = mock.port();
+
+    boost::asio::io_service io_service;
+    std::unique_ptr<boost::asio::io_service::work> work(new boost::asio::io_service::work(io_service));
+    std::thread io_thread([&io_service]() { io_service.run(); });
+
+    ProducerClient a("127.0.0.1:" + std::to_string(port), io_service, true);
+    ProducerClient b("127.0.0.1:" + std::to_string(port), io_service, true);
+    a.set_produce_timeout(50);
+    a.set_produce_timeout_rtt_allowance(50);
+
+    ASSERT_FALSE(a.check_topic_partition_leader_available("test", 0));
+    ASSERT_FALSE(b.check_topic_partition_leader_available("test", 0));
+
+    std::error_code b_ec;
+    std::thread producer([&]() {
+        MessageSet messages;
+        messages.push("test message", "");
+        b_ec = b.produce("test", 0, messages);
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    // Queued behind b's slow produce so a gives up on it's own
+    MessageSet messages;
+    messages.push("test message", "");
+    EXPECT_EQ(synkafka_error::network_timeout, a.produce("test", 0, messages));
+
+    // Without taking b's request down with it
+    producer.join();
+    EXPECT_FALSE(b_ec) << b_ec.message();
+
+    a.close();
+    b.close();
+    work.reset();
+    io_thread.join();
+}
+
+TEST(ProducerClient, ShardedModeKeepsEachBrokerOnItsShard)
+{
+    // Partition n of "test" is led by the nth broker
+    std::vector<int32_t> node_ids{1, 2, 4};
+    std::vector<int32_t> ports;
+    auto meta = [&]() {
+        proto::MetadataResponse resp;
+        resp.topics.push_back(proto::TopicMetaData{make_error_code(kafka_error::NoError), "test", {}});
+        for (size_t i = 0; i < node_ids.size(); ++i) {
+            resp.brokers.push_back(proto::Broker{node_ids[i], "127.0.0.1", ports[i]});
+            resp.topics[0].partitions.push_back(proto::PartitionMetaData{make_error_code(kafka_error::NoError)
+                                                                        ,static_cast<int32_t>(i), node_ids[i]
+                                                                        ,{node_ids[i]}, {node_ids[i]}
+                                                                        });
+        }
+        return MockBroker::encode(resp);
+    };
+
+    std::vector<std::unique_ptr<MockBroker>> mocks;
+    for (size_t i = 0; i < node_ids.size(); ++i) {
+        mocks.emplace_back(new MockBroker([&, i](const MockBroker::Request& r) {
+            if (r.api_key == ApiKey::MetadataRequest) {
+                return meta();
+            }
+            return produce_response(static_cast<int32_t>(i), kafka_error::NoError);
+        }));
+    }
+    for (auto& m : mocks) {
+        ports.push_back(m->port());
+    }
+
+    // Which threads wrote requests to each broker
+    class ThreadInterceptor : public Interceptor
+    {
+    public:
+        void on_write_start(const RequestTrace& t) override
+        {
+            std::lock_guard<std::mutex> lk(mu);
+            threads[t.broker_id].insert(std::this_thread::get_id());
+        }
+
+        std::mutex                                          mu;
+        std::map<int32_t, std::set<std::thread::id>>        threads;
+    };
+    auto interceptor = std::make_shared<ThreadInterceptor>();
+
+    ProducerClient client("127.0.0.1:" + std::to_string(ports[0]), 3, IOThreadMode::ShardPerCore);
+    client.set_interceptor(interceptor);
+
+    MessageSet messages;
+    messages.push("test message", "");
+
+    for (int round = 0; round < 3; ++round) {
+        for (size_t i = 0; i < node_ids.size(); ++i) {
+            ASSERT_FALSE(client.produce("test", static_cast<int32_t>(i), messages));
+        }
+    }
+
+    std::lock_guard<std::mutex> lk(interceptor->mu);
+    for (auto id : node_ids) {
+        ASSERT_EQ(1u, interceptor->threads[id].size()) << "broker " << id << " handled on more than one thread";
+        EXPECT_EQ(0u, interceptor->threads[id].count(std::this_thread::get_id()));
+    }
+
+    // Shards are picked by node id modulo the number of shards: 1 and 4 share one, 2 has another
+    EXPECT_EQ(*interceptor->threads[1].begin(), *interceptor->threads[4].begin());
+    EXPECT_NE(*interceptor->threads[1].begin(), *interceptor->threads[2].begin());
+
+    client.close();
+}
+
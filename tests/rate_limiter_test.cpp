@@ -0,0 +1,47 @@
+#include "gtest/gtest.h"
+
+#include <chrono>
+
+#include "rate_limiter.h"
+
+using namespace synkafka;
+
+TEST(TokenBucket, BurstThenDebt)
+{
+    TokenBucket bucket(1000, 1000);
+
+    EXPECT_EQ(0, bucket.take(600).count());
+    EXPECT_EQ(0, bucket.take(400).count());
+
+    // 500 tokens short at 1000/s, a little under half a second since some will have trickled in
+    auto delay = bucket.take(500);
+    EXPECT_GT(delay, std::chrono::milliseconds(400));
+    EXPECT_LE(delay, std::chrono::milliseconds(501));
+
+    // Changed our mind, back to (about) empty
+    bucket.give_back(500);
+    EXPECT_LE(bucket.take(10), std::chrono::milliseconds(11));
+}
+
+TEST(TokenBucket, ZeroRateIsUnlimited)
+{
+    TokenBucket bucket(0, 0);
+
+    for (int i = 0; i < 10; ++i) {
+        EXPECT_EQ(0, bucket.take(1e9).count());
+    }
+}
+
+TEST(RateLimiter, WaitsForWhicheverLimitIsFurthestBehind)
+{
+    RateLimiter limit(1000, 10);
+
+    // Bytes are fine but we run out of requests
+    for (int i = 0; i < 10; ++i) {
+        EXPECT_EQ(0, limit.take(10).count());
+    }
+    EXPECT_GT(limit.take(10), std::chrono::milliseconds(50));
+
+    // Now bytes are further behind
+    EXPECT_GT(limit.take(2000), std::chrono::milliseconds(1000));
+}
@@ -0,0 +1,123 @@
+#include "gtest/gtest.h"
+
+#include <cstring>
+#include <limits>
+#include <string>
+
+#include "portable_endian.h"
+
+#include "message_set.h"
+#include "record_batch.h"
+
+using namespace synkafka;
+
+namespace {
+
+int32_t read_be32(const buffer_t& b, size_t offset)
+{
+    uint32_t v;
+    std::memcpy(&v, &b[offset], sizeof(v));
+    return static_cast<int32_t>(be32toh(v));
+}
+
+int64_t read_be64(const buffer_t& b, size_t offset)
+{
+    uint64_t v;
+    std::memcpy(&v, &b[offset], sizeof(v));
+    return static_cast<int64_t>(be64toh(v));
+}
+
+int16_t read_be16(const buffer_t& b, size_t offset)
+{
+    uint16_t v;
+    std::memcpy(&v, &b[offset], sizeof(v));
+    return static_cast<int16_t>(be16toh(v));
+}
+
+}
+
+TEST(RecordBatch, Crc32c)
+{
+    // Standard check value for CRC-32C
+    const std::string check("123456789");
+    EXPECT_EQ(0xE3069283u, crc32c(0, reinterpret_cast<const uint8_t*>(check.data()), check.size()));
+}
+
+TEST(RecordBatch, Varint)
+{
+    // Zig-zag encoded so small negative numbers stay small
+    std::vector<std::pair<int64_t, buffer_t>> cases{{0, {0x00}}
+                                                   ,{-1, {0x01}}
+                                                   ,{1, {0x02}}
+                                                   ,{63, {0x7E}}
+                                                   ,{-64, {0x7F}}
+                                                   ,{64, {0x80, 0x01}}
+                                                   ,{300, {0xD8, 0x04}}
+                                                   };
+
+    for (auto& c : cases) {
+        buffer_t out;
+        write_varint(out, c.first);
+        EXPECT_EQ(c.second, out) << "value " << c.first;
+        EXPECT_EQ(c.second.size(), varint_size(c.first)) << "value " << c.first;
+    }
+}
+
+TEST(RecordBatch, SequenceWraps)
+{
+    EXPECT_EQ(10, next_sequence(5, 5));
+    EXPECT_EQ(0, next_sequence(std::numeric_limits<int32_t>::max(), 1));
+    EXPECT_EQ(2, next_sequence(std::numeric_limits<int32_t>::max() - 1, 4));
+}
+
+TEST(RecordBatch, EncodeHeader)
+{
+    for (auto comp : {COMP_None, COMP_GZIP, COMP_Snappy}) {
+        MessageSet ms;
+        ms.set_compression(comp);
+        ms.push("hello", "key");
+        ms.push("world", "");
+
+        buffer_t batch;
+        ASSERT_FALSE(encode_record_batch(batch, ms, ProducerIdentity{1234, 5, 42}, 1500000000000));
+
+        ASSERT_GT(batch.size(), 61u);
+
+        EXPECT_EQ(0, read_be64(batch, 0)); // base offset
+        EXPECT_EQ(static_cast<int32_t>(batch.size() - 12), read_be32(batch, 8)); // batch length
+        EXPECT_EQ(-1, read_be32(batch, 12)); // leader epoch
+        EXPECT_EQ(2, batch[16]); // magic
+        EXPECT_EQ(static_cast<int16_t>(comp), read_be16(batch, 21)); // attributes
+        EXPECT_EQ(1, read_be32(batch, 23)); // last offset delta
+        EXPECT_EQ(1500000000000, read_be64(batch, 27)); // first timestamp
+        EXPECT_EQ(1500000000000, read_be64(batch, 35)); // max timestamp
+        EXPECT_EQ(1234, read_be64(batch, 43)); // producer id
+        EXPECT_EQ(5, read_be16(batch, 51)); // producer epoch
+        EXPECT_EQ(42, read_be32(batch, 53)); // base sequence
+        EXPECT_EQ(2, read_be32(batch, 57)); // record count
+
+        auto crc = static_cast<uint32_t>(read_be32(batch, 17));
+        EXPECT_EQ(crc32c(0, &batch[21], batch.size() - 21), crc) << "compression " << comp;
+    }
+}
+
+TEST(RecordBatch, EncodeRecords)
+{
+    MessageSet ms;
+    ms.push("hello", "key");
+
+    buffer_t batch;
+    ASSERT_FALSE(encode_record_batch(batch, ms, ProducerIdentity{1, 0, 0}, 0));
+
+    buffer_t expected_record{0x1C // length 14
+                            ,0x00 // attributes
+                            ,0x00 // timestamp delta
+                            ,0x00 // offset delta
+                            ,0x06, 'k', 'e', 'y' // key length 3
+                            ,0x0A, 'h', 'e', 'l', 'l', 'o' // value length 5
+                            ,0x00 // no headers
+                            };
+
+    ASSERT_EQ(61 + expected_record.size(), batch.size());
+    EXPECT_EQ(expected_record, buffer_t(batch.begin() + 61, batch.end()));
+}
@@ -0,0 +1,81 @@
+#include "gtest/gtest.h"
+
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "resolver_cache.h"
+
+using namespace synkafka;
+using boost::asio::ip::address_v4;
+
+namespace {
+
+std::vector<ResolverCache::endpoint_t> make_endpoints(int n)
+{
+    std::vector<ResolverCache::endpoint_t> eps;
+    for (int i = 0; i < n; ++i) {
+        eps.emplace_back(address_v4(0x7f000001 + i), 9092);
+    }
+    return eps;
+}
+
+}
+
+TEST(ResolverCache, LookupRotatesThroughAddresses)
+{
+    ResolverCache cache;
+    std::vector<ResolverCache::endpoint_t> eps;
+    boost::system::error_code ec;
+
+    EXPECT_FALSE(cache.lookup("kafka", "9092", eps, ec));
+
+    auto stored = make_endpoints(3);
+    cache.store("kafka", "9092", stored);
+
+    // The connection that stored the entry tries stored[0] first so lookups carry on from there
+    for (int i = 1; i <= 4; ++i) {
+        ASSERT_TRUE(cache.lookup("kafka", "9092", eps, ec));
+        EXPECT_FALSE(ec);
+        ASSERT_EQ(3u, eps.size());
+        EXPECT_EQ(stored[i % 3], eps[0]);
+        EXPECT_EQ(stored[(i + 1) % 3], eps[1]);
+        EXPECT_EQ(stored[(i + 2) % 3], eps[2]);
+    }
+
+    // Different port is a different entry
+    EXPECT_FALSE(cache.lookup("kafka", "9093", eps, ec));
+}
+
+TEST(ResolverCache, CachesFailures)
+{
+    ResolverCache cache;
+    std::vector<ResolverCache::endpoint_t> eps = make_endpoints(1);
+    boost::system::error_code ec;
+
+    cache.store_failure("nope", "9092", boost::asio::error::host_not_found);
+
+    ASSERT_TRUE(cache.lookup("nope", "9092", eps, ec));
+    EXPECT_EQ(boost::asio::error::host_not_found, ec);
+    EXPECT_TRUE(eps.empty());
+}
+
+TEST(ResolverCache, EntriesExpire)
+{
+    ResolverCache cache;
+    std::vector<ResolverCache::endpoint_t> eps;
+    boost::system::error_code ec;
+
+    cache.set_ttl(20, 0);
+    cache.store("kafka", "9092", make_endpoints(2));
+    cache.store_failure("nope", "9092", boost::asio::error::host_not_found);
+
+    EXPECT_TRUE(cache.lookup("kafka", "9092", eps, ec));
+    // Negative caching disabled
+    EXPECT_FALSE(cache.lookup("nope", "9092", eps, ec));
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(30));
+    EXPECT_FALSE(cache.lookup("kafka", "9092", eps, ec));
+}
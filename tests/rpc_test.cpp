@@ -57,4 +57,61 @@ TEST(RPC, Encoding)
     EXPECT_EQ(request_expected, enc_req)
         << "Expected: <" << request_expected.hex() << "> ("<< request_expected.size() << ")\n"
         << "Got:      <" << enc_req.hex() << "> ("<< enc_req.size() << ")";
-}
\ No newline at end of file
+}
+namespace {
+
+std::unique_ptr<RPC> make_rpc(int32_t seq)
+{
+    std::unique_ptr<RPC> rpc(new RPC(ApiKey::MetadataRequest, std::unique_ptr<PacketEncoder>(new PacketEncoder(10)), "tester"));
+    rpc->set_seq(seq);
+    return rpc;
+}
+
+}
+
+TEST(InFlightTable, OutOfOrderRemoval)
+{
+    InFlightTable t(4);
+
+    // Enough to make it grow, with ids that collide once masked and some that wrap negative
+    std::vector<int32_t> ids{0, 1, 2, 4, 8, 16, 3, -1, 2147483647, 100, 5, 6};
+    for (auto id : ids) {
+        t.insert(make_rpc(id));
+    }
+    EXPECT_EQ(ids.size(), t.size());
+
+    for (auto id : ids) {
+        ASSERT_NE(nullptr, t.find(id)) << id;
+        EXPECT_EQ(id, t.find(id)->get_seq());
+    }
+    EXPECT_EQ(nullptr, t.find(7));
+    EXPECT_EQ(nullptr, t.remove(7));
+
+    // Remove in a different order, everything left must stay reachable after each shift
+    std::vector<int32_t> order{4, 0, 100, -1, 16, 2, 3, 8, 6, 1, 2147483647, 5};
+    for (size_t i = 0; i < order.size(); ++i) {
+        auto rpc = t.remove(order[i]);
+        ASSERT_NE(nullptr, rpc) << order[i];
+        EXPECT_EQ(order[i], rpc->get_seq());
+        EXPECT_EQ(nullptr, t.find(order[i]));
+
+        for (size_t j = i + 1; j < order.size(); ++j) {
+            EXPECT_NE(nullptr, t.find(order[j])) << "lost " << order[j] << " after removing " << order[i];
+        }
+    }
+
+    EXPECT_TRUE(t.empty());
+}
+
+TEST(InFlightTable, TakeAll)
+{
+    InFlightTable t;
+    for (int32_t i = 0; i < 10; ++i) {
+        t.insert(make_rpc(i));
+    }
+
+    auto all = t.take_all();
+    EXPECT_EQ(10u, all.size());
+    EXPECT_TRUE(t.empty());
+    EXPECT_EQ(nullptr, t.find(3));
+}